@@ -4,13 +4,16 @@
 
 #include "Camera.hpp"
 
-Camera::Camera() : position(glm::vec3(0, 0, 0)), direction(glm::vec3(0, 0, 1)),
-    u(glm::cross(glm::vec3(0, 1, 0), direction)),
-    v(glm::cross(direction, u)), near(0.1f), far(1000.0f), fov(90.0f) {}
+#include <cmath>
+
+Camera::Camera() : position(glm::vec3(0, 0, 0)), near(0.1f), far(1000.0f), fov(90.0f) {
+    setBasis(glm::vec3(0, 0, 1), glm::vec3(0, 1, 0));
+}
 
 Camera::Camera(glm::vec3 position, glm::vec3 direction, glm::vec3 up, float near, float far, float fov)
-    : position(position), direction(direction), u(glm::cross(up, direction)), v(glm::cross(direction, u)),
-    near(near), far(far), fov(fov) {}
+    : position(position), near(near), far(far), fov(fov) {
+    setBasis(direction, up);
+}
 
 glm::vec3 Camera::getPosition() const { return this->position; }
 
@@ -28,10 +31,20 @@ float Camera::getFov() const { return this->fov; }
 
 void Camera::setPosition(glm::vec3 position) { this->position = position; }
 
-void Camera::setDirection(glm::vec3 direction) {
-    this->direction = direction;
-    this->u = glm::cross(glm::vec3(0, 1, 0), direction);
-    this->v = glm::cross(direction, u);
+void Camera::setDirection(glm::vec3 direction) { setBasis(direction, glm::vec3(0, 1, 0)); }
+
+// The shaders invert the ray generation by projecting onto the basis vectors, which only works for an orthonormal
+// basis, so direction and side are normalized. Looking straight along up keeps the side vector as far as possible.
+void Camera::setBasis(glm::vec3 direction, glm::vec3 up) {
+    this->direction = glm::normalize(direction);
+    glm::vec3 side = glm::cross(up, this->direction);
+    if (glm::dot(side, side) <= 1e-12f)
+        side = this->u - this->direction * glm::dot(this->u, this->direction);
+    if (glm::dot(side, side) <= 1e-12f)
+        side = glm::cross(std::abs(this->direction.x) < 0.9f ? glm::vec3(1, 0, 0) : glm::vec3(0, 1, 0),
+                          this->direction);
+    this->u = glm::normalize(side);
+    this->v = glm::cross(this->direction, this->u);
 }
 
 void Camera::setNear(float near) { this->near = near; }
@@ -64,4 +77,11 @@ glm::mat4 Camera::getRotationMatrix() {
     rotationMatrix[1][2] = z.y;
     rotationMatrix[2][2] = z.z;
     return rotationMatrix;
-}
\ No newline at end of file
+}
+
+bool Camera::isValidOrientation(glm::vec3 direction, glm::vec3 up) {
+    const float directionLength = glm::length(direction);
+    const float upLength = glm::length(up);
+    return std::isfinite(directionLength) && std::isfinite(upLength) && directionLength > 0.0f && upLength > 0.0f &&
+           glm::length(glm::cross(direction, up)) > 1e-4f * directionLength * upLength;
+}
@@ -19,6 +19,8 @@ class Camera {
     float far;
     float fov;
 
+    void setBasis(glm::vec3 direction, glm::vec3 up);
+
 public:
     Camera();
     Camera(glm::vec3 position, glm::vec3 direction, glm::vec3 up, float near, float far, float fov);
@@ -40,6 +42,9 @@ public:
     void move(glm::vec3 delta);
     void rotate(float angleX, float angleY);
     glm::mat4 getRotationMatrix();
+
+    // a basis can only be built from a direction and an up vector which are finite and not parallel
+    static bool isValidOrientation(glm::vec3 direction, glm::vec3 up);
 };
 
 
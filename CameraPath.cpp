@@ -0,0 +1,107 @@
+//
+// Keyframed camera animation. Positions follow a Catmull-Rom spline through the keyframes, orientations are
+// interpolated by quaternion slerp and the field of view linearly.
+//
+
+#include "CameraPath.hpp"
+
+#include <algorithm>
+#include <cmath>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+
+namespace {
+    // uniform Catmull-Rom segment between p1 and p2
+    glm::vec3 catmullRom(const glm::vec3 &p0, const glm::vec3 &p1, const glm::vec3 &p2, const glm::vec3 &p3, float t) {
+        const float t2 = t * t;
+        const float t3 = t2 * t;
+        return 0.5f * (2.0f * p1 + (p2 - p0) * t + (2.0f * p0 - 5.0f * p1 + 4.0f * p2 - p3) * t2 +
+                       (3.0f * p1 - p0 - 3.0f * p2 + p3) * t3);
+    }
+}
+
+bool CameraPath::load(const std::string &fileName) {
+    std::ifstream file(fileName);
+    if (!file) {
+        std::cerr << "Could not open camera path " << fileName << std::endl;
+        return false;
+    }
+
+    size_t lineNumber = 0;
+    for (std::string line; std::getline(file, line);) {
+        ++lineNumber;
+        if (line.find_first_not_of(" \t\r") == std::string::npos || line[line.find_first_not_of(" \t")] == '#')
+            continue;
+
+        std::istringstream values(line);
+        Keyframe keyframe{};
+        values >> keyframe.time >> keyframe.position.x >> keyframe.position.y >> keyframe.position.z
+               >> keyframe.direction.x >> keyframe.direction.y >> keyframe.direction.z
+               >> keyframe.up.x >> keyframe.up.y >> keyframe.up.z >> keyframe.fov;
+        if (!values || (!keyframes.empty() && keyframe.time <= keyframes.back().time)) {
+            std::cerr << fileName << ":" << lineNumber << ": expected time px py pz dx dy dz ux uy uz fov with "
+                      << "increasing time" << std::endl;
+            return false;
+        }
+        // the orientation is built from direction and up like a Camera
+        if (!std::isfinite(keyframe.time) ||
+            !std::isfinite(keyframe.position.x + keyframe.position.y + keyframe.position.z) ||
+            !Camera::isValidOrientation(keyframe.direction, keyframe.up) ||
+            !(keyframe.fov > 0.0f && keyframe.fov < 180.0f)) {
+            std::cerr << fileName << ":" << lineNumber << ": values must be finite, direction and up non-zero and not "
+                      << "parallel and fov between 0 and 180 degrees" << std::endl;
+            return false;
+        }
+        addKeyframe(keyframe);
+    }
+
+    if (keyframes.empty()) {
+        std::cerr << "Camera path " << fileName << " has no keyframes" << std::endl;
+        return false;
+    }
+    return true;
+}
+
+void CameraPath::addKeyframe(const Keyframe &keyframe) {
+    // same handedness as Camera: right = up x direction
+    const glm::vec3 direction = glm::normalize(keyframe.direction);
+    const glm::vec3 right = glm::normalize(glm::cross(keyframe.up, direction));
+    const glm::vec3 up = glm::cross(direction, right);
+    glm::quat orientation = glm::quat_cast(glm::mat3(right, up, direction));
+
+    // q and -q are the same rotation, the one closer to the previous keyframe avoids turning the long way round
+    if (!orientations.empty() && glm::dot(orientations.back(), orientation) < 0.0f)
+        orientation = -orientation;
+
+    keyframes.push_back(keyframe);
+    orientations.push_back(orientation);
+}
+
+const std::vector<CameraPath::Keyframe> &CameraPath::getKeyframes() const {
+    return keyframes;
+}
+
+float CameraPath::getDuration() const {
+    return keyframes.empty() ? 0.0f : keyframes.back().time;
+}
+
+Camera CameraPath::evaluate(float time, float near, float far) const {
+    // first keyframe at or after time, the segment ends there
+    const auto next = std::lower_bound(keyframes.begin(), keyframes.end(), time,
+                                       [](const Keyframe &keyframe, float t) { return keyframe.time < t; });
+    const size_t i2 = std::min(static_cast<size_t>(next - keyframes.begin()), keyframes.size() - 1);
+    const size_t i1 = i2 > 0 ? i2 - 1 : 0;
+    const size_t i0 = i1 > 0 ? i1 - 1 : 0;
+    const size_t i3 = std::min(i2 + 1, keyframes.size() - 1);
+
+    const float segment = keyframes[i2].time - keyframes[i1].time;
+    const float t = segment > 0.0f ? std::clamp((time - keyframes[i1].time) / segment, 0.0f, 1.0f) : 1.0f;
+
+    const glm::vec3 position = catmullRom(keyframes[i0].position, keyframes[i1].position, keyframes[i2].position,
+                                          keyframes[i3].position, t);
+    const glm::mat3 basis = glm::mat3_cast(glm::slerp(orientations[i1], orientations[i2], t));
+    const float fov = keyframes[i1].fov + (keyframes[i2].fov - keyframes[i1].fov) * t;
+
+    return {position, glm::normalize(basis[2]), glm::normalize(basis[1]), near, far, fov};
+}
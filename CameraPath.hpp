@@ -0,0 +1,45 @@
+//
+// Keyframed camera animation. Positions follow a Catmull-Rom spline through the keyframes, orientations are
+// interpolated by quaternion slerp and the field of view linearly.
+//
+
+#ifndef PATHTRACER_CAMERAPATH_HPP
+#define PATHTRACER_CAMERAPATH_HPP
+
+#include <string>
+#include <vector>
+
+#include "Camera.hpp"
+
+class CameraPath {
+public:
+    struct Keyframe {
+        float time; // seconds
+        glm::vec3 position;
+        glm::vec3 direction;
+        glm::vec3 up;
+        float fov;  // degrees
+    };
+
+    // One keyframe per line: time px py pz dx dy dz ux uy uz fov, lines starting with # are comments. Keyframes
+    // must be in increasing order of time. Returns false if the file can't be read, holds no keyframe or a keyframe
+    // whose direction and up vector can't form a basis.
+    bool load(const std::string &fileName);
+
+    // the keyframe must have a valid orientation, see Camera::isValidOrientation
+    void addKeyframe(const Keyframe &keyframe);
+
+    const std::vector<Keyframe> &getKeyframes() const;
+
+    // time of the last keyframe
+    float getDuration() const;
+
+    // camera at the given time, before the first and after the last keyframe the camera stands still
+    Camera evaluate(float time, float near, float far) const;
+
+private:
+    std::vector<Keyframe> keyframes;
+    std::vector<glm::quat> orientations; // rotation from camera space (x: right, y: up, z: view direction)
+};
+
+#endif //PATHTRACER_CAMERAPATH_HPP
@@ -0,0 +1,154 @@
+//
+// Equal-time convergence measurement: error of the accumulated image against a high sample reference after fixed
+// render time budgets, compared with the curve of an earlier run
+//
+
+#include "ConvergenceTest.hpp"
+
+#include <algorithm>
+#include <cmath>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <utility>
+
+namespace {
+    const double relMseOffset = 0.01; // keeps the relative error of almost black reference pixels finite
+}
+
+ConvergenceTest::ConvergenceTest(std::string referenceFile, std::vector<double> timeBudgets)
+        : referenceFile(std::move(referenceFile)), timeBudgets(std::move(timeBudgets)) {
+    std::sort(this->timeBudgets.begin(), this->timeBudgets.end());
+}
+
+bool ConvergenceTest::isActive() const {
+    return !referenceFile.empty() && !timeBudgets.empty();
+}
+
+bool ConvergenceTest::loadReference(uint32_t width, uint32_t height) {
+    if (!pfm::read(referenceFile, reference) || reference.channels != 3) {
+        std::cerr << "Could not read RGB reference image " << referenceFile << std::endl;
+        return false;
+    }
+    if (reference.width != width || reference.height != height) {
+        std::cerr << "Reference image is " << reference.width << "x" << reference.height << " but the render is "
+                  << width << "x" << height << std::endl;
+        return false;
+    }
+    return true;
+}
+
+void ConvergenceTest::start() {
+    startTime = Clock::now();
+    pausedDuration = Clock::duration::zero();
+    paused = false;
+    curve.clear();
+}
+
+void ConvergenceTest::pause() {
+    pauseTime = Clock::now();
+    paused = true;
+}
+
+void ConvergenceTest::resume() {
+    pausedDuration += Clock::now() - pauseTime;
+    paused = false;
+}
+
+double ConvergenceTest::getRenderTime() const {
+    const Clock::time_point now = paused ? pauseTime : Clock::now();
+    return std::chrono::duration<double>(now - startTime - pausedDuration).count();
+}
+
+bool ConvergenceTest::checkpointDue() const {
+    return !finished() && getRenderTime() >= timeBudgets[curve.size()];
+}
+
+bool ConvergenceTest::finished() const {
+    return curve.size() >= timeBudgets.size();
+}
+
+void ConvergenceTest::addCheckpoint(uint32_t samples, const glm::vec4 *color) {
+    const size_t pixelCount = static_cast<size_t>(reference.width) * reference.height;
+
+    double squaredErrorSum = 0;
+    double relativeErrorSum = 0;
+    for (size_t i = 0; i < pixelCount; ++i) {
+        for (int c = 0; c < 3; ++c) {
+            const double expected = reference.pixels[3 * i + c];
+            const double error = static_cast<double>(color[i][c]) - expected;
+            squaredErrorSum += error * error;
+            relativeErrorSum += error * error / (expected * expected + relMseOffset);
+        }
+    }
+
+    const double valueCount = 3.0 * static_cast<double>(pixelCount);
+    curve.push_back({timeBudgets[curve.size()], getRenderTime(), samples,
+                     std::sqrt(squaredErrorSum / valueCount), relativeErrorSum / valueCount});
+
+    const Point &point = curve.back();
+    std::cout << "Convergence after " << point.time << " s, " << point.samples << " spp: RMSE " << point.rmse
+              << ", relMSE " << point.relMse << std::endl;
+}
+
+bool ConvergenceTest::writeCurve(const std::string &fileName) const {
+    std::ofstream file(fileName);
+    if (!file) {
+        std::cerr << "Could not open file for writing" << std::endl;
+        return false;
+    }
+
+    file << "budget,time,samples,rmse,relmse\n";
+    for (const auto &point: curve)
+        file << point.budget << "," << point.time << "," << point.samples << "," << point.rmse << ","
+             << point.relMse << "\n";
+    return static_cast<bool>(file);
+}
+
+bool ConvergenceTest::readCurve(const std::string &fileName, std::vector<Point> &curve) {
+    std::ifstream file(fileName);
+    std::string line;
+    if (!file || !std::getline(file, line)) // header
+        return false;
+
+    while (std::getline(file, line)) {
+        std::istringstream values(line);
+        Point point{};
+        char separator;
+        if (values >> point.budget >> separator >> point.time >> separator >> point.samples >> separator
+                   >> point.rmse >> separator >> point.relMse)
+            curve.push_back(point);
+    }
+    return true;
+}
+
+// Points are matched by budget. Timing varies between runs, so only errors above the tolerance count as regression.
+bool ConvergenceTest::compareToBaseline(const std::string &fileName, double tolerance) const {
+    std::vector<Point> baseline;
+    if (!readCurve(fileName, baseline)) {
+        std::cerr << "Could not read baseline curve " << fileName << std::endl;
+        return false;
+    }
+
+    bool passed = true;
+    for (const auto &expected: baseline) {
+        const auto point = std::find_if(curve.begin(), curve.end(), [&](const Point &p) {
+            return std::abs(p.budget - expected.budget) < 1e-6;
+        });
+        if (point == curve.end()) {
+            std::cerr << "No measurement for the baseline budget of " << expected.budget << " s" << std::endl;
+            passed = false;
+            continue;
+        }
+
+        const bool regressed = point->rmse > expected.rmse * (1.0 + tolerance) ||
+                               point->relMse > expected.relMse * (1.0 + tolerance);
+        std::cout << (regressed ? "REGRESSION" : "ok") << " at " << expected.budget << " s: RMSE " << point->rmse
+                  << " (baseline " << expected.rmse << "), relMSE " << point->relMse << " (baseline "
+                  << expected.relMse << ")" << std::endl;
+        passed = passed && !regressed;
+    }
+    return passed;
+}
+
+const std::vector<ConvergenceTest::Point> &ConvergenceTest::getCurve() const { return curve; }
@@ -0,0 +1,74 @@
+//
+// Equal-time convergence measurement: error of the accumulated image against a high sample reference after fixed
+// render time budgets, compared with the curve of an earlier run
+//
+
+#ifndef PATHTRACER_CONVERGENCETEST_HPP
+#define PATHTRACER_CONVERGENCETEST_HPP
+
+#include <chrono>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "glm/glm.hpp"
+#include "Pfm.hpp"
+
+class ConvergenceTest {
+public:
+    struct Point {
+        double budget;     // seconds of render time the point was scheduled at
+        double time;       // seconds of render time actually spent, at least the budget
+        uint32_t samples;  // samples per pixel
+        double rmse;
+        double relMse;     // squared error relative to the squared reference value
+    };
+
+    ConvergenceTest() = default;
+
+    // timeBudgets in seconds, measurement starts with start()
+    ConvergenceTest(std::string referenceFile, std::vector<double> timeBudgets);
+
+    bool isActive() const;
+
+    // false if the reference can't be read or doesn't have the size of the rendered image
+    bool loadReference(uint32_t width, uint32_t height);
+
+    void start();
+
+    // time spent reading back and evaluating the image doesn't count as render time
+    void pause();
+    void resume();
+
+    bool checkpointDue() const;
+    bool finished() const;
+
+    // color holds width * height pixels of the accumulated image, called while paused
+    void addCheckpoint(uint32_t samples, const glm::vec4 *color);
+
+    bool writeCurve(const std::string &fileName) const;
+
+    // false if the error at any budget of the baseline curve grew by more than the relative tolerance
+    bool compareToBaseline(const std::string &fileName, double tolerance) const;
+
+    const std::vector<Point> &getCurve() const;
+
+private:
+    using Clock = std::chrono::steady_clock;
+
+    double getRenderTime() const;
+
+    static bool readCurve(const std::string &fileName, std::vector<Point> &curve);
+
+    std::string referenceFile;
+    std::vector<double> timeBudgets;  // ascending
+    pfm::Image reference;
+    std::vector<Point> curve;
+
+    Clock::time_point startTime;
+    Clock::time_point pauseTime;
+    Clock::duration pausedDuration{};
+    bool paused = false;
+};
+
+#endif //PATHTRACER_CONVERGENCETEST_HPP
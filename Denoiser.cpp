@@ -0,0 +1,112 @@
+//
+// Edge-aware à-trous wavelet filter guided by first hit albedo and normal, runs on the CPU
+//
+
+#include "Denoiser.hpp"
+
+#include <algorithm>
+#include <cmath>
+#include <functional>
+#include <thread>
+
+namespace {
+    // B3 spline kernel of the à-trous wavelet transform
+    const float kernel[5] = {1.0f / 16.0f, 1.0f / 4.0f, 3.0f / 8.0f, 1.0f / 4.0f, 1.0f / 16.0f};
+
+    const float initialColorPhi = 0.5f; // tolerated squared color difference relative to luminance, halved every pass
+    const float normalExponent = 64.0f; // sharpness of the normal edge stop
+    const float albedoPhi = 0.01f;      // tolerated squared albedo difference
+    const float minAlbedo = 1e-3f;
+
+    float luminance(const glm::vec3 &color) {
+        return glm::dot(color, glm::vec3(0.2126f, 0.7152f, 0.0722f));
+    }
+
+    // Lighting is filtered without the surface color so textures and material edges stay sharp. Channels without
+    // reflectance, e.g. of pure emitters or pixels without a hit, are filtered as they are.
+    glm::vec3 demodulationFactor(const glm::vec4 &albedo) {
+        const glm::vec3 reflectance(albedo);
+        return glm::mix(reflectance, glm::vec3(1.0f), glm::lessThan(reflectance, glm::vec3(minAlbedo)));
+    }
+}
+
+Denoiser::Denoiser(uint32_t iterations) : iterations(iterations) {}
+
+std::vector<glm::vec4> Denoiser::denoise(const glm::vec4 *color, const glm::vec4 *albedo, const glm::vec4 *normal,
+                                         uint32_t width, uint32_t height) const {
+    const size_t pixelCount = static_cast<size_t>(width) * height;
+    const Guide guide{albedo, normal, width, height};
+
+    std::vector<glm::vec3> irradiance(pixelCount);
+    std::vector<glm::vec3> filtered(pixelCount);
+    for (size_t i = 0; i < pixelCount; ++i)
+        irradiance[i] = glm::vec3(color[i]) / demodulationFactor(albedo[i]);
+
+    // every pass is split into bands of rows, one per hardware thread
+    const uint32_t threadCount = std::max(1u, std::thread::hardware_concurrency());
+    const uint32_t rowsPerThread = (height + threadCount - 1) / threadCount;
+
+    float colorPhi = initialColorPhi;
+    for (uint32_t iteration = 0; iteration < iterations; ++iteration) {
+        std::vector<std::thread> threads;
+        for (uint32_t firstRow = 0; firstRow < height; firstRow += rowsPerThread)
+            threads.emplace_back(filterRows, std::cref(guide), std::cref(irradiance), std::ref(filtered),
+                                 1u << iteration, colorPhi, firstRow, std::min(height, firstRow + rowsPerThread));
+        for (auto &thread: threads)
+            thread.join();
+
+        std::swap(irradiance, filtered);
+        colorPhi *= 0.5f;
+    }
+
+    std::vector<glm::vec4> result(pixelCount);
+    for (size_t i = 0; i < pixelCount; ++i)
+        result[i] = glm::vec4(irradiance[i] * demodulationFactor(albedo[i]), 1.0f);
+    return result;
+}
+
+void Denoiser::filterRows(const Guide &guide, const std::vector<glm::vec3> &input, std::vector<glm::vec3> &output,
+                          uint32_t step, float colorPhi, uint32_t firstRow, uint32_t lastRow) {
+    const auto width = static_cast<int64_t>(guide.width);
+    const auto height = static_cast<int64_t>(guide.height);
+
+    for (int64_t y = firstRow; y < lastRow; ++y) {
+        for (int64_t x = 0; x < width; ++x) {
+            const int64_t p = y * width + x;
+            const glm::vec3 colorP = input[p];
+            const glm::vec3 normalP(guide.normal[p]);
+            const glm::vec3 albedoP(guide.albedo[p]);
+            // relative to the brightness of the pixel, so bright outliers are smoothed but not spread into dark areas
+            const float colorScale = colorPhi * (luminance(colorP) * luminance(colorP) + 1e-4f);
+
+            glm::vec3 sum(0.0f);
+            float weightSum = 0.0f;
+            for (int64_t dy = -2; dy <= 2; ++dy) {
+                const int64_t qy = y + dy * step;
+                if (qy < 0 || qy >= height) continue;
+
+                for (int64_t dx = -2; dx <= 2; ++dx) {
+                    const int64_t qx = x + dx * step;
+                    if (qx < 0 || qx >= width) continue;
+
+                    const int64_t q = qy * width + qx;
+                    float weight = kernel[dy + 2] * kernel[dx + 2];
+                    if (q != p) {
+                        const glm::vec3 colorDifference = colorP - input[q];
+                        const glm::vec3 albedoDifference = albedoP - glm::vec3(guide.albedo[q]);
+                        // pixels without a hit have a zero normal and are never mixed with others
+                        weight *= std::pow(std::max(0.0f, glm::dot(normalP, glm::vec3(guide.normal[q]))),
+                                           normalExponent);
+                        weight *= std::exp(-glm::dot(colorDifference, colorDifference) / colorScale);
+                        weight *= std::exp(-glm::dot(albedoDifference, albedoDifference) / albedoPhi);
+                    }
+
+                    sum += input[q] * weight;
+                    weightSum += weight;
+                }
+            }
+
+            output[p] = sum / weightSum;
+        }
+    }
+}
@@ -0,0 +1,37 @@
+//
+// Edge-aware à-trous wavelet filter guided by first hit albedo and normal, runs on the CPU
+//
+
+#ifndef PATHTRACER_DENOISER_HPP
+#define PATHTRACER_DENOISER_HPP
+
+#include <cstdint>
+#include <vector>
+
+#include "glm/glm.hpp"
+
+class Denoiser {
+public:
+    // iterations: number of filter passes, pass i samples pixels 2^i apart
+    explicit Denoiser(uint32_t iterations);
+
+    // color, albedo and normal hold width * height pixels in row major order, normals of pixels without a hit are 0
+    std::vector<glm::vec4> denoise(const glm::vec4 *color, const glm::vec4 *albedo, const glm::vec4 *normal,
+                                   uint32_t width, uint32_t height) const;
+
+private:
+    struct Guide {
+        const glm::vec4 *albedo;
+        const glm::vec4 *normal;
+        uint32_t width;
+        uint32_t height;
+    };
+
+    // filter rows [firstRow, lastRow) of one pass
+    static void filterRows(const Guide &guide, const std::vector<glm::vec3> &input, std::vector<glm::vec3> &output,
+                           uint32_t step, float colorPhi, uint32_t firstRow, uint32_t lastRow);
+
+    uint32_t iterations;
+};
+
+#endif //PATHTRACER_DENOISER_HPP
@@ -0,0 +1,237 @@
+//
+// Bounding volume hierarchy over the emissive triangles of the scene. Every node bounds the position, the normal
+// directions and the emitted power of the triangles below it, so the shaders can pick a light which is likely to
+// contribute much to a shading point in O(log n).
+//
+
+#include "LightTree.hpp"
+
+#include <algorithm>
+#include <cmath>
+
+namespace {
+    const uint32_t binCount = 12; // split candidates per axis are the borders between bins of equal width
+    const float pi = 3.14159265358979323846f;
+
+    float luminance(const glm::vec3 &color) {
+        return glm::dot(color, glm::vec3(0.2126f, 0.7152f, 0.0722f));
+    }
+}
+
+bool LightTree::Bounds::isEmpty() const {
+    return glm::dot(axis, axis) == 0.0f;
+}
+
+// Cones are merged like in Kulla and Conty, "Importance Sampling of Many Lights with Adaptive Tree Splitting", with
+// the difference that lights emit on both sides: a cone and its mirror image bound the same set of lights, so no
+// cone has to open wider than a hemisphere.
+void LightTree::Bounds::extend(const Bounds &other) {
+    if (other.isEmpty())
+        return;
+    min = glm::min(min, other.min);
+    max = glm::max(max, other.max);
+    power += other.power;
+    if (isEmpty()) {
+        axis = other.axis;
+        cosSpread = other.cosSpread;
+        return;
+    }
+
+    const glm::vec3 otherAxis = glm::dot(axis, other.axis) < 0.0f ? -other.axis : other.axis;
+    const float spread = std::acos(std::clamp(cosSpread, -1.0f, 1.0f));
+    const float otherSpread = std::acos(std::clamp(other.cosSpread, -1.0f, 1.0f));
+    const float between = std::acos(std::clamp(glm::dot(axis, otherAxis), -1.0f, 1.0f));
+    if (between + otherSpread <= spread)
+        return;
+    if (between + spread <= otherSpread) {
+        axis = otherAxis;
+        cosSpread = other.cosSpread;
+        return;
+    }
+
+    // the merged cone touches the far sides of both cones, its axis lies on the arc between the two axes
+    const float mergedSpread = 0.5f * (spread + between + otherSpread);
+    const glm::vec3 rotationAxis = glm::cross(axis, otherAxis);
+    if (mergedSpread >= 0.5f * pi || glm::dot(rotationAxis, rotationAxis) < 1e-12f) {
+        cosSpread = std::max(0.0f, std::cos(std::max(spread, otherSpread) + between));
+        return;
+    }
+    const float rotation = mergedSpread - spread;
+    axis = glm::normalize(axis * std::cos(rotation) +
+                          glm::cross(glm::normalize(rotationAxis), axis) * std::sin(rotation));
+    cosSpread = std::cos(mergedSpread);
+}
+
+float LightTree::Bounds::surfaceArea() const {
+    const glm::vec3 extent = max - min;
+    return 2.0f * (extent.x * extent.y + extent.y * extent.z + extent.z * extent.x);
+}
+
+// Solid angle measure of the directions light can leave the node in, for emitters which emit into the hemisphere
+// around their normal. Grows from pi for a single triangle to 2 pi for a cone which spans a hemisphere.
+float LightTree::Bounds::orientationMeasure() const {
+    const float spread = std::acos(std::clamp(cosSpread, -1.0f, 1.0f));
+    const float emission = std::min(spread + 0.5f * pi, pi);
+    const float sinSpread = std::sin(spread);
+    return 2.0f * pi * (1.0f - cosSpread) +
+           0.5f * pi * (2.0f * emission * sinSpread - std::cos(spread - 2.0f * emission) -
+                        2.0f * spread * sinSpread + cosSpread);
+}
+
+void LightTree::addShape(const glm::vec4 *vertices, const uint32_t *indices, const Material *materials,
+                         uint64_t triangleCount) {
+    for (uint64_t i = 0; i < triangleCount; ++i) {
+        const Material &material = materials[i];
+        // emission of mirrors is never picked up by paths, so they are no lights
+        if (luminance(glm::vec3(material.emittance)) <= 0.0f || material.reflectance.w == 1.0f)
+            continue;
+
+        const glm::vec3 v0(vertices[indices[3 * i + 0]]);
+        const glm::vec3 v1(vertices[indices[3 * i + 1]]);
+        const glm::vec3 v2(vertices[indices[3 * i + 2]]);
+        const float area = 0.5f * glm::length(glm::cross(v1 - v0, v2 - v0));
+        if (area <= 0.0f)
+            continue;
+
+        triangles.push_back({glm::vec4(v0, area), glm::vec4(v1, 0.0f), glm::vec4(v2, 0.0f), material.emittance});
+    }
+}
+
+void LightTree::build() {
+    nodes.clear();
+    lightCount = triangles.size();
+    if (triangles.empty()) {
+        triangles.push_back({});
+        nodes.push_back({glm::vec4(0.0f), glm::vec4(0.0f), glm::vec4(0.0f), glm::uvec4(0, 1, 0, 0)});
+        depth = 1;
+        return;
+    }
+
+    std::vector<Light> lights(triangles.size());
+    for (size_t i = 0; i < triangles.size(); ++i) {
+        const LightTriangle &triangle = triangles[i];
+        const glm::vec3 v0(triangle.v0), v1(triangle.v1), v2(triangle.v2);
+        Light &light = lights[i];
+        light.bounds.min = glm::min(v0, glm::min(v1, v2));
+        light.bounds.max = glm::max(v0, glm::max(v1, v2));
+        light.bounds.axis = glm::normalize(glm::cross(v1 - v0, v2 - v0));
+        // a diffuse emitter radiates pi * area * emittance from each side
+        light.bounds.power = 2.0f * pi * triangle.v0.w * luminance(glm::vec3(triangle.emittance));
+        light.centroid = (v0 + v1 + v2) / 3.0f;
+        light.triangle = static_cast<uint32_t>(i);
+    }
+
+    nodes.reserve(2 * lights.size() - 1);
+    depth = buildNode(lights, 0, lights.size());
+
+    // leaves are visited in depth first order, so their triangles end up next to each other in memory
+    std::vector<LightTriangle> orderedTriangles;
+    orderedTriangles.reserve(triangles.size());
+    for (LightNode &node: nodes) {
+        if (node.info.y == 0)
+            continue;
+        orderedTriangles.push_back(triangles[node.info.x]);
+        node.info.x = static_cast<uint32_t>(orderedTriangles.size() - 1);
+    }
+    triangles = std::move(orderedTriangles);
+}
+
+// Lights are split at the bin border with the lowest surface area orientation heuristic (SAOH): the cost of a child
+// grows with its power, the surface area of its box and the solid angle it emits into, as each makes the importance
+// estimate of the child less accurate. Every leaf holds a single light.
+uint32_t LightTree::buildNode(std::vector<Light> &lights, size_t begin, size_t end) {
+    Bounds bounds;
+    glm::vec3 centroidMin(std::numeric_limits<float>::max());
+    glm::vec3 centroidMax(std::numeric_limits<float>::lowest());
+    for (size_t i = begin; i < end; ++i) {
+        bounds.extend(lights[i].bounds);
+        centroidMin = glm::min(centroidMin, lights[i].centroid);
+        centroidMax = glm::max(centroidMax, lights[i].centroid);
+    }
+
+    const size_t nodeIndex = nodes.size();
+    nodes.push_back({glm::vec4(bounds.min, bounds.power), glm::vec4(bounds.max, bounds.cosSpread),
+                     glm::vec4(bounds.axis, 0.0f), glm::uvec4(0)});
+    if (end - begin == 1) {
+        nodes[nodeIndex].info = glm::uvec4(lights[begin].triangle, 1, 0, 0);
+        return 1;
+    }
+
+    const glm::vec3 extent = bounds.max - bounds.min;
+    const float maxExtent = std::max(extent.x, std::max(extent.y, extent.z));
+
+    float bestCost = std::numeric_limits<float>::max();
+    int bestAxis = -1;
+    uint32_t bestSplit = 0;
+    for (int axis = 0; axis < 3; ++axis) {
+        const float centroidExtent = centroidMax[axis] - centroidMin[axis];
+        if (centroidExtent <= 0.0f)
+            continue;
+
+        Bounds bins[binCount];
+        size_t binLights[binCount] = {};
+        for (size_t i = begin; i < end; ++i) {
+            const float position = (lights[i].centroid[axis] - centroidMin[axis]) / centroidExtent;
+            const auto bin = std::min(binCount - 1, static_cast<uint32_t>(position * binCount));
+            bins[bin].extend(lights[i].bounds);
+            ++binLights[bin];
+        }
+
+        for (uint32_t split = 1; split < binCount; ++split) {
+            Bounds below, above;
+            size_t lightsBelow = 0, lightsAbove = 0;
+            for (uint32_t bin = 0; bin < split; ++bin) {
+                below.extend(bins[bin]);
+                lightsBelow += binLights[bin];
+            }
+            for (uint32_t bin = split; bin < binCount; ++bin) {
+                above.extend(bins[bin]);
+                lightsAbove += binLights[bin];
+            }
+            if (lightsBelow == 0 || lightsAbove == 0)
+                continue;
+
+            // thin boxes are cheap by surface area, the factor keeps splits across the long axis preferred
+            const float cost = maxExtent / extent[axis] *
+                               (below.power * below.surfaceArea() * below.orientationMeasure() +
+                                above.power * above.surfaceArea() * above.orientationMeasure());
+            if (cost < bestCost) {
+                bestCost = cost;
+                bestAxis = axis;
+                bestSplit = split;
+            }
+        }
+    }
+
+    size_t middle = begin + (end - begin) / 2;
+    if (bestAxis >= 0) {
+        const float centroidExtent = centroidMax[bestAxis] - centroidMin[bestAxis];
+        const auto belowSplit = [&](const Light &light) {
+            const float position = (light.centroid[bestAxis] - centroidMin[bestAxis]) / centroidExtent;
+            return std::min(binCount - 1, static_cast<uint32_t>(position * binCount)) < bestSplit;
+        };
+        middle = std::partition(lights.begin() + begin, lights.begin() + end, belowSplit) - lights.begin();
+    }
+    // without a split candidate all centroids coincide and the lights are halved in any order
+
+    const uint32_t firstDepth = buildNode(lights, begin, middle);
+    nodes[nodeIndex].info.x = static_cast<uint32_t>(nodes.size());
+    const uint32_t secondDepth = buildNode(lights, middle, end);
+    return 1 + std::max(firstDepth, secondDepth);
+}
+
+const std::vector<LightNode> &LightTree::getNodes() const {
+    return nodes;
+}
+
+const std::vector<LightTriangle> &LightTree::getTriangles() const {
+    return triangles;
+}
+
+size_t LightTree::getLightCount() const {
+    return lightCount;
+}
+
+uint32_t LightTree::getDepth() const {
+    return depth;
+}
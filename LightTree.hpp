@@ -0,0 +1,65 @@
+//
+// Bounding volume hierarchy over the emissive triangles of the scene. Every node bounds the position, the normal
+// directions and the emitted power of the triangles below it, so the shaders can pick a light which is likely to
+// contribute much to a shading point in O(log n).
+//
+
+#ifndef PATHTRACER_LIGHTTREE_HPP
+#define PATHTRACER_LIGHTTREE_HPP
+
+#include <cstdint>
+#include <limits>
+#include <vector>
+
+#include "glm/glm.hpp"
+#include "shaderStructs.hpp"
+
+class LightTree {
+public:
+    // collects the emissive triangles of a shape, vertices are in world space and materials are given per triangle
+    void addShape(const glm::vec4 *vertices, const uint32_t *indices, const Material *materials,
+                  uint64_t triangleCount);
+
+    // reorders the collected triangles into the order of the leaves and creates the nodes
+    void build();
+
+    // depth first, never empty: without lights the root is a leaf without power
+    const std::vector<LightNode> &getNodes() const;
+
+    // in the order of the leaves, never empty: without lights it holds a placeholder which is never selected
+    const std::vector<LightTriangle> &getTriangles() const;
+
+    size_t getLightCount() const;
+    uint32_t getDepth() const;
+
+private:
+    // bounds of a set of lights
+    struct Bounds {
+        glm::vec3 min{std::numeric_limits<float>::max()};
+        glm::vec3 max{std::numeric_limits<float>::lowest()};
+        glm::vec3 axis{0.0f};   // zero while the bounds are empty
+        float cosSpread = 1.0f; // cosine of the largest angle between a normal and the axis
+        float power = 0.0f;
+
+        bool isEmpty() const;
+        void extend(const Bounds &other);
+        float surfaceArea() const;
+        float orientationMeasure() const;
+    };
+
+    struct Light {
+        Bounds bounds;
+        glm::vec3 centroid;
+        uint32_t triangle;
+    };
+
+    // creates the subtree of lights [begin, end), returns its depth
+    uint32_t buildNode(std::vector<Light> &lights, size_t begin, size_t end);
+
+    std::vector<LightTriangle> triangles;
+    std::vector<LightNode> nodes;
+    size_t lightCount = 0;
+    uint32_t depth = 0;
+};
+
+#endif //PATHTRACER_LIGHTTREE_HPP
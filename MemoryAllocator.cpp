@@ -0,0 +1,291 @@
+//
+// Suballocation of buffers and images from large device memory blocks, one set of blocks per memory type
+//
+
+#include "MemoryAllocator.hpp"
+
+#include <algorithm>
+#include <sstream>
+#include <utility>
+
+namespace vk::utils {
+
+    namespace {
+        // Also covers minAccelerationStructureScratchOffsetAlignment and the alignment of acceleration structure
+        // storage, which memory requirements of buffers don't report.
+        const vk::DeviceSize minAlignment = 256;
+        const vk::DeviceSize minBuddySize = minAlignment;
+
+        vk::DeviceSize alignUp(vk::DeviceSize value, vk::DeviceSize alignment) {
+            return (value + alignment - 1) / alignment * alignment;
+        }
+
+        // index into the free range lists of the buddy strategy
+        size_t buddyLevel(vk::DeviceSize rangeSize) {
+            size_t level = 0;
+            while ((minBuddySize << level) < rangeSize) ++level;
+            return level;
+        }
+    }
+
+    MemoryBlock::MemoryBlock(const vk::raii::Device &device, vk::DeviceSize size, uint32_t memoryTypeIndex,
+                             vk::MemoryPropertyFlags propertyFlags, vk::DeviceSize nonCoherentAtomSize,
+                             AllocationStrategy strategy, bool dedicated)
+            : device(device), memory(VK_NULL_HANDLE), size(size), propertyFlags(propertyFlags),
+              coherent(static_cast<bool>(propertyFlags & vk::MemoryPropertyFlagBits::eHostCoherent)),
+              nonCoherentAtomSize(nonCoherentAtomSize), strategy(strategy), dedicated(dedicated) {
+        vk::MemoryAllocateInfo allocateInfo(size, memoryTypeIndex);
+        vk::MemoryAllocateFlagsInfo memoryAllocateFlagsInfo(vk::MemoryAllocateFlagBits::eDeviceAddress);
+        allocateInfo.pNext = &memoryAllocateFlagsInfo;
+        memory = device.allocateMemory(allocateInfo);
+
+        // blocks stay mapped, as memory can't be mapped twice to map allocations sharing a block individually
+        if (propertyFlags & vk::MemoryPropertyFlagBits::eHostVisible)
+            mappedData = memory.mapMemory(0, VK_WHOLE_SIZE);
+
+        if (strategy == AllocationStrategy::buddy) {
+            freeRanges.resize(buddyLevel(size) + 1);
+            freeRanges.back().insert(0);
+        }
+    }
+
+    bool MemoryBlock::allocate(vk::DeviceSize allocationSize, vk::DeviceSize alignment, vk::DeviceSize &offset,
+                               vk::DeviceSize &reservedSize) {
+        alignment = std::max(alignment, minAlignment);
+
+        if (strategy == AllocationStrategy::linear) {
+            offset = alignUp(linearTop, alignment);
+            if (offset + allocationSize > size)
+                return false;
+            reservedSize = offset + allocationSize - linearTop;
+            linearTop = offset + allocationSize;
+        } else {
+            // ranges are aligned to their own size, which covers every power of two alignment up to it
+            const size_t level = buddyLevel(std::max(allocationSize, alignment));
+            size_t freeLevel = level;
+            while (freeLevel < freeRanges.size() && freeRanges[freeLevel].empty())
+                ++freeLevel;
+            if (freeLevel >= freeRanges.size())
+                return false;
+
+            offset = *freeRanges[freeLevel].begin();
+            freeRanges[freeLevel].erase(freeRanges[freeLevel].begin());
+            // split off the upper halves until the range has the requested size
+            while (freeLevel > level) {
+                --freeLevel;
+                freeRanges[freeLevel].insert(offset + (minBuddySize << freeLevel));
+            }
+            reservedSize = minBuddySize << level;
+        }
+
+        ++allocationCount;
+        usedBytes += allocationSize;
+        reservedBytes += reservedSize;
+        return true;
+    }
+
+    void MemoryBlock::free(vk::DeviceSize offset, vk::DeviceSize allocationSize, vk::DeviceSize reservedSize) {
+        --allocationCount;
+        usedBytes -= allocationSize;
+        reservedBytes -= reservedSize;
+
+        if (strategy == AllocationStrategy::linear) {
+            if (allocationCount == 0)
+                linearTop = 0;
+            return;
+        }
+
+        // merge with the buddy range as long as it is free as well
+        size_t level = buddyLevel(reservedSize);
+        while (level + 1 < freeRanges.size()) {
+            const vk::DeviceSize buddy = offset ^ (minBuddySize << level);
+            if (freeRanges[level].erase(buddy) == 0)
+                break;
+            offset = std::min(offset, buddy);
+            ++level;
+        }
+        freeRanges[level].insert(offset);
+    }
+
+    // non-coherent ranges have to start and end on multiples of nonCoherentAtomSize
+    vk::MappedMemoryRange MemoryBlock::getAtomAlignedRange(vk::DeviceSize offset, vk::DeviceSize rangeSize) const {
+        const vk::DeviceSize start = offset / nonCoherentAtomSize * nonCoherentAtomSize;
+        const vk::DeviceSize end = alignUp(offset + rangeSize, nonCoherentAtomSize);
+        return {*memory, start, end >= size ? VK_WHOLE_SIZE : end - start};
+    }
+
+    void MemoryBlock::flush(vk::DeviceSize offset, vk::DeviceSize rangeSize) const {
+        if (!coherent && mappedData)
+            device.flushMappedMemoryRanges(getAtomAlignedRange(offset, rangeSize));
+    }
+
+    void MemoryBlock::invalidate(vk::DeviceSize offset, vk::DeviceSize rangeSize) const {
+        if (!coherent && mappedData)
+            device.invalidateMappedMemoryRanges(getAtomAlignedRange(offset, rangeSize));
+    }
+
+    bool MemoryBlock::isEmpty() const { return allocationCount == 0; }
+
+    bool MemoryBlock::isDedicated() const { return dedicated; }
+
+    vk::MemoryPropertyFlags MemoryBlock::getPropertyFlags() const { return propertyFlags; }
+
+    const vk::raii::DeviceMemory &MemoryBlock::getMemory() const { return memory; }
+
+    void *MemoryBlock::getMappedData() const { return mappedData; }
+
+    vk::DeviceSize MemoryBlock::getSize() const { return size; }
+
+    uint32_t MemoryBlock::getAllocationCount() const { return allocationCount; }
+
+    vk::DeviceSize MemoryBlock::getUsedBytes() const { return usedBytes; }
+
+    vk::DeviceSize MemoryBlock::getReservedBytes() const { return reservedBytes; }
+
+    Allocation::Allocation(Allocation &&other) noexcept
+            : allocator(std::exchange(other.allocator, nullptr)), block(std::exchange(other.block, nullptr)),
+              offset(other.offset), size(other.size), reservedSize(other.reservedSize) {}
+
+    Allocation &Allocation::operator=(Allocation &&other) noexcept {
+        if (this != &other) {
+            release();
+            allocator = std::exchange(other.allocator, nullptr);
+            block = std::exchange(other.block, nullptr);
+            offset = other.offset;
+            size = other.size;
+            reservedSize = other.reservedSize;
+        }
+        return *this;
+    }
+
+    Allocation::~Allocation() { release(); }
+
+    void Allocation::release() {
+        if (allocator)
+            allocator->free(*this);
+        allocator = nullptr;
+        block = nullptr;
+    }
+
+    const vk::raii::DeviceMemory &Allocation::getMemory() const { return block->getMemory(); }
+
+    vk::DeviceSize Allocation::getOffset() const { return offset; }
+
+    void *Allocation::getMappedData() const {
+        return block && block->getMappedData() ? static_cast<char *>(block->getMappedData()) + offset : nullptr;
+    }
+
+    void Allocation::flush(vk::DeviceSize rangeOffset, vk::DeviceSize rangeSize) const {
+        block->flush(offset + rangeOffset, rangeSize);
+    }
+
+    void Allocation::invalidate(vk::DeviceSize rangeOffset, vk::DeviceSize rangeSize) const {
+        block->invalidate(offset + rangeOffset, rangeSize);
+    }
+
+    MemoryAllocator::MemoryAllocator(const vk::raii::PhysicalDevice &physicalDevice, const vk::raii::Device &device,
+                                     vk::DeviceSize blockSize)
+            : device(device), memoryProperties(physicalDevice.getMemoryProperties()),
+              nonCoherentAtomSize(physicalDevice.getProperties().limits.nonCoherentAtomSize), blockSize(blockSize) {}
+
+    // at most an eighth of the heap, so small heaps aren't exhausted by partially used blocks
+    vk::DeviceSize MemoryAllocator::getBlockSize(uint32_t memoryTypeIndex) const {
+        const vk::DeviceSize heapSize =
+                memoryProperties.memoryHeaps[memoryProperties.memoryTypes[memoryTypeIndex].heapIndex].size;
+        vk::DeviceSize size = blockSize;
+        while (size > minBuddySize && size > heapSize / 8)
+            size >>= 1;
+        return size;
+    }
+
+    Allocation MemoryAllocator::allocate(const vk::MemoryRequirements &memoryRequirements, uint32_t memoryTypeIndex,
+                                         bool linearResource, AllocationStrategy strategy) {
+        const vk::MemoryPropertyFlags propertyFlags = memoryProperties.memoryTypes[memoryTypeIndex].propertyFlags;
+        vk::DeviceSize alignment = memoryRequirements.alignment;
+        if ((propertyFlags & vk::MemoryPropertyFlagBits::eHostVisible) &&
+            !(propertyFlags & vk::MemoryPropertyFlagBits::eHostCoherent))
+            alignment = std::max(alignment, nonCoherentAtomSize);
+
+        Allocation allocation;
+        allocation.allocator = this;
+        allocation.size = memoryRequirements.size;
+
+        auto &blocks = pools[{memoryTypeIndex, linearResource, strategy}];
+        const vk::DeviceSize poolBlockSize = getBlockSize(memoryTypeIndex);
+
+        // resources which would fill most of a block get memory of their own
+        if (memoryRequirements.size > poolBlockSize / 2) {
+            blocks.push_back(std::make_unique<MemoryBlock>(device, memoryRequirements.size, memoryTypeIndex,
+                                                           propertyFlags, nonCoherentAtomSize,
+                                                           AllocationStrategy::linear, true));
+            blocks.back()->allocate(memoryRequirements.size, alignment, allocation.offset, allocation.reservedSize);
+            allocation.block = blocks.back().get();
+            return allocation;
+        }
+
+        for (auto &block: blocks) {
+            if (!block->isDedicated() &&
+                block->allocate(memoryRequirements.size, alignment, allocation.offset, allocation.reservedSize)) {
+                allocation.block = block.get();
+                return allocation;
+            }
+        }
+
+        blocks.push_back(std::make_unique<MemoryBlock>(device, poolBlockSize, memoryTypeIndex, propertyFlags,
+                                                       nonCoherentAtomSize, strategy, false));
+        blocks.back()->allocate(memoryRequirements.size, alignment, allocation.offset, allocation.reservedSize);
+        allocation.block = blocks.back().get();
+        return allocation;
+    }
+
+    // Empty blocks are released, except for the last regular block of a pool, which would otherwise be allocated
+    // and freed over and over by short lived resources.
+    void MemoryAllocator::free(const Allocation &allocation) {
+        MemoryBlock *block = allocation.block;
+        block->free(allocation.offset, allocation.size, allocation.reservedSize);
+        if (!block->isEmpty())
+            return;
+
+        for (auto &[key, blocks]: pools) {
+            const auto found = std::find_if(blocks.begin(), blocks.end(),
+                                            [block](const auto &candidate) { return candidate.get() == block; });
+            if (found == blocks.end())
+                continue;
+
+            const auto regularBlocks = std::count_if(blocks.begin(), blocks.end(),
+                                                     [](const auto &candidate) { return !candidate->isDedicated(); });
+            if (block->isDedicated() || regularBlocks > 1)
+                blocks.erase(found);
+            return;
+        }
+    }
+
+    MemoryAllocator::Statistics MemoryAllocator::getStatistics() const {
+        Statistics statistics;
+        for (const auto &[key, blocks]: pools) {
+            for (const auto &block: blocks) {
+                ++statistics.blockCount;
+                if (block->isDedicated()) ++statistics.dedicatedBlockCount;
+                statistics.allocationCount += block->getAllocationCount();
+                statistics.blockBytes += block->getSize();
+                statistics.usedBytes += block->getUsedBytes();
+                statistics.reservedBytes += block->getReservedBytes();
+                if (block->getPropertyFlags() & vk::MemoryPropertyFlagBits::eDeviceLocal)
+                    statistics.deviceLocalBytes += block->getUsedBytes();
+                if (block->getPropertyFlags() & vk::MemoryPropertyFlagBits::eHostVisible)
+                    statistics.hostVisibleBytes += block->getUsedBytes();
+            }
+        }
+        return statistics;
+    }
+
+    std::string MemoryAllocator::Statistics::toString() const {
+        std::ostringstream stream;
+        stream << allocationCount << " allocations in " << blockCount << " blocks (" << dedicatedBlockCount
+               << " dedicated), " << usedBytes / 1024 << " KiB used, " << reservedBytes / 1024 << " KiB reserved, "
+               << blockBytes / 1024 << " KiB allocated, " << deviceLocalBytes / 1024 << " KiB device local, "
+               << hostVisibleBytes / 1024 << " KiB host visible";
+        return stream.str();
+    }
+
+} // namespace vk::utils
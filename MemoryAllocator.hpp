@@ -0,0 +1,156 @@
+//
+// Suballocation of buffers and images from large device memory blocks, one set of blocks per memory type
+//
+
+#ifndef PATHTRACER_MEMORYALLOCATOR_HPP
+#define PATHTRACER_MEMORYALLOCATOR_HPP
+
+#include <map>
+#include <memory>
+#include <set>
+#include <string>
+#include <tuple>
+#include <vector>
+
+#include "vulkan/vulkan_raii.hpp"
+
+namespace vk::utils {
+
+    enum class AllocationStrategy {
+        buddy,  // power of two ranges which merge again when freed, for long lived resources
+        linear  // ranges are stacked, a block is only reused once all of them are freed, for short lived resources
+    };
+
+    class MemoryAllocator;
+
+    // device memory of one block with either allocation strategy
+    class MemoryBlock {
+    public:
+        MemoryBlock(const vk::raii::Device &device, vk::DeviceSize size, uint32_t memoryTypeIndex,
+                    vk::MemoryPropertyFlags propertyFlags, vk::DeviceSize nonCoherentAtomSize,
+                    AllocationStrategy strategy, bool dedicated);
+
+        // reservedSize is the part of the block taken by the allocation, including padding
+        bool allocate(vk::DeviceSize size, vk::DeviceSize alignment, vk::DeviceSize &offset,
+                      vk::DeviceSize &reservedSize);
+        void free(vk::DeviceSize offset, vk::DeviceSize size, vk::DeviceSize reservedSize);
+
+        // make host writes visible to the device and the other way round, nothing to do for coherent memory
+        void flush(vk::DeviceSize offset, vk::DeviceSize size) const;
+        void invalidate(vk::DeviceSize offset, vk::DeviceSize size) const;
+
+        bool isEmpty() const;
+        bool isDedicated() const;
+        vk::MemoryPropertyFlags getPropertyFlags() const;
+
+        const vk::raii::DeviceMemory &getMemory() const;
+        void *getMappedData() const; // start of the persistently mapped block, nullptr if not host visible
+        vk::DeviceSize getSize() const;
+        uint32_t getAllocationCount() const;
+        vk::DeviceSize getUsedBytes() const;
+        vk::DeviceSize getReservedBytes() const;
+
+    private:
+        vk::MappedMemoryRange getAtomAlignedRange(vk::DeviceSize offset, vk::DeviceSize size) const;
+
+        const vk::raii::Device &device;
+        vk::raii::DeviceMemory memory;
+        void *mappedData = nullptr;
+        vk::DeviceSize size;
+        vk::MemoryPropertyFlags propertyFlags;
+        bool coherent;
+        vk::DeviceSize nonCoherentAtomSize;
+        AllocationStrategy strategy;
+        bool dedicated;  // holds a single allocation larger than the regular blocks
+
+        uint32_t allocationCount = 0;
+        vk::DeviceSize usedBytes = 0;      // requested by the allocations
+        vk::DeviceSize reservedBytes = 0;  // taken by the allocations including alignment and rounding
+
+        vk::DeviceSize linearTop = 0;  // end of the last linear allocation
+
+        // buddy strategy: offsets of free ranges, index i holds ranges of minBuddySize << i bytes
+        std::vector<std::set<vk::DeviceSize>> freeRanges;
+    };
+
+    // range of a memory block, returned to the allocator on destruction
+    class Allocation {
+    public:
+        Allocation() = default;
+        Allocation(const Allocation &) = delete;
+        Allocation &operator=(const Allocation &) = delete;
+        Allocation(Allocation &&other) noexcept;
+        Allocation &operator=(Allocation &&other) noexcept;
+        ~Allocation();
+
+        const vk::raii::DeviceMemory &getMemory() const;
+        vk::DeviceSize getOffset() const;    // within the memory returned by getMemory()
+        void *getMappedData() const;         // start of the allocation, nullptr if not host visible
+
+        // offsets are relative to the start of the allocation
+        void flush(vk::DeviceSize offset, vk::DeviceSize size) const;
+        void invalidate(vk::DeviceSize offset, vk::DeviceSize size) const;
+
+    private:
+        friend class MemoryAllocator;
+
+        void release();
+
+        MemoryAllocator *allocator = nullptr;
+        MemoryBlock *block = nullptr;
+        vk::DeviceSize offset = 0;
+        vk::DeviceSize size = 0;
+        vk::DeviceSize reservedSize = 0;
+    };
+
+    class MemoryAllocator {
+    public:
+        struct Statistics {
+            uint32_t blockCount = 0;
+            uint32_t dedicatedBlockCount = 0;
+            uint32_t allocationCount = 0;
+            vk::DeviceSize blockBytes = 0;     // device memory allocated from the driver
+            vk::DeviceSize usedBytes = 0;      // requested by buffers and images
+            vk::DeviceSize reservedBytes = 0;  // used bytes plus alignment and rounding
+            vk::DeviceSize deviceLocalBytes = 0;  // used bytes in device local memory
+            vk::DeviceSize hostVisibleBytes = 0;  // used bytes in host visible memory, may overlap the above
+
+            std::string toString() const;
+        };
+
+        // blockSize must be a power of two, it is reduced for small memory heaps
+        MemoryAllocator(const vk::raii::PhysicalDevice &physicalDevice, const vk::raii::Device &device,
+                        vk::DeviceSize blockSize = vk::DeviceSize(64) << 20);
+
+        // blocks hold pointers to the allocator
+        MemoryAllocator(const MemoryAllocator &) = delete;
+        MemoryAllocator &operator=(const MemoryAllocator &) = delete;
+
+        // linearResource: buffers and linear images, which are kept apart from optimal images in separate blocks
+        // so bufferImageGranularity never applies
+        Allocation allocate(const vk::MemoryRequirements &memoryRequirements, uint32_t memoryTypeIndex,
+                            bool linearResource, AllocationStrategy strategy);
+
+        Statistics getStatistics() const;
+
+    private:
+        friend class Allocation;
+
+        // memory type index, linear resource, strategy
+        using PoolKey = std::tuple<uint32_t, bool, AllocationStrategy>;
+
+        void free(const Allocation &allocation);
+
+        vk::DeviceSize getBlockSize(uint32_t memoryTypeIndex) const;
+
+        const vk::raii::Device &device;
+        vk::PhysicalDeviceMemoryProperties memoryProperties;
+        vk::DeviceSize nonCoherentAtomSize;
+        vk::DeviceSize blockSize;
+
+        std::map<PoolKey, std::vector<std::unique_ptr<MemoryBlock>>> pools;
+    };
+
+} // namespace vk::utils
+
+#endif //PATHTRACER_MEMORYALLOCATOR_HPP
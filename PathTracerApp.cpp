@@ -3,8 +3,29 @@
 //
 
 #include "PathTracerApp.hpp"
+#include "Denoiser.hpp"
+#include "Pfm.hpp"
+#include "StagingRing.hpp"
+#include "LightTree.hpp"
+#include "RenderServer.hpp"
+#include "CameraPath.hpp"
 #include <iostream>
 #include <utility>
+#include <queue>
+#include <limits>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <cmath>
+#include <algorithm>
+#include <array>
+
+#ifndef _WIN32
+#include <sys/resource.h>
+#else
+#include <fcntl.h>
+#include <io.h>
+#endif
 
 #define TINYOBJLOADER_IMPLEMENTATION
 
@@ -21,7 +42,7 @@ PathTracerApp::PathTracerApp()
           graphicsQueue(VK_NULL_HANDLE), computeQueue(VK_NULL_HANDLE), transferQueue(VK_NULL_HANDLE),
           descriptorSetLayouts{}, pipelineLayout(VK_NULL_HANDLE), pipelineRT(VK_NULL_HANDLE),
           descriptorPoolRayGen(VK_NULL_HANDLE), descriptorPoolCHit(VK_NULL_HANDLE), descriptorSets{},
-          shaderBindingTable(), scene(), frameData(), frameDataBuffer() {}
+          shaderBindingTable(), timestampQueryPool(VK_NULL_HANDLE), scene(), frameData(), frameDataBuffer() {}
 
 void PathTracerApp::initSettings(
         std::string appName = "PathTracer", uint32_t windowWidth = 800, uint32_t windowHeight = 600,
@@ -32,14 +53,112 @@ void PathTracerApp::initSettings(
     settings.windowHeight = windowHeight;
     settings.modelName = std::move(modelName);
     settings.maxRecursionDepth = maxRecursionDepth;
+    settings.compactAccelerationStructures = true;
+    settings.precomputeTriangleData = true;
+    settings.buildQuality = BuildQuality::fastTrace;
+    settings.triangleSplitBudget = 0.0f;
+    settings.reuseSceneCache = true;
+    settings.flattenShapes = true;
+    settings.maxObjectTriangles = 1u << 20;
+    settings.allowRayReordering = true;
+    settings.specializeShaders = true;
+    settings.renderMode = RENDER_MODE_PATH_TRACING;
+    settings.lightSampling = LIGHT_SAMPLING_TREE;
+    settings.resampling = RESAMPLING_OFF;
+    settings.lightTracing = false;
+    settings.dynamicResolution = true;
+    settings.targetFrameTime = 16.0f;
+    settings.minResolutionScale = 0.25f;
+    settings.previewRecursionDepth = std::min(maxRecursionDepth, 4u);
+    settings.denoiserIterations = 5;
+    settings.denoiseOnExport = true;
+    settings.previewDenoiseInterval = 0.25f;
+    settings.timeBudget = 0;
+    settings.maxSamples = 0;
+    settings.noiseTarget = 0;
+    settings.convergenceTolerance = 0.05;
+    settings.maxResidentScenes = 4;
+    settings.sequenceFps = 30.0f;
+    settings.viewOutput = "view.pfm";
+    settings.sequentialBaseline = false;
+
+    renderExtent = vk::Extent2D(settings.windowWidth, settings.windowHeight);
+    fullExtent = renderExtent;
+    renderDepth = settings.maxRecursionDepth;
 
     camera = Camera({275, 275, 1}, {0, 0, 1}, {0, 1, 0}, 0.1f, 1000.0f, 90.0f);
 
     frameData.frameID = glm::vec4(0);
 }
 
-void PathTracerApp::run() {
-    if (!initialized) initSettings();
+void PathTracerApp::setRenderLimits(double timeBudget, uint32_t maxSamples, float noiseTarget) {
+    settings.timeBudget = timeBudget;
+    settings.maxSamples = maxSamples;
+    settings.noiseTarget = noiseTarget;
+}
+
+void PathTracerApp::setConvergenceTest(const std::string &referenceFile, const std::vector<double> &timeBudgets,
+                                       const std::string &baselineFile) {
+    settings.convergenceReference = referenceFile;
+    settings.convergenceBudgets = timeBudgets;
+    settings.convergenceBaseline = baselineFile;
+}
+
+void PathTracerApp::setReferenceOutput(const std::string &fileName) {
+    settings.referenceOutput = fileName;
+}
+
+void PathTracerApp::setFlattenShapes(bool flatten) {
+    settings.flattenShapes = flatten;
+}
+
+void PathTracerApp::setBuildQuality(bool fastBuild) {
+    settings.buildQuality = fastBuild ? BuildQuality::fastBuild : BuildQuality::fastTrace;
+}
+
+void PathTracerApp::setTriangleSplitBudget(float budget) {
+    settings.triangleSplitBudget = budget;
+}
+
+void PathTracerApp::setSpecializeShaders(bool specialize) {
+    settings.specializeShaders = specialize;
+}
+
+void PathTracerApp::setLightSampling(uint32_t lightSampling) {
+    settings.lightSampling = lightSampling;
+}
+
+void PathTracerApp::setResampling(uint32_t resampling) {
+    settings.resampling = resampling;
+}
+
+void PathTracerApp::setLightTracing(bool lightTracing) {
+    settings.lightTracing = lightTracing;
+}
+
+void PathTracerApp::setServer(const std::string &socketPath) {
+    settings.serverSocket = socketPath;
+}
+
+void PathTracerApp::setSequence(const std::string &cameraPathFile, float fps, const std::string &output) {
+    settings.cameraPath = cameraPathFile;
+    settings.sequenceFps = fps;
+    settings.sequenceOutput = output;
+}
+
+void PathTracerApp::setViews(const std::string &viewsFile, const std::string &output, bool sequentialBaseline) {
+    settings.viewsFile = viewsFile;
+    settings.viewOutput = output;
+    settings.sequentialBaseline = sequentialBaseline;
+}
+
+int PathTracerApp::run() {
+    if (!settings.initialized) initSettings();
+    // frames streamed to stdout must not be interleaved with the log
+    if (!settings.cameraPath.empty() && settings.sequenceOutput == "-")
+        std::cout.rdbuf(std::cerr.rdbuf());
+    renderController = RenderController(settings.timeBudget, settings.maxSamples, settings.noiseTarget);
+    convergenceTest = ConvergenceTest(settings.convergenceReference, settings.convergenceBudgets);
     initGLFW();
     updateCamera(0);
     initVulkan();
@@ -47,20 +166,32 @@ void PathTracerApp::run() {
     initSurface();
     initSwapchain();
     initSyncObjects();
-    vk::utils::Initialize(&physicalDevice, &device, &graphicsPool, &transferQueue);
+    memoryAllocator = std::make_unique<vk::utils::MemoryAllocator>(physicalDevice, device);
+    vk::utils::Initialize(&physicalDevice, &device, &graphicsPool, &transferQueue, memoryAllocator.get());
     initImages();
     initCommandPoolAndBuffers();
 
-    createScene();
+    SceneCache cache;
+    const SceneCache::Key cacheKey = openSceneCache(settings.modelName, cache);
+    createScene(cache, cacheKey);
     createRaytracingPipeline();
     createShaderBindingTable();
     createDescriptorSets();
 
-    fillCommandBuffers();
+    if (convergenceTest.isActive() && !convergenceTest.loadReference(settings.windowWidth, settings.windowHeight))
+        return 2;
 
-    mainLoop();
+    if (!settings.serverSocket.empty())
+        serve();
+    else if (!settings.cameraPath.empty())
+        renderSequence();
+    else if (!settings.viewsFile.empty())
+        renderViews();
+    else
+        mainLoop();
 
     device.waitIdle();
+    return exitCode;
 }
 
 PathTracerApp &PathTracerApp::instance() {
@@ -77,6 +208,8 @@ PathTracerApp::~PathTracerApp() {
 
 void PathTracerApp::mainLoop() {
     glfwSetTime(0);
+    renderController.start();
+    convergenceTest.start();
     double currentTime, previousTime = 0, deltaTime;
     while (!glfwWindowShouldClose(window)) {
         currentTime = glfwGetTime();
@@ -85,17 +218,111 @@ void PathTracerApp::mainLoop() {
 
         drawFrame(static_cast<float>(deltaTime));
 
-        glfwSetWindowTitle(window, (settings.name + " | Frame: " + std::to_string(frameData.frameID.x)).c_str());
+        if (renderController.hasLimits()) {
+            renderController.passFinished(frameData.frameID.x);
+            if (renderController.noiseCheckDue())
+                renderController.setNoise(estimateNoise());
+
+            const RenderController::StopReason stopReason = renderController.shouldStop();
+            if (stopReason != RenderController::StopReason::none) {
+                finishJob(stopReason);
+                break;
+            }
+        }
+
+        if (convergenceTest.isActive()) {
+            if (convergenceTest.checkpointDue()) {
+                // the frame in flight still counts as render time, the readback doesn't
+                device.waitIdle();
+                convergenceTest.pause();
+                const std::vector<glm::vec4> aovs = readAccumulation();
+                convergenceTest.addCheckpoint(frameData.frameID.x,
+                                              aovs.data() + AOV_COLOR * renderExtent.width * renderExtent.height);
+                convergenceTest.resume();
+            }
+            if (convergenceTest.finished()) {
+                finishConvergenceTest();
+                break;
+            }
+        }
+
+        // samples per second of the last completed frame, measured on the GPU
+        const float megaSamplesPerSecond =
+                traceTime > 0 ? static_cast<float>(renderExtent.width * renderExtent.height) / traceTime * 1e-3f : 0;
+
+        glfwSetWindowTitle(window, (settings.name + " | Frame: " + std::to_string(frameData.frameID.x) +
+                                    " | Trace: " + std::to_string(traceTime) + " ms" +
+                                    " | " + std::to_string(megaSamplesPerSecond) + " MSamples/s" +
+                                    (previewActive ? " | Preview: " + std::to_string(renderExtent.width) + "x" +
+                                                     std::to_string(renderExtent.height) : "") +
+                                    (diagnostics ? " | Diagnostics" : "") +
+                                    (renderController.hasLimits() ? " | Remaining: " + std::to_string(
+                                            renderController.estimateRemainingTime()) + " s" : "")).c_str());
 
         glfwPollEvents();
     }
 }
 
+// the last pass has been submitted, wait for it and write the result
+void PathTracerApp::finishJob(RenderController::StopReason reason) {
+    device.waitIdle();
+
+    const double megaSamplesPerSecond = static_cast<double>(frameData.frameID.x) * renderExtent.width *
+                                        renderExtent.height / renderController.getElapsedTime() * 1e-6;
+    std::cout << "Render finished by " << RenderController::toString(reason) << " after "
+              << renderController.getElapsedTime() << " s with " << frameData.frameID.x << " samples per pixel ("
+              << megaSamplesPerSecond << " MSamples/s)";
+    if (renderController.getNoise() >= 0)
+        std::cout << ", estimated noise " << renderController.getNoise();
+    std::cout << std::endl;
+
+    exportImage();
+    if (!settings.referenceOutput.empty())
+        exportReference(settings.referenceOutput);
+}
+
+// write the convergence curve and fail the run if the error at equal time got worse than in the baseline run
+void PathTracerApp::finishConvergenceTest() {
+    const std::string curveFile = std::string("../screenshots/") + settings.modelName + "-convergence.csv";
+    if (!convergenceTest.writeCurve(curveFile))
+        exitCode = 2;
+    else
+        std::cout << "Convergence curve written to " << curveFile << std::endl;
+
+    if (!settings.convergenceBaseline.empty() &&
+        !convergenceTest.compareToBaseline(settings.convergenceBaseline, settings.convergenceTolerance))
+        exitCode = 1;
+}
+
+// the accumulated color as raw floats, a long render of this is the reference of convergence tests
+void PathTracerApp::exportReference(const std::string &fileName) {
+    const std::vector<glm::vec4> aovs = readAccumulation();
+    const size_t pixelCount = static_cast<size_t>(renderExtent.width) * renderExtent.height;
+
+    pfm::Image image{renderExtent.width, renderExtent.height, 3, std::vector<float>(3 * pixelCount)};
+    for (size_t i = 0; i < pixelCount; ++i) {
+        const glm::vec4 &color = aovs[AOV_COLOR * pixelCount + i];
+        image.pixels[3 * i] = color.r;
+        image.pixels[3 * i + 1] = color.g;
+        image.pixels[3 * i + 2] = color.b;
+    }
+
+    if (!pfm::write(fileName, image))
+        std::cerr << "Could not write reference image " << fileName << std::endl;
+}
+
+// render jobs, convergence tests, the render server, sequences and multi-view jobs don't need a visible window
+bool PathTracerApp::isUnattended() const {
+    return renderController.hasLimits() || convergenceTest.isActive() || !settings.serverSocket.empty() ||
+           !settings.cameraPath.empty() || !settings.viewsFile.empty();
+}
+
 void PathTracerApp::initGLFW() {
     glfwInit();
 
     glfwWindowHint(GLFW_CLIENT_API, GLFW_NO_API);
     glfwWindowHint(GLFW_RESIZABLE, GLFW_FALSE);
+    glfwWindowHint(GLFW_VISIBLE, isUnattended() ? GLFW_FALSE : GLFW_TRUE);
 
     window = glfwCreateWindow(static_cast<int>(settings.windowWidth),
                               static_cast<int>(settings.windowHeight),
@@ -149,7 +376,7 @@ void PathTracerApp::initDevicesAndQueues() {
     std::vector<vk::ExtensionProperties> extensionProperties = physicalDevice.enumerateDeviceExtensionProperties();
 
     //
-    auto requiredExtensions = {VK_KHR_SWAPCHAIN_EXTENSION_NAME,
+    std::vector<const char *> requiredExtensions = {VK_KHR_SWAPCHAIN_EXTENSION_NAME,
                                VK_KHR_GET_MEMORY_REQUIREMENTS_2_EXTENSION_NAME,
                                VK_KHR_BUFFER_DEVICE_ADDRESS_EXTENSION_NAME,
                                VK_KHR_DEFERRED_HOST_OPERATIONS_EXTENSION_NAME,
@@ -165,6 +392,41 @@ void PathTracerApp::initDevicesAndQueues() {
         }
     }
 
+    // shader execution reordering is optional, it is used to regroup incoherent secondary rays
+    vk::PhysicalDeviceRayTracingInvocationReorderFeaturesNV invocationReorderFeatures;
+    if (vk::utils::contains(extensionProperties, VK_NV_RAY_TRACING_INVOCATION_REORDER_EXTENSION_NAME)) {
+        invocationReorderFeatures = physicalDevice.getFeatures2<vk::PhysicalDeviceFeatures2,
+                vk::PhysicalDeviceRayTracingInvocationReorderFeaturesNV>().get<vk::PhysicalDeviceRayTracingInvocationReorderFeaturesNV>();
+        auto reorderProperties = physicalDevice.getProperties2<vk::PhysicalDeviceProperties2,
+                vk::PhysicalDeviceRayTracingInvocationReorderPropertiesNV>().get<vk::PhysicalDeviceRayTracingInvocationReorderPropertiesNV>();
+        // some implementations accept the reorder calls but don't actually reorder
+        rayReorderingSupported = invocationReorderFeatures.rayTracingInvocationReorder &&
+                                 reorderProperties.rayTracingInvocationReorderReorderingHint ==
+                                 vk::RayTracingInvocationReorderModeNV::eReorder;
+    }
+    if (rayReorderingSupported)
+        requiredExtensions.push_back(VK_NV_RAY_TRACING_INVOCATION_REORDER_EXTENSION_NAME);
+
+    // shader clock is optional, the diagnostics ray generation shader uses it to measure the cost of each ray
+    vk::PhysicalDeviceShaderClockFeaturesKHR shaderClockFeatures;
+    if (vk::utils::contains(extensionProperties, VK_KHR_SHADER_CLOCK_EXTENSION_NAME)) {
+        shaderClockFeatures = physicalDevice.getFeatures2<vk::PhysicalDeviceFeatures2,
+                vk::PhysicalDeviceShaderClockFeaturesKHR>().get<vk::PhysicalDeviceShaderClockFeaturesKHR>();
+        diagnosticsSupported = shaderClockFeatures.shaderSubgroupClock;
+    }
+    if (diagnosticsSupported)
+        requiredExtensions.push_back(VK_KHR_SHADER_CLOCK_EXTENSION_NAME);
+
+    // float atomics are optional, light tracing falls back to compare and swap loops to splat onto the film
+    vk::PhysicalDeviceShaderAtomicFloatFeaturesEXT atomicFloatFeatures;
+    if (vk::utils::contains(extensionProperties, VK_EXT_SHADER_ATOMIC_FLOAT_EXTENSION_NAME)) {
+        atomicFloatFeatures = physicalDevice.getFeatures2<vk::PhysicalDeviceFeatures2,
+                vk::PhysicalDeviceShaderAtomicFloatFeaturesEXT>().get<vk::PhysicalDeviceShaderAtomicFloatFeaturesEXT>();
+        atomicFloatSupported = atomicFloatFeatures.shaderBufferFloat32AtomicAdd;
+    }
+    if (atomicFloatSupported)
+        requiredExtensions.push_back(VK_EXT_SHADER_ATOMIC_FLOAT_EXTENSION_NAME);
+
     // graphics, compute and transfer queue family indices
     std::vector<vk::QueueFamilyProperties> queueFamilies = physicalDevice.getQueueFamilyProperties();
 
@@ -215,7 +477,8 @@ void PathTracerApp::initDevicesAndQueues() {
                     vk::PhysicalDeviceDescriptorIndexingFeaturesEXT,
                     vk::PhysicalDeviceAccelerationStructureFeaturesKHR,
                     vk::PhysicalDeviceRayTracingPipelineFeaturesKHR,
-                    vk::PhysicalDeviceBufferDeviceAddressFeatures>();
+                    vk::PhysicalDeviceBufferDeviceAddressFeatures,
+                    vk::PhysicalDeviceTimelineSemaphoreFeatures>();
 
     float queuePriority = 1.0f;
     std::vector<vk::DeviceQueueCreateInfo> deviceQueueCreateInfos;
@@ -240,6 +503,20 @@ void PathTracerApp::initDevicesAndQueues() {
                                           requiredExtensions,
                                           &supportedFeatures.get<vk::PhysicalDeviceFeatures2>().features);
     deviceCreateInfo.pNext = &supportedFeatures.get<vk::PhysicalDeviceDescriptorIndexingFeaturesEXT>();
+
+    // features of optional extensions are appended to the end of the chain if they are enabled
+    void **featureChainEnd = &supportedFeatures.get<vk::PhysicalDeviceTimelineSemaphoreFeatures>().pNext;
+    auto appendFeatures = [&featureChainEnd](auto &features) {
+        features.pNext = nullptr; // still points into the chain the features were queried with
+        *featureChainEnd = &features;
+        featureChainEnd = &features.pNext;
+    };
+    if (rayReorderingSupported)
+        appendFeatures(invocationReorderFeatures);
+    if (diagnosticsSupported)
+        appendFeatures(shaderClockFeatures);
+    if (atomicFloatSupported)
+        appendFeatures(atomicFloatFeatures);
     device = physicalDevice.createDevice(deviceCreateInfo);
 
     graphicsQueue = device.getQueue(queueFamilyIndices[vk::utils::QueueFamilyIndex::graphics], 0);
@@ -250,8 +527,12 @@ void PathTracerApp::initDevicesAndQueues() {
             vk::PhysicalDeviceRayTracingPipelinePropertiesKHR>();
 
     pipelineProperties = props.get<vk::PhysicalDeviceRayTracingPipelinePropertiesKHR>();
-    settings.maxRecursionDepth = std::min(pipelineProperties.maxRayRecursionDepth, settings.maxRecursionDepth);
-    std::cout << "Max ray recursion depth: " << settings.maxRecursionDepth << std::endl;
+    timestampPeriod = props.get<vk::PhysicalDeviceProperties2>().properties.limits.timestampPeriod;
+    const vk::DeviceSize uniformAlignment =
+            props.get<vk::PhysicalDeviceProperties2>().properties.limits.minUniformBufferOffsetAlignment;
+    frameDataStride = (sizeof(FrameData) + uniformAlignment - 1) / uniformAlignment * uniformAlignment;
+    // paths are traced iteratively by the ray generation shader, so only the loop bound limits their depth
+    std::cout << "Max path depth: " << settings.maxRecursionDepth << std::endl;
 }
 
 void PathTracerApp::initSurface() {
@@ -288,7 +569,14 @@ void PathTracerApp::initSwapchain() {
     settings.windowHeight = std::clamp(settings.windowHeight, surfaceCapabilities.minImageExtent.height,
                                        surfaceCapabilities.maxImageExtent.height);
 
-    // since input latency is irrelevant to us, present mode doesn't matter so FIFO is fine
+    // Since input latency is irrelevant to us, FIFO is fine for interactive use. Render jobs and convergence tests
+    // shouldn't be limited by the display refresh rate though.
+    vk::PresentModeKHR presentMode = vk::PresentModeKHR::eFifo;
+    const auto presentModes = physicalDevice.getSurfacePresentModesKHR(*surface);
+    if (isUnattended() &&
+        std::find(presentModes.begin(), presentModes.end(), vk::PresentModeKHR::eImmediate) != presentModes.end())
+        presentMode = vk::PresentModeKHR::eImmediate;
+
     vk::SwapchainCreateInfoKHR swapchainCreateInfo(
             { /* flags */ },
            *surface,
@@ -303,7 +591,7 @@ void PathTracerApp::initSwapchain() {
            queueFamilyIndices,
            vk::SurfaceTransformFlagBitsKHR::eIdentity,
            vk::CompositeAlphaFlagBitsKHR::eOpaque,
-           vk::PresentModeKHR::eFifo,
+           presentMode,
            VK_TRUE,
            VK_NULL_HANDLE); // required for rebuilding swapchain to enable resizing window
     swapchain = device.createSwapchainKHR(swapchainCreateInfo);
@@ -325,6 +613,7 @@ void PathTracerApp::initSwapchain() {
 void PathTracerApp::initSyncObjects() {
     for (const auto &e: swapchainImages)
         waitForFrameFences.emplace_back(device, vk::FenceCreateInfo(vk::FenceCreateFlagBits::eSignaled));
+    imageSubmissions.assign(swapchainImages.size(), 0);
 
     graphicsPool = device.createCommandPool(vk::CommandPoolCreateInfo{});
 
@@ -338,13 +627,66 @@ void PathTracerApp::initImages() {
             surfaceFormat.format,
             {settings.windowWidth, settings.windowHeight, 1},
             vk::ImageTiling::eOptimal,
-            vk::ImageUsageFlagBits::eStorage | vk::ImageUsageFlagBits::eTransferSrc,
+            // the denoised preview is copied into it in place of the traced frame
+            vk::ImageUsageFlagBits::eStorage | vk::ImageUsageFlagBits::eTransferSrc |
+            vk::ImageUsageFlagBits::eTransferDst,
             vk::MemoryPropertyFlagBits::eDeviceLocal);
 
     resultImage.createImageView(
             vk::ImageViewType::e2D,
             surfaceFormat.format,
             vk::ImageSubresourceRange{vk::ImageAspectFlagBits::eColor, 0, 1, 0, 1});
+
+    // history is kept in float precision, every frame reads one layer of each pair and writes the other
+    accumulationImages = vk::utils::Image(
+            vk::ImageType::e2D,
+            vk::Format::eR32G32B32A32Sfloat,
+            {settings.windowWidth, settings.windowHeight, 1},
+            vk::ImageTiling::eOptimal,
+            vk::ImageUsageFlagBits::eStorage | vk::ImageUsageFlagBits::eTransferSrc,
+            vk::MemoryPropertyFlagBits::eDeviceLocal,
+            2 * AOV_COUNT);
+    accumulationImages.createImageView(
+            vk::ImageViewType::e2DArray,
+            vk::Format::eR32G32B32A32Sfloat,
+            vk::ImageSubresourceRange{vk::ImageAspectFlagBits::eColor, 0, 1, 0, 2 * AOV_COUNT});
+
+    positionImages = vk::utils::Image(
+            vk::ImageType::e2D,
+            vk::Format::eR32G32B32A32Sfloat,
+            {settings.windowWidth, settings.windowHeight, 1},
+            vk::ImageTiling::eOptimal,
+            vk::ImageUsageFlagBits::eStorage,
+            vk::MemoryPropertyFlagBits::eDeviceLocal,
+            2);
+    positionImages.createImageView(
+            vk::ImageViewType::e2DArray,
+            vk::Format::eR32G32B32A32Sfloat,
+            vk::ImageSubresourceRange{vk::ImageAspectFlagBits::eColor, 0, 1, 0, 2});
+
+    const vk::DeviceSize pixelCount = static_cast<vk::DeviceSize>(settings.windowWidth) * settings.windowHeight;
+    reservoirBuffer = {{{ /* flags */ }, 2 * pixelCount * sizeof(Reservoir), vk::BufferUsageFlagBits::eStorageBuffer},
+                       vk::MemoryPropertyFlagBits::eDeviceLocal};
+    // cleared before every light tracing pass
+    splatBuffer = {{{ /* flags */ }, 3 * pixelCount * sizeof(float),
+                    vk::BufferUsageFlagBits::eStorageBuffer | vk::BufferUsageFlagBits::eTransferDst},
+                   vk::MemoryPropertyFlagBits::eDeviceLocal};
+
+    // Frames still in flight read their own copy of the frame data, writing the next frame's parity and camera into
+    // a shared one would make them write the history layer they should read and reproject with the wrong camera.
+    frameDataBuffer = {{{ /* flags */ }, frameDataStride * swapchainImages.size(),
+                        vk::BufferUsageFlagBits::eUniformBuffer},
+                       vk::MemoryPropertyFlagBits::eHostVisible};
+
+    // host copies of the accumulated quantities for the denoiser and of its result for display
+    readbackBuffer = {{{ /* flags */ }, AOV_COUNT * pixelCount * sizeof(glm::vec4),
+                       vk::BufferUsageFlagBits::eTransferDst},
+                      vk::MemoryPropertyFlagBits::eHostVisible | vk::MemoryPropertyFlagBits::eHostCoherent};
+    previewReadbackBuffer = {{{ /* flags */ }, 3 * pixelCount * sizeof(glm::vec4),
+                              vk::BufferUsageFlagBits::eTransferDst},
+                             vk::MemoryPropertyFlagBits::eHostVisible};
+    displayBuffer = {{{ /* flags */ }, 2 * pixelCount * 4, vk::BufferUsageFlagBits::eTransferSrc},
+                     vk::MemoryPropertyFlagBits::eHostVisible | vk::MemoryPropertyFlagBits::eHostCoherent};
 }
 
 void PathTracerApp::initCommandPoolAndBuffers() {
@@ -361,34 +703,134 @@ void PathTracerApp::initCommandPoolAndBuffers() {
     computeCommandBuffer = std::move(device.allocateCommandBuffers({*computePool,
                                                                     vk::CommandBufferLevel::ePrimary,
                                                                     1}).front());
+
+    // one pair of timestamps around the ray tracing dispatch per swapchain image
+    timestampQueryPool = device.createQueryPool({{ /* flags */ }, vk::QueryType::eTimestamp,
+                                                 2 * static_cast<uint32_t>(swapchainImages.size())});
+
+    // history images keep their contents from frame to frame, so they are moved into the general layout only once
+    commandBuffers[0].begin({vk::CommandBufferUsageFlagBits::eOneTimeSubmit});
+    for (const auto *image: {&accumulationImages, &positionImages})
+        vk::utils::imageBarrier(commandBuffers[0],
+                                *image->getImage(),
+                                {vk::ImageAspectFlagBits::eColor, 0, 1, 0, VK_REMAINING_ARRAY_LAYERS},
+                                { /* srcAccessMask */ },
+                                vk::AccessFlagBits::eShaderRead | vk::AccessFlagBits::eShaderWrite,
+                                vk::ImageLayout::eUndefined,
+                                vk::ImageLayout::eGeneral);
+    commandBuffers[0].end();
+    graphicsQueue.submit(vk::SubmitInfo(VK_NULL_HANDLE, VK_NULL_HANDLE, *commandBuffers[0], VK_NULL_HANDLE));
+    graphicsQueue.waitIdle();
 }
 
-void PathTracerApp::fillCommandBuffers() {
-    for (size_t i = 0; i < commandBuffers.size() - 1; ++i) {
-        const vk::raii::CommandBuffer &commandBuffer = commandBuffers[i];
-        commandBuffer.begin({ /* beginInfo */ });
+// Command buffers are recorded every frame as the render resolution and path depth change while the camera moves
+void PathTracerApp::recordCommandBuffer(uint32_t imageIndex, bool readPreview) {
+    const vk::raii::CommandBuffer &commandBuffer = commandBuffers[imageIndex];
+    commandBuffer.begin({ /* beginInfo */ });
+
+    commandBuffer.resetQueryPool(*timestampQueryPool, 2 * imageIndex, 2);
+
+    const PushConstants pushConstants{renderDepth, settings.renderMode, settings.lightSampling, settings.resampling,
+                                      tracesLights() ? 1u : 0u};
+    commandBuffer.pushConstants<PushConstants>(*pipelineLayout, vk::ShaderStageFlagBits::eRaygenKHR, 0,
+                                               pushConstants);
 
-        commandBuffer.pushConstants<uint32_t>(*pipelineLayout, vk::ShaderStageFlagBits::eClosestHitKHR, 0,
-                                              {settings.maxRecursionDepth});
+    vk::utils::imageBarrier(commandBuffer,
+                            *resultImage.getImage(),
+                            {vk::ImageAspectFlagBits::eColor, 0, 1, 0, 1},
+                            { /* srcAccessMask */},
+                            vk::AccessFlagBits::eShaderWrite,
+                            vk::ImageLayout::eUndefined,
+                            vk::ImageLayout::eGeneral);
 
+    // make the history written by the previous frame visible to this one
+    for (const auto *image: {&accumulationImages, &positionImages})
         vk::utils::imageBarrier(commandBuffer,
-                                *resultImage.getImage(),
-                                {vk::ImageAspectFlagBits::eColor, 0, 1, 0, 1},
-                                { /* srcAccessMask */},
+                                *image->getImage(),
+                                {vk::ImageAspectFlagBits::eColor, 0, 1, 0, VK_REMAINING_ARRAY_LAYERS},
                                 vk::AccessFlagBits::eShaderWrite,
-                                vk::ImageLayout::eUndefined,
+                                vk::AccessFlagBits::eShaderRead | vk::AccessFlagBits::eShaderWrite,
+                                vk::ImageLayout::eGeneral,
                                 vk::ImageLayout::eGeneral);
+    const vk::BufferMemoryBarrier reservoirBarrier(vk::AccessFlagBits::eShaderWrite,
+                                                   vk::AccessFlagBits::eShaderRead | vk::AccessFlagBits::eShaderWrite,
+                                                   VK_QUEUE_FAMILY_IGNORED, VK_QUEUE_FAMILY_IGNORED,
+                                                   *reservoirBuffer.getBuffer(), 0, VK_WHOLE_SIZE);
+    commandBuffer.pipelineBarrier(vk::PipelineStageFlagBits::eRayTracingShaderKHR,
+                                  vk::PipelineStageFlagBits::eRayTracingShaderKHR,
+                                  { /* dependencyFlags */ }, nullptr, reservoirBarrier, nullptr);
+
+    commandBuffer.writeTimestamp(vk::PipelineStageFlagBits::eTopOfPipe, *timestampQueryPool, 2 * imageIndex);
+    fillCommandBuffer(commandBuffer, imageIndex);
+    commandBuffer.writeTimestamp(vk::PipelineStageFlagBits::eRayTracingShaderKHR, *timestampQueryPool,
+                                 2 * imageIndex + 1);
+
+    // the denoised preview reads the accumulation once this frame's fence has signaled
+    if (readPreview) {
+        const vk::DeviceSize layerSize = static_cast<vk::DeviceSize>(renderExtent.width) * renderExtent.height *
+                                         sizeof(glm::vec4);
+        std::vector<vk::BufferImageCopy> copyRegions;
+        for (uint32_t aov: {AOV_COLOR, AOV_ALBEDO, AOV_NORMAL})
+            copyRegions.emplace_back(copyRegions.size() * layerSize, 0, 0,
+                                     vk::ImageSubresourceLayers(vk::ImageAspectFlagBits::eColor, 0,
+                                                                2 * aov + frameData.frameID.z, 1),
+                                     vk::Offset3D{0, 0, 0},
+                                     vk::Extent3D{renderExtent.width, renderExtent.height, 1});
 
-        fillCommandBuffer(commandBuffer);
+        vk::utils::imageBarrier(commandBuffer,
+                                *accumulationImages.getImage(),
+                                {vk::ImageAspectFlagBits::eColor, 0, 1, 0, VK_REMAINING_ARRAY_LAYERS},
+                                vk::AccessFlagBits::eShaderWrite,
+                                vk::AccessFlagBits::eTransferRead,
+                                vk::ImageLayout::eGeneral,
+                                vk::ImageLayout::eGeneral);
+        commandBuffer.copyImageToBuffer(*accumulationImages.getImage(), vk::ImageLayout::eGeneral,
+                                        *previewReadbackBuffer.getBuffer(), copyRegions);
+        const vk::BufferMemoryBarrier hostReadBarrier(vk::AccessFlagBits::eTransferWrite,
+                                                      vk::AccessFlagBits::eHostRead,
+                                                      VK_QUEUE_FAMILY_IGNORED, VK_QUEUE_FAMILY_IGNORED,
+                                                      *previewReadbackBuffer.getBuffer(), 0, VK_WHOLE_SIZE);
+        commandBuffer.pipelineBarrier(vk::PipelineStageFlagBits::eTransfer, vk::PipelineStageFlagBits::eHost,
+                                      { /* dependencyFlags */ }, nullptr, hostReadBarrier, nullptr);
+    }
 
+    vk::utils::imageBarrier(commandBuffer,
+                            swapchainImages[imageIndex],
+                            {vk::ImageAspectFlagBits::eColor, 0, 1, 0, 1},
+                            { /* srcAccessMask */},
+                            vk::AccessFlagBits::eTransferWrite,
+                            vk::ImageLayout::eUndefined,
+                            vk::ImageLayout::eTransferDstOptimal);
+
+    // the traced result is replaced by the last denoised frame if the denoised preview is shown
+    vk::Extent2D displayExtent = renderExtent;
+    if (denoisedPreview && denoisedExtent.width > 0) {
         vk::utils::imageBarrier(commandBuffer,
-                                swapchainImages[i],
+                                *resultImage.getImage(),
                                 {vk::ImageAspectFlagBits::eColor, 0, 1, 0, 1},
-                                { /* srcAccessMask */},
+                                vk::AccessFlagBits::eShaderWrite,
                                 vk::AccessFlagBits::eTransferWrite,
-                                vk::ImageLayout::eUndefined,
+                                vk::ImageLayout::eGeneral,
                                 vk::ImageLayout::eTransferDstOptimal);
 
+        const vk::DeviceSize halfSize = static_cast<vk::DeviceSize>(settings.windowWidth) * settings.windowHeight * 4;
+        vk::BufferImageCopy copyRegion(displayHalf * halfSize, 0, 0,
+                                       {vk::ImageAspectFlagBits::eColor, 0, 0, 1},
+                                       {0, 0, 0},
+                                       {denoisedExtent.width, denoisedExtent.height, 1});
+        commandBuffer.copyBufferToImage(*displayBuffer.getBuffer(), *resultImage.getImage(),
+                                        vk::ImageLayout::eTransferDstOptimal, copyRegion);
+
+        vk::utils::imageBarrier(commandBuffer,
+                                *resultImage.getImage(),
+                                {vk::ImageAspectFlagBits::eColor, 0, 1, 0, 1},
+                                vk::AccessFlagBits::eTransferWrite,
+                                vk::AccessFlagBits::eTransferRead,
+                                vk::ImageLayout::eTransferDstOptimal,
+                                vk::ImageLayout::eTransferSrcOptimal);
+        displayExtent = denoisedExtent;
+        displayHalfUse[displayHalf] = submittedFrames + 1; // recorded for the next submission
+    } else {
         vk::utils::imageBarrier(commandBuffer,
                                 *resultImage.getImage(),
                                 {vk::ImageAspectFlagBits::eColor, 0, 1, 0, 1},
@@ -396,54 +838,97 @@ void PathTracerApp::fillCommandBuffers() {
                                 vk::AccessFlagBits::eTransferRead,
                                 vk::ImageLayout::eGeneral,
                                 vk::ImageLayout::eTransferSrcOptimal);
-
-        vk::ImageCopy copyRegion({vk::ImageAspectFlagBits::eColor, 0, 0, 1},
-                                 {0, 0, 0},
-                                 {vk::ImageAspectFlagBits::eColor, 0, 0, 1},
-                                 {0, 0, 0},
-                                 {settings.windowWidth, settings.windowHeight, 1});
-
-        commandBuffer.copyImage(*resultImage.getImage(),
-                                vk::ImageLayout::eTransferSrcOptimal,
-                                swapchainImages[i],
-                                vk::ImageLayout::eTransferDstOptimal,
-                                copyRegion);
-
-        vk::utils::imageBarrier(commandBuffer, swapchainImages[i],
-                                {vk::ImageAspectFlagBits::eColor, 0, 1, 0, 1},
-                                vk::AccessFlagBits::eTransferWrite,
-                                { /* dstAccessMask */},
-                                vk::ImageLayout::eTransferDstOptimal,
-                                vk::ImageLayout::ePresentSrcKHR);
-
-        commandBuffer.end();
     }
 
+    // the rendered region is upsampled to the window size in preview mode
+    vk::ImageBlit blitRegion({vk::ImageAspectFlagBits::eColor, 0, 0, 1},
+                             {vk::Offset3D{0, 0, 0},
+                              vk::Offset3D{static_cast<int32_t>(displayExtent.width),
+                                           static_cast<int32_t>(displayExtent.height), 1}},
+                             {vk::ImageAspectFlagBits::eColor, 0, 0, 1},
+                             {vk::Offset3D{0, 0, 0},
+                              vk::Offset3D{static_cast<int32_t>(settings.windowWidth),
+                                           static_cast<int32_t>(settings.windowHeight), 1}});
+
+    commandBuffer.blitImage(*resultImage.getImage(),
+                            vk::ImageLayout::eTransferSrcOptimal,
+                            swapchainImages[imageIndex],
+                            vk::ImageLayout::eTransferDstOptimal,
+                            blitRegion,
+                            vk::Filter::eLinear);
+
+    vk::utils::imageBarrier(commandBuffer, swapchainImages[imageIndex],
+                            {vk::ImageAspectFlagBits::eColor, 0, 1, 0, 1},
+                            vk::AccessFlagBits::eTransferWrite,
+                            { /* dstAccessMask */},
+                            vk::ImageLayout::eTransferDstOptimal,
+                            vk::ImageLayout::ePresentSrcKHR);
+
+    commandBuffer.end();
 }
 
-void PathTracerApp::fillCommandBuffer(const vk::raii::CommandBuffer &commandBuffer) {
+void PathTracerApp::fillCommandBuffer(const vk::raii::CommandBuffer &commandBuffer, uint32_t imageIndex) {
     commandBuffer.bindPipeline(vk::PipelineBindPoint::eRayTracingKHR, *pipelineRT);
 
     std::vector<vk::DescriptorSet> sets{};
     std::for_each(descriptorSets.begin(), descriptorSets.end(),
                   [&sets](const auto &e) { sets.push_back(*e); });
 
-    commandBuffer.bindDescriptorSets(vk::PipelineBindPoint::eRayTracingKHR, *pipelineLayout, 0, sets, { /* dynamicOffsets */ });
+    // the frame data of the command buffer's swapchain image
+    const auto frameDataOffset = static_cast<uint32_t>(imageIndex * frameDataStride);
+    commandBuffer.bindDescriptorSets(vk::PipelineBindPoint::eRayTracingKHR, *pipelineLayout, 0, sets, frameDataOffset);
 
     // our shader binding table layout:
-    // |[ raygen ]|[miss]|[closest hit]|
-    // | 0        | 1    | 2           |
+    // |[ raygen ]|[diagnostics raygen]|[miss]|[shadow miss]|[closest hit]|[light raygen]|
+    // | 0        | 1                  | 2    | 3           | 4           | 5            |
 
     uint32_t sbtChunkSize =
             (pipelineProperties.shaderGroupHandleSize + (pipelineProperties.shaderGroupBaseAlignment - 1)) &
             (~(pipelineProperties.shaderGroupBaseAlignment - 1));
 
+    // Light paths are splatted onto the film first, the camera paths add the film to their pixels. Both passes share
+    // the miss and hit groups.
+    if (tracesLights()) {
+        // the camera paths of the previous frame may still read the film
+        const vk::BufferMemoryBarrier readBarrier(vk::AccessFlagBits::eShaderRead, vk::AccessFlagBits::eTransferWrite,
+                                                  VK_QUEUE_FAMILY_IGNORED, VK_QUEUE_FAMILY_IGNORED,
+                                                  *splatBuffer.getBuffer(), 0, VK_WHOLE_SIZE);
+        commandBuffer.pipelineBarrier(vk::PipelineStageFlagBits::eRayTracingShaderKHR,
+                                      vk::PipelineStageFlagBits::eTransfer,
+                                      { /* dependencyFlags */ }, nullptr, readBarrier, nullptr);
+        commandBuffer.fillBuffer(*splatBuffer.getBuffer(), 0, VK_WHOLE_SIZE, 0);
+        const vk::BufferMemoryBarrier clearBarrier(vk::AccessFlagBits::eTransferWrite,
+                                                   vk::AccessFlagBits::eShaderRead | vk::AccessFlagBits::eShaderWrite,
+                                                   VK_QUEUE_FAMILY_IGNORED, VK_QUEUE_FAMILY_IGNORED,
+                                                   *splatBuffer.getBuffer(), 0, VK_WHOLE_SIZE);
+        commandBuffer.pipelineBarrier(vk::PipelineStageFlagBits::eTransfer,
+                                      vk::PipelineStageFlagBits::eRayTracingShaderKHR,
+                                      { /* dependencyFlags */ }, nullptr, clearBarrier, nullptr);
+
+        commandBuffer.traceRaysKHR(
+                vk::StridedDeviceAddressRegionKHR(shaderBindingTable.getAddress() + 5u * sbtChunkSize, sbtChunkSize,
+                                                  sbtChunkSize),
+                vk::StridedDeviceAddressRegionKHR(shaderBindingTable.getAddress() + 2u * sbtChunkSize, sbtChunkSize,
+                                                  2u * sbtChunkSize),
+                vk::StridedDeviceAddressRegionKHR(shaderBindingTable.getAddress() + 4u * sbtChunkSize, sbtChunkSize,
+                                                  sbtChunkSize),
+                vk::StridedDeviceAddressRegionKHR(0u, 0u, 0u),
+                renderExtent.width, renderExtent.height, 1);
+
+        const vk::BufferMemoryBarrier splatBarrier(vk::AccessFlagBits::eShaderWrite, vk::AccessFlagBits::eShaderRead,
+                                                   VK_QUEUE_FAMILY_IGNORED, VK_QUEUE_FAMILY_IGNORED,
+                                                   *splatBuffer.getBuffer(), 0, VK_WHOLE_SIZE);
+        commandBuffer.pipelineBarrier(vk::PipelineStageFlagBits::eRayTracingShaderKHR,
+                                      vk::PipelineStageFlagBits::eRayTracingShaderKHR,
+                                      { /* dependencyFlags */ }, nullptr, splatBarrier, nullptr);
+    }
+
     std::array strideAddresses{
-            vk::StridedDeviceAddressRegionKHR(shaderBindingTable.getAddress() + 0u * sbtChunkSize, sbtChunkSize,
-                                              sbtChunkSize),
-            vk::StridedDeviceAddressRegionKHR(shaderBindingTable.getAddress() + 1u * sbtChunkSize, sbtChunkSize,
-                                              sbtChunkSize),
+            vk::StridedDeviceAddressRegionKHR(shaderBindingTable.getAddress() + (diagnostics ? 1u : 0u) * sbtChunkSize,
+                                              sbtChunkSize, sbtChunkSize),
             vk::StridedDeviceAddressRegionKHR(shaderBindingTable.getAddress() + 2u * sbtChunkSize, sbtChunkSize,
+                                              2u * sbtChunkSize),
+            vk::StridedDeviceAddressRegionKHR(shaderBindingTable.getAddress() + 4u * sbtChunkSize, sbtChunkSize,
                                               sbtChunkSize),
             vk::StridedDeviceAddressRegionKHR(0u, 0u, 0u)
     };
@@ -451,20 +936,21 @@ void PathTracerApp::fillCommandBuffer(const vk::raii::CommandBuffer &commandBuff
                                strideAddresses[1],
                                strideAddresses[2],
                                strideAddresses[3],
-                               settings.windowWidth, settings.windowHeight, 1);
+                               renderExtent.width, renderExtent.height, 1);
 }
 
 // create either a bottom level acceleration structure containing geometries or
 // a top level acceleration structure containing all bottom level instances
 void PathTracerApp::createAS(const vk::AccelerationStructureTypeKHR &type,
                              const vk::AccelerationStructureGeometryKHR &_geometry,
+                             uint32_t primitiveCount,
                              vk::utils::RTAccelerationStructure &_as) {
     vk::AccelerationStructureGeometryKHR geometry;
     std::size_t geometryCount = 0;
 
     if (type == vk::AccelerationStructureTypeKHR::eBottomLevel) {
         geometry = _geometry;
-        geometryCount = geometry.geometry.triangles.maxVertex;
+        geometryCount = primitiveCount;
     } else if (type == vk::AccelerationStructureTypeKHR::eTopLevel) {
         vk::TransformMatrixKHR transform({{
                                                   {{1., 0., 0., 0.}},
@@ -493,8 +979,17 @@ void PathTracerApp::createAS(const vk::AccelerationStructureTypeKHR &type,
         geometry = {vk::GeometryTypeKHR::eInstances, {instancesData}, { /* flags */ }};
     }
 
+    // compaction is only worth it for bottom level structures which hold the actual geometry
+    const bool compact = type == vk::AccelerationStructureTypeKHR::eBottomLevel &&
+                         settings.compactAccelerationStructures;
+
+    vk::BuildAccelerationStructureFlagsKHR buildFlags = settings.buildQuality == BuildQuality::fastBuild
+                                                        ? vk::BuildAccelerationStructureFlagBitsKHR::ePreferFastBuild
+                                                        : vk::BuildAccelerationStructureFlagBitsKHR::ePreferFastTrace;
+    if (compact) buildFlags |= vk::BuildAccelerationStructureFlagBitsKHR::eAllowCompaction;
+
     vk::AccelerationStructureBuildGeometryInfoKHR geometryInfo(type,
-                                                               { /* flags */},
+                                                               buildFlags,
                                                                vk::BuildAccelerationStructureModeKHR::eBuild,
                                                                { /* srcAccelerationStructure */},
                                                                { /* dstAccelerationStructure */},
@@ -526,34 +1021,100 @@ void PathTracerApp::createAS(const vk::AccelerationStructureTypeKHR &type,
                                             vk::BufferUsageFlagBits::eShaderDeviceAddress |
                                             vk::BufferUsageFlagBits::eAccelerationStructureStorageKHR |
                                             vk::BufferUsageFlagBits::eStorageBuffer},
-                                    vk::MemoryPropertyFlagBits::eDeviceLocal);
+                                    vk::MemoryPropertyFlagBits::eDeviceLocal,
+                                    vk::utils::AllocationStrategy::linear); // freed right after the build
     geometryInfo.scratchData.deviceAddress = scratchBuffer.getAddress();
+    _as.uncompactedSize = sizeInfo.accelerationStructureSize;
+
+    vk::raii::QueryPool queryPool(VK_NULL_HANDLE);
+    if (compact)
+        queryPool = device.createQueryPool({{ /* flags */ }, vk::QueryType::eAccelerationStructureCompactedSizeKHR, 1});
+    vk::raii::QueryPool buildTimestampQueryPool = device.createQueryPool(
+            {{ /* flags */ }, vk::QueryType::eTimestamp, 2});
 
     commandBuffers[0].begin({vk::CommandBufferUsageFlagBits::eOneTimeSubmit});
 
+    commandBuffers[0].resetQueryPool(*buildTimestampQueryPool, 0, 2);
+    commandBuffers[0].writeTimestamp(vk::PipelineStageFlagBits::eTopOfPipe, *buildTimestampQueryPool, 0);
+
     vk::AccelerationStructureBuildRangeInfoKHR buildRangeInfo(geometryCount, 0, 0, 0);
     commandBuffers[0].buildAccelerationStructuresKHR(geometryInfo, &buildRangeInfo);
 
+    commandBuffers[0].writeTimestamp(vk::PipelineStageFlagBits::eAccelerationStructureBuildKHR,
+                                     *buildTimestampQueryPool, 1);
+
+    if (compact) {
+        // the compacted size can only be queried once the build has finished
+        vk::MemoryBarrier buildBarrier(vk::AccessFlagBits::eAccelerationStructureWriteKHR,
+                                       vk::AccessFlagBits::eAccelerationStructureReadKHR);
+        commandBuffers[0].pipelineBarrier(vk::PipelineStageFlagBits::eAccelerationStructureBuildKHR,
+                                          vk::PipelineStageFlagBits::eAccelerationStructureBuildKHR,
+                                          {},
+                                          buildBarrier,
+                                          nullptr,
+                                          nullptr);
+        commandBuffers[0].resetQueryPool(*queryPool, 0, 1);
+        commandBuffers[0].writeAccelerationStructuresPropertiesKHR(*_as.accelerationStructure,
+                                                                   vk::QueryType::eAccelerationStructureCompactedSizeKHR,
+                                                                   *queryPool,
+                                                                   0);
+    }
+
     commandBuffers[0].end();
     graphicsQueue.submit(vk::SubmitInfo(VK_NULL_HANDLE, VK_NULL_HANDLE, *commandBuffers[0], VK_NULL_HANDLE));
     graphicsQueue.waitIdle();
-}
 
-// load scene data from obj file into acceleration structure
-void PathTracerApp::createScene() {
-    frameDataBuffer = {{{ /* flags */ }, sizeof(frameData), vk::BufferUsageFlagBits::eUniformBuffer},
-                       vk::MemoryPropertyFlagBits::eHostVisible};
-    frameDataBuffer.uploadData(&frameData, sizeof(frameData));
+    auto [timestampResult, timestamps] = buildTimestampQueryPool.getResults<uint64_t>(0, 2, 2 * sizeof(uint64_t),
+                                                                                      sizeof(uint64_t),
+                                                                                      vk::QueryResultFlagBits::e64 |
+                                                                                      vk::QueryResultFlagBits::eWait);
+    check_vk_result(timestampResult);
+    _as.buildTime = static_cast<float>(timestamps[1] - timestamps[0]) * timestampPeriod * 1e-6f;
+
+    if (compact) {
+        auto [result, compactedSizes] = queryPool.getResults<vk::DeviceSize>(0, 1, sizeof(vk::DeviceSize),
+                                                                             sizeof(vk::DeviceSize),
+                                                                             vk::QueryResultFlagBits::e64 |
+                                                                             vk::QueryResultFlagBits::eWait);
+        check_vk_result(result);
+        const vk::DeviceSize compactedSize = compactedSizes.front();
+
+        // copy into a tightly sized acceleration structure and release the original one
+        vk::utils::Buffer compactedBuffer({
+                                                  { /* flags */},
+                                                  compactedSize,
+                                                  vk::BufferUsageFlagBits::eShaderDeviceAddress |
+                                                  vk::BufferUsageFlagBits::eAccelerationStructureStorageKHR,
+                                                  vk::SharingMode::eExclusive},
+                                          vk::MemoryPropertyFlagBits::eDeviceLocal);
+
+        vk::raii::AccelerationStructureKHR compactedAS = device.createAccelerationStructureKHR(
+                {{ /* createFlags */},
+                 *compactedBuffer.getBuffer(),
+                 { /* offset */},
+                 compactedSize,
+                 type});
+
+        commandBuffers[0].begin({vk::CommandBufferUsageFlagBits::eOneTimeSubmit});
+        commandBuffers[0].copyAccelerationStructureKHR({*_as.accelerationStructure,
+                                                        *compactedAS,
+                                                        vk::CopyAccelerationStructureModeKHR::eCompact});
+        commandBuffers[0].end();
+        graphicsQueue.submit(vk::SubmitInfo(VK_NULL_HANDLE, VK_NULL_HANDLE, *commandBuffers[0], VK_NULL_HANDLE));
+        graphicsQueue.waitIdle();
+
+        _as.accelerationStructure = std::move(compactedAS);
+        _as.buffer = std::move(compactedBuffer);
+    }
+}
 
-    std::string fileName = "../models/" + settings.modelName + ".obj";
+// parse obj file and write its shapes, converted to the layout used on the GPU, into a scene cache
+void PathTracerApp::convertObj(const std::string &fileName, SceneCache::Writer &cacheWriter) {
     tinyobj::ObjReaderConfig readerConfig;
     tinyobj::ObjReader reader;
 
-    if (!reader.ParseFromFile(fileName, readerConfig)) {
-        if (!reader.Error().empty())
-            std::cerr << "TinyObjReader: " << reader.Error();
-        exit(1);
-    }
+    if (!reader.ParseFromFile(fileName, readerConfig))
+        throw std::runtime_error("Could not parse " + fileName + ": " + reader.Error());
 
     if (!reader.Warning().empty())
         std::cout << "TinyObjReader: " << reader.Warning();
@@ -562,27 +1123,70 @@ void PathTracerApp::createScene() {
     auto &shapes = reader.GetShapes();
     auto &materials = reader.GetMaterials();
 
-    std::unordered_map<glm::vec4, uint32_t> uniqueVertices{};
+    // triangles with edges longer than a fraction of the scene diagonal are split if the budget allows it
+    glm::vec3 sceneMin(std::numeric_limits<float>::max());
+    glm::vec3 sceneMax(std::numeric_limits<float>::lowest());
+    for (size_t i = 0; i + 2 < attrib.vertices.size(); i += 3) {
+        const glm::vec3 vertex(attrib.vertices[i + 0], attrib.vertices[i + 1], attrib.vertices[i + 2]);
+        sceneMin = glm::min(sceneMin, vertex);
+        sceneMax = glm::max(sceneMax, vertex);
+    }
+    const float maxEdgeLength = glm::length(sceneMax - sceneMin) / 32.0f;
 
+    size_t triangleCount = 0;
+    size_t maxShapeIndexCount = 0;
     for (const auto &shape: shapes) {
-        std::vector<glm::vec4> vertices{};
-        std::vector<uint32_t> indices{};
-        std::vector<Material> newMaterials{};
+        triangleCount += shape.mesh.indices.size() / 3;
+        maxShapeIndexCount = std::max(maxShapeIndexCount, shape.mesh.indices.size());
+    }
+    size_t splitBudget = static_cast<size_t>(settings.triangleSplitBudget * static_cast<float>(triangleCount));
+
+    // Scratch arrays are allocated once for the largest shape and reused for every shape, so without triangle
+    // splitting the conversion allocates a constant number of times instead of several times per shape and once
+    // per vertex. splitLongTriangles still allocates a hash map node per edge of the shapes it splits.
+    // Vertices are deduplicated by remapping their OBJ vertex index to the shape local index through a flat table
+    // instead of hashing their positions. Distinct OBJ vertices at the same position are therefore no longer merged,
+    // and as splitLongTriangles finds the triangle on the other side of an edge through shared indices, such seams
+    // may open T-junctions when split.
+    std::vector<uint32_t> shapeVertexIndices(attrib.vertices.size() / 3, ~0u);
+    std::vector<int> objVertexIndices{};
+    std::vector<glm::vec4> vertices{};
+    std::vector<uint32_t> indices{};
+    std::vector<Material> newMaterials{};
+    std::vector<glm::vec4> normals{};
+    objVertexIndices.reserve(maxShapeIndexCount);
+    vertices.reserve(maxShapeIndexCount);
+    indices.reserve(maxShapeIndexCount);
+    newMaterials.reserve(maxShapeIndexCount / 3);
+    normals.reserve(maxShapeIndexCount / 3);
+
+    for (const auto &shape: shapes) {
+        // reset remap table entries of the previous shape
+        for (const int objVertexIndex: objVertexIndices)
+            shapeVertexIndices[objVertexIndex] = ~0u;
+        objVertexIndices.clear();
+        vertices.clear();
+        indices.clear();
+        newMaterials.clear();
+        normals.clear();
+
         for (const auto &index: shape.mesh.indices) {
-            glm::vec4 vertex{
-                    attrib.vertices[3 * index.vertex_index + 0],
-                    attrib.vertices[3 * index.vertex_index + 1],
-                    attrib.vertices[3 * index.vertex_index + 2],
-                    1
-            };
-
-            if (uniqueVertices.count(vertex) == 0) {
-                uniqueVertices[vertex] = static_cast<uint32_t>(vertices.size());
-                vertices.push_back(vertex);
+            if (index.vertex_index < 0 || static_cast<size_t>(index.vertex_index) >= shapeVertexIndices.size())
+                throw std::runtime_error(fileName + ": shape " + shape.name + " references a missing vertex");
+            uint32_t &shapeVertexIndex = shapeVertexIndices[index.vertex_index];
+            if (shapeVertexIndex == ~0u) {
+                shapeVertexIndex = static_cast<uint32_t>(vertices.size());
+                objVertexIndices.push_back(index.vertex_index);
+                vertices.emplace_back(attrib.vertices[3 * index.vertex_index + 0],
+                                      attrib.vertices[3 * index.vertex_index + 1],
+                                      attrib.vertices[3 * index.vertex_index + 2],
+                                      1);
             }
-            indices.push_back(uniqueVertices[vertex]);
+            indices.push_back(shapeVertexIndex);
         }
         for (const auto &index: shape.mesh.material_ids) {
+            if (index < 0 || static_cast<size_t>(index) >= materials.size())
+                throw std::runtime_error(fileName + ": shape " + shape.name + " has a face without material");
             Material material{};
             material.emittance = {materials[index].ambient[0],
                                   materials[index].ambient[1],
@@ -594,63 +1198,447 @@ void PathTracerApp::createScene() {
                                     materials[index].shininess};
             newMaterials.push_back(material);
         }
-        scene.vertexBuffers.emplace_back(
-                vk::BufferCreateInfo({ /* flags */ }, sizeof(glm::vec4) * vertices.size(), vk::BufferUsageFlagBits::eStorageBuffer |
-                                                                              vk::BufferUsageFlagBits::eAccelerationStructureStorageKHR |
-                                                                              vk::BufferUsageFlagBits::eShaderDeviceAddress |
-                                                                              vk::BufferUsageFlagBits::eAccelerationStructureBuildInputReadOnlyKHR),
-                vk::MemoryPropertyFlagBits::eHostVisible |
-                vk::MemoryPropertyFlagBits::eHostCoherent);
 
-        scene.vertexBuffers.back().uploadData(vertices.data(), scene.vertexBuffers.back().getSize());
+        if (splitBudget > 0)
+            splitBudget -= splitLongTriangles(vertices, indices, newMaterials, maxEdgeLength, splitBudget);
+
+        // face normals are precomputed per triangle, so hits don't have to fetch vertices through the index buffer
+        if (settings.precomputeTriangleData) {
+            for (size_t i = 0; i + 2 < indices.size(); i += 3) {
+                const glm::vec3 v1(vertices[indices[i + 0]]);
+                const glm::vec3 v2(vertices[indices[i + 1]]);
+                const glm::vec3 v3(vertices[indices[i + 2]]);
+                const glm::vec3 normal = glm::cross(v2 - v1, v3 - v1);
+                const float length = glm::length(normal);
+                // rays never hit a triangle without area, it just needs a unit normal instead of NaN
+                normals.emplace_back(length > 0.0f && std::isfinite(length) ? normal / length : glm::vec3(0, 1, 0),
+                                     0.f);
+            }
+        }
 
-        scene.indexBuffers.emplace_back(
-                vk::BufferCreateInfo({ /* flags */ }, sizeof(uint32_t) * indices.size(), vk::BufferUsageFlagBits::eStorageBuffer |
-                                                                            vk::BufferUsageFlagBits::eAccelerationStructureStorageKHR |
-                                                                            vk::BufferUsageFlagBits::eShaderDeviceAddress |
-                                                                            vk::BufferUsageFlagBits::eAccelerationStructureBuildInputReadOnlyKHR),
-                vk::MemoryPropertyFlagBits::eHostVisible |
-                vk::MemoryPropertyFlagBits::eHostCoherent);
+        cacheWriter.addShape(vertices, indices, newMaterials, normals);
+    }
+    cacheWriter.finish();
+
+    if (settings.triangleSplitBudget > 0)
+        std::cout << "Split triangles: "
+                  << static_cast<size_t>(settings.triangleSplitBudget * static_cast<float>(triangleCount)) - splitBudget
+                  << " added to " << triangleCount << std::endl;
+}
+
+SceneCache::Key PathTracerApp::openSceneCache(const std::string &modelName, SceneCache &cache) {
+    const std::string fileName = "../models/" + modelName + ".obj";
+    const std::string cacheFileName = "../models/" + modelName + ".scenecache";
+    const SceneCache::Key cacheKey = SceneCache::makeKey(fileName, settings.precomputeTriangleData,
+                                                         settings.triangleSplitBudget);
+
+    const bool cacheHit = settings.reuseSceneCache && cache.open(cacheFileName, cacheKey);
+    if (!cacheHit) {
+        const auto conversionStart = std::chrono::steady_clock::now();
+        SceneCache::Writer cacheWriter(cacheFileName, cacheKey);
+        convertObj(fileName, cacheWriter);
+        if (!cache.open(cacheFileName, cacheKey))
+            throw std::runtime_error("Could not open scene cache " + cacheFileName);
+        const std::chrono::duration<float, std::milli> conversionTime =
+                std::chrono::steady_clock::now() - conversionStart;
+        std::cout << "Scene cache miss, converted " << fileName << " in " << conversionTime.count() << " ms"
+                  << std::endl;
+    }
+    if (cache.getShapeCount() == 0)
+        throw std::runtime_error(fileName + " has no triangles");
+    return cacheKey;
+}
+
+// load scene data from the opened scene cache into acceleration structures
+void PathTracerApp::createScene(const SceneCache &cache, const SceneCache::Key &cacheKey) {
+    const auto loadStart = std::chrono::steady_clock::now();
+
+    sceneKey = cacheKey;
+
+    // The converted scene is memory mapped and uploaded one shape at a time. Pages of uploaded shapes are released
+    // again, so host memory holds about one shape at a time instead of the whole parsed obj plus per-shape copies.
+
+#ifndef _WIN32
+    rusage usage{};
+    getrusage(RUSAGE_SELF, &usage);
+    const long majorFaultsBefore = usage.ru_majflt;
+#endif
+
+    glm::vec3 sceneMin(std::numeric_limits<float>::max());
+    glm::vec3 sceneMax(std::numeric_limits<float>::lowest());
+
+    const size_t shapeCount = cache.getShapeCount();
+    std::vector<glm::vec3> shapeCenters(shapeCount);
+    std::vector<uint64_t> shapeTriangleCounts(shapeCount);
+    // the bounds are stored apart from the shape data, so grouping shapes doesn't read their vertices from disk
+    for (size_t shapeIndex = 0; shapeIndex < shapeCount; ++shapeIndex) {
+        const SceneCache::Shape shape = cache.getShape(shapeIndex);
+        sceneMin = glm::min(sceneMin, shape.boundsMin);
+        sceneMax = glm::max(sceneMax, shape.boundsMax);
+        shapeCenters[shapeIndex] = (shape.boundsMin + shape.boundsMax) * 0.5f;
+        shapeTriangleCounts[shapeIndex] = shape.indexCount / 3;
+    }
+
+    // Small shapes are merged into objects of nearby shapes, so the scene has far fewer buffers, descriptors and
+    // bottom level structures. Without flattening every shape is an object of its own.
+    std::vector<std::vector<size_t>> objects;
+    if (settings.flattenShapes) {
+        objects = groupShapes(shapeCenters, shapeTriangleCounts, sceneMin, sceneMax, settings.maxObjectTriangles);
+    } else {
+        for (size_t shapeIndex = 0; shapeIndex < shapeCount; ++shapeIndex)
+            objects.push_back({shapeIndex});
+    }
 
-        scene.indexBuffers.back().uploadData(indices.data(), scene.indexBuffers.back().getSize());
+    // Shape data is read during traversal, so it lives in device local memory. It is staged through a ring buffer and
+    // copied on the transfer queue while the next shapes are read from the cache.
+    vk::utils::StagingRing stagingRing(device, transferQueue,
+                                       queueFamilyIndices[vk::utils::QueueFamilyIndex::transfer]);
+
+    // the transfer queue writes the buffers and the graphics queue reads them, possibly from different families
+    std::vector<uint32_t> sharingFamilies{queueFamilyIndices[vk::utils::QueueFamilyIndex::graphics]};
+    if (queueFamilyIndices[vk::utils::QueueFamilyIndex::transfer] != sharingFamilies.front())
+        sharingFamilies.push_back(queueFamilyIndices[vk::utils::QueueFamilyIndex::transfer]);
+    auto sceneBufferInfo = [&sharingFamilies](vk::DeviceSize size, vk::BufferUsageFlags usage) {
+        vk::BufferCreateInfo bufferInfo({ /* flags */ }, size, usage | vk::BufferUsageFlagBits::eTransferDst);
+        if (sharingFamilies.size() > 1)
+            bufferInfo.setSharingMode(vk::SharingMode::eConcurrent).setQueueFamilyIndices(sharingFamilies);
+        return bufferInfo;
+    };
 
+    std::vector<uint64_t> vertexCounts;
+    std::vector<uint64_t> triangleCounts;
+    std::vector<uint32_t> objectIndices;
+    LightTree lightTree;
+    sceneFeatures = {};
+    const bool normals = shapeCount > 0 && cache.getShape(0).normals;
+
+    // An object concatenates the vertices and triangles of its shapes. Per triangle data follows the order of the
+    // triangles, so it is still addressed by gl_PrimitiveID, and indices are offset by the first vertex of their shape.
+    for (const auto &object: objects) {
+        uint64_t vertexCount = 0;
+        uint64_t triangleCount = 0;
+        for (const size_t shapeIndex: object) {
+            vertexCount += cache.getShape(shapeIndex).vertexCount;
+            triangleCount += shapeTriangleCounts[shapeIndex];
+        }
+        vertexCounts.push_back(vertexCount);
+        triangleCounts.push_back(triangleCount);
+
+        if (normals) {
+            scene.normalBuffers.emplace_back(
+                    sceneBufferInfo(sizeof(glm::vec4) * triangleCount,
+                                    vk::BufferUsageFlagBits::eStorageBuffer |
+                                    vk::BufferUsageFlagBits::eShaderDeviceAddress),
+                    vk::MemoryPropertyFlagBits::eDeviceLocal);
+        }
+        scene.vertexBuffers.emplace_back(
+                sceneBufferInfo(sizeof(glm::vec4) * vertexCount, vk::BufferUsageFlagBits::eStorageBuffer |
+                                                                 vk::BufferUsageFlagBits::eAccelerationStructureStorageKHR |
+                                                                 vk::BufferUsageFlagBits::eShaderDeviceAddress |
+                                                                 vk::BufferUsageFlagBits::eAccelerationStructureBuildInputReadOnlyKHR),
+                vk::MemoryPropertyFlagBits::eDeviceLocal);
+        scene.indexBuffers.emplace_back(
+                sceneBufferInfo(sizeof(uint32_t) * 3 * triangleCount, vk::BufferUsageFlagBits::eStorageBuffer |
+                                                                      vk::BufferUsageFlagBits::eAccelerationStructureStorageKHR |
+                                                                      vk::BufferUsageFlagBits::eShaderDeviceAddress |
+                                                                      vk::BufferUsageFlagBits::eAccelerationStructureBuildInputReadOnlyKHR),
+                vk::MemoryPropertyFlagBits::eDeviceLocal);
         scene.materialBuffers.emplace_back(
-                vk::BufferCreateInfo({ /* flags */ }, sizeof(Material) * newMaterials.size(),
-                                     vk::BufferUsageFlagBits::eStorageBuffer |
-                                     vk::BufferUsageFlagBits::eShaderDeviceAddress),
-                vk::MemoryPropertyFlagBits::eHostVisible |
-                vk::MemoryPropertyFlagBits::eHostCoherent);
+                sceneBufferInfo(sizeof(Material) * triangleCount,
+                                vk::BufferUsageFlagBits::eStorageBuffer |
+                                vk::BufferUsageFlagBits::eShaderDeviceAddress),
+                vk::MemoryPropertyFlagBits::eDeviceLocal);
+
+        uint64_t firstVertex = 0;
+        uint64_t firstTriangle = 0;
+        for (const size_t shapeIndex: object) {
+            const SceneCache::Shape shape = cache.getShape(shapeIndex);
+            const uint64_t shapeTriangles = shapeTriangleCounts[shapeIndex];
+
+            objectIndices.assign(shape.indices, shape.indices + shape.indexCount);
+            for (uint32_t &index: objectIndices)
+                index += static_cast<uint32_t>(firstVertex);
+
+            stagingRing.upload(scene.vertexBuffers.back(), shape.vertices, sizeof(glm::vec4) * shape.vertexCount,
+                               sizeof(glm::vec4) * firstVertex);
+            stagingRing.upload(scene.indexBuffers.back(), objectIndices.data(), sizeof(uint32_t) * shape.indexCount,
+                               sizeof(uint32_t) * 3 * firstTriangle);
+            stagingRing.upload(scene.materialBuffers.back(), shape.materials, sizeof(Material) * shapeTriangles,
+                               sizeof(Material) * firstTriangle);
+            if (normals)
+                stagingRing.upload(scene.normalBuffers.back(), shape.normals, sizeof(glm::vec4) * shapeTriangles,
+                                   sizeof(glm::vec4) * firstTriangle);
+
+            lightTree.addShape(shape.vertices, shape.indices, shape.materials, shapeTriangles);
+            for (uint64_t i = 0; i < shapeTriangles; ++i) {
+                const Material &material = shape.materials[i];
+                const bool mirror = material.reflectance.w == 1.0f;
+                sceneFeatures.mirrors |= mirror;
+                sceneFeatures.diffuse |= !mirror;
+                sceneFeatures.emitters |= !mirror && glm::vec3(material.emittance) != glm::vec3(0.0f);
+            }
+
+            // the data has been copied into the staging ring
+            cache.release(shapeIndex);
 
-        scene.materialBuffers.back().uploadData(newMaterials.data(), scene.materialBuffers.back().getSize());
+            firstVertex += shape.vertexCount;
+            firstTriangle += shapeTriangles;
+        }
+    }
 
+    const size_t buffersPerObject = normals ? 4 : 3;
+    std::cout << "Scene objects: " << shapeCount << " shapes " << (settings.flattenShapes ? "flattened into " : "as ")
+              << objects.size() << " objects, " << buffersPerObject * objects.size() << " buffers and "
+              << objects.size() << " bottom level structures instead of " << buffersPerObject * shapeCount << " and "
+              << shapeCount << std::endl;
+
+    // the light tree is built over the same triangles as the bottom level structures and uploaded with them
+    const auto lightTreeStart = std::chrono::steady_clock::now();
+    lightTree.build();
+    const std::vector<LightNode> &lightNodes = lightTree.getNodes();
+    const std::vector<LightTriangle> &lightTriangles = lightTree.getTriangles();
+    scene.lightNodeBuffer = {sceneBufferInfo(sizeof(LightNode) * lightNodes.size(),
+                                             vk::BufferUsageFlagBits::eStorageBuffer),
+                             vk::MemoryPropertyFlagBits::eDeviceLocal};
+    scene.lightTriangleBuffer = {sceneBufferInfo(sizeof(LightTriangle) * lightTriangles.size(),
+                                                 vk::BufferUsageFlagBits::eStorageBuffer),
+                                 vk::MemoryPropertyFlagBits::eDeviceLocal};
+    stagingRing.upload(scene.lightNodeBuffer, lightNodes.data(), sizeof(LightNode) * lightNodes.size());
+    stagingRing.upload(scene.lightTriangleBuffer, lightTriangles.data(),
+                       sizeof(LightTriangle) * lightTriangles.size());
+    const std::chrono::duration<float, std::milli> lightTreeTime = std::chrono::steady_clock::now() - lightTreeStart;
+    lightCount = lightTree.getLightCount();
+    std::cout << "Light tree: " << lightTree.getLightCount() << " emissive triangles, " << lightNodes.size()
+              << " nodes, depth " << lightTree.getDepth() << ", built in " << lightTreeTime.count() << " ms"
+              << std::endl;
+
+    // acceleration structure builds on the graphics queue start once the last copy is done
+    stagingRing.waitOnQueue(graphicsQueue, stagingRing.flush());
+
+    const vk::utils::StagingRing::Statistics &stagingStatistics = stagingRing.getStatistics();
+    std::cout << "Staged " << stagingStatistics.uploadedBytes / 1024 << " KiB in " << stagingStatistics.copyCount
+              << " copies and " << stagingStatistics.submissionCount << " transfer submissions, "
+              << stagingStatistics.stallCount << " stalls on a full ring" << std::endl;
+
+    for (size_t objectIndex = 0; objectIndex < objects.size(); ++objectIndex) {
+        // the highest vertex index, an object without vertices has no triangles either and keeps 0
+        const auto maxVertex = static_cast<uint32_t>(std::max<uint64_t>(vertexCounts[objectIndex], 1) - 1);
         vk::AccelerationStructureGeometryKHR geometry(vk::GeometryTypeKHR::eTriangles,
                                                       {{
                                                                vk::Format::eR32G32B32A32Sfloat,
-                                                               scene.vertexBuffers.back().getAddress(),
+                                                               scene.vertexBuffers[objectIndex].getAddress(),
                                                                sizeof(glm::vec4),
-                                                               static_cast<uint32_t>(indices.size()),
+                                                               maxVertex,
                                                                vk::IndexType::eUint32,
-                                                               scene.indexBuffers.back().getAddress()}},
+                                                               scene.indexBuffers[objectIndex].getAddress()}},
                                                       vk::GeometryFlagBitsKHR::eOpaque);
 
         scene.bottomLevelAS.emplace_back();
 
         createAS(vk::AccelerationStructureTypeKHR::eBottomLevel,
                  geometry,
+                 static_cast<uint32_t>(triangleCounts[objectIndex]),
                  scene.bottomLevelAS.back());
     }
-    createAS(vk::AccelerationStructureTypeKHR::eTopLevel, { /* geometry */ }, scene.topLevelAS);
+    createAS(vk::AccelerationStructureTypeKHR::eTopLevel, { /* geometry */ }, 0, scene.topLevelAS);
+
+    frameData.sceneMin = {sceneMin, 1.0f};
+    frameData.sceneMax = {sceneMax, 1.0f};
+
+    // the normal descriptor array can't be empty, so bind a placeholder which is never read
+    if (!settings.precomputeTriangleData) {
+        scene.normalBuffers.emplace_back(
+                vk::BufferCreateInfo({ /* flags */ }, sizeof(glm::vec4), vk::BufferUsageFlagBits::eStorageBuffer),
+                vk::MemoryPropertyFlagBits::eHostVisible |
+                vk::MemoryPropertyFlagBits::eHostCoherent);
+    }
+
+    // report acceleration structure build time and memory footprint,
+    // traversal cost of the chosen build quality shows up as trace time in the window title
+    vk::DeviceSize uncompactedSize = scene.topLevelAS.uncompactedSize;
+    vk::DeviceSize finalSize = scene.topLevelAS.buffer.getSize();
+    float buildTime = scene.topLevelAS.buildTime;
+    for (const auto &bottomLevelAS: scene.bottomLevelAS) {
+        uncompactedSize += bottomLevelAS.uncompactedSize;
+        finalSize += bottomLevelAS.buffer.getSize();
+        buildTime += bottomLevelAS.buildTime;
+    }
+    std::cout << "Acceleration structures: " << finalSize / 1024 << " KiB";
+    if (settings.compactAccelerationStructures)
+        std::cout << " (compacted from " << uncompactedSize / 1024 << " KiB)";
+    std::cout << ", built in " << buildTime << " ms preferring fast "
+              << (settings.buildQuality == BuildQuality::fastBuild ? "build" : "trace") << std::endl;
+
+    const std::chrono::duration<float, std::milli> loadTime = std::chrono::steady_clock::now() - loadStart;
+    std::cout << "Scene loaded from the cache in " << loadTime.count() << " ms";
+#ifndef _WIN32
+    getrusage(RUSAGE_SELF, &usage);
+    std::cout << ", " << usage.ru_majflt - majorFaultsBefore << " pages read from disk during upload"
+              << ", peak RSS " << usage.ru_maxrss / 1024 << " MiB"; // ru_maxrss is in KiB on Linux
+#endif
+    std::cout << std::endl;
+    std::cout << "Device memory: " << memoryAllocator->getStatistics().toString() << std::endl;
+}
+
+// Split triangles along their longest edge until no edge is longer than maxEdgeLength or budget triangles were added.
+// Long, thin triangles have large bounding boxes which overlap everything around them, splitting them lets the
+// acceleration structure builder bound the geometry tightly, similar to spatial splits in an SBVH.
+// The triangle on the other side of a split edge is split as well, so no T-junctions (cracks) are introduced. Edges
+// are matched by vertex index, shapes whose OBJ file repeats vertices along a seam aren't protected across it.
+// Returns the number of added triangles.
+size_t PathTracerApp::splitLongTriangles(std::vector<glm::vec4> &vertices,
+                                         std::vector<uint32_t> &indices,
+                                         std::vector<Material> &materials,
+                                         float maxEdgeLength,
+                                         size_t budget) {
+    struct EdgeTriangles {
+        std::array<uint32_t, 2> triangles;
+        uint32_t count;
+    };
+    std::unordered_map<uint64_t, EdgeTriangles> edges{};
+    edges.reserve(indices.size() * 2);
+
+    auto edgeKey = [](uint32_t a, uint32_t b) {
+        return (static_cast<uint64_t>(std::min(a, b)) << 32) | std::max(a, b);
+    };
+    auto addEdge = [&](uint32_t a, uint32_t b, uint32_t triangle) {
+        auto &edge = edges[edgeKey(a, b)];
+        if (edge.count < 2) edge.triangles[edge.count] = triangle;
+        edge.count++;
+    };
+    auto replaceEdgeTriangle = [&](uint32_t a, uint32_t b, uint32_t oldTriangle, uint32_t newTriangle) {
+        auto &edge = edges[edgeKey(a, b)];
+        for (auto &triangle: edge.triangles)
+            if (triangle == oldTriangle) triangle = newTriangle;
+    };
+    // returns the local index of the first vertex of the longest edge and its squared length
+    auto longestEdge = [&](uint32_t triangle) {
+        std::pair<uint32_t, float> longest{0, 0.0f};
+        for (uint32_t i = 0; i < 3; ++i) {
+            const glm::vec3 a(vertices[indices[3 * triangle + i]]);
+            const glm::vec3 b(vertices[indices[3 * triangle + (i + 1) % 3]]);
+            const float lengthSquared = glm::dot(b - a, b - a);
+            if (lengthSquared > longest.second) longest = {i, lengthSquared};
+        }
+        return longest;
+    };
+
+    // longest triangles are split first
+    std::priority_queue<std::pair<float, uint32_t>> queue;
+    for (uint32_t triangle = 0; triangle < indices.size() / 3; ++triangle) {
+        for (uint32_t i = 0; i < 3; ++i)
+            addEdge(indices[3 * triangle + i], indices[3 * triangle + (i + 1) % 3], triangle);
+        queue.emplace(longestEdge(triangle).second, triangle);
+    }
+
+    // split triangle at edge (a, b) into two halves sharing the new vertex m, keeping the winding order
+    auto split = [&](uint32_t triangle, uint32_t a, uint32_t b, uint32_t m) {
+        uint32_t first = 0;
+        while (!((indices[3 * triangle + first] == a && indices[3 * triangle + (first + 1) % 3] == b) ||
+                 (indices[3 * triangle + first] == b && indices[3 * triangle + (first + 1) % 3] == a)))
+            first++;
+        const uint32_t p0 = indices[3 * triangle + first];
+        const uint32_t p1 = indices[3 * triangle + (first + 1) % 3];
+        const uint32_t p2 = indices[3 * triangle + (first + 2) % 3];
+        const auto newTriangle = static_cast<uint32_t>(indices.size() / 3);
+
+        indices[3 * triangle + 0] = p0;
+        indices[3 * triangle + 1] = m;
+        indices[3 * triangle + 2] = p2;
+        indices.insert(indices.end(), {m, p1, p2});
+        materials.push_back(materials[triangle]);
+
+        replaceEdgeTriangle(p1, p2, triangle, newTriangle);
+        addEdge(p0, m, triangle);
+        addEdge(m, p1, newTriangle);
+        addEdge(m, p2, triangle);
+        addEdge(m, p2, newTriangle);
+
+        queue.emplace(longestEdge(triangle).second, triangle);
+        queue.emplace(longestEdge(newTriangle).second, newTriangle);
+    };
+
+    const float maxEdgeLengthSquared = maxEdgeLength * maxEdgeLength;
+    size_t addedTriangles = 0;
+    while (!queue.empty() && addedTriangles < budget) {
+        const auto [lengthSquared, triangle] = queue.top();
+        queue.pop();
+
+        const auto [first, currentLengthSquared] = longestEdge(triangle);
+        if (currentLengthSquared != lengthSquared) continue; // triangle has been split since it was queued
+        if (currentLengthSquared <= maxEdgeLengthSquared) break;
+
+        const uint32_t a = indices[3 * triangle + first];
+        const uint32_t b = indices[3 * triangle + (first + 1) % 3];
+        const EdgeTriangles edge = edges[edgeKey(a, b)];
+        if (edge.count > 2) continue; // splitting non-manifold edges would leave cracks
+        if (addedTriangles + edge.count > budget) continue; // both sides of a shared edge are split or neither
+
+        const auto m = static_cast<uint32_t>(vertices.size());
+        vertices.push_back((vertices[a] + vertices[b]) * 0.5f);
+        edges.erase(edgeKey(a, b));
+
+        for (uint32_t i = 0; i < edge.count; ++i) {
+            split(edge.triangles[i], a, b, m);
+            addedTriangles++;
+        }
+    }
+    return addedTriangles;
+}
+
+// Group shapes into objects of at most maxTriangles triangles, unless a single shape is larger. Shapes are ordered along
+// a Morton curve through their centers, so consecutive shapes and thereby the members of an object are close in space
+// and the bounding boxes of the objects overlap little.
+std::vector<std::vector<size_t>> PathTracerApp::groupShapes(const std::vector<glm::vec3> &centers,
+                                                            const std::vector<uint64_t> &triangleCounts,
+                                                            glm::vec3 sceneMin,
+                                                            glm::vec3 sceneMax,
+                                                            uint64_t maxTriangles) {
+    // spread the lower 10 bits of v, so two zero bits follow each of them
+    auto expandBits = [](uint32_t v) {
+        v = (v * 0x00010001u) & 0xFF0000FFu;
+        v = (v * 0x00000101u) & 0x0F00F00Fu;
+        v = (v * 0x00000011u) & 0xC30C30C3u;
+        v = (v * 0x00000005u) & 0x49249249u;
+        return v;
+    };
+
+    const glm::vec3 extent = glm::max(sceneMax - sceneMin, glm::vec3(1e-6f));
+    std::vector<std::pair<uint32_t, size_t>> mortonCodes(centers.size());
+    for (size_t i = 0; i < centers.size(); ++i) {
+        const glm::vec3 cell = glm::clamp((centers[i] - sceneMin) / extent * 1024.0f, 0.0f, 1023.0f);
+        mortonCodes[i] = {expandBits(static_cast<uint32_t>(cell.x)) << 2 |
+                          expandBits(static_cast<uint32_t>(cell.y)) << 1 |
+                          expandBits(static_cast<uint32_t>(cell.z)), i};
+    }
+    std::sort(mortonCodes.begin(), mortonCodes.end());
+
+    std::vector<std::vector<size_t>> groups;
+    uint64_t groupTriangles = 0;
+    for (const auto &[code, shapeIndex]: mortonCodes) {
+        if (groups.empty() || groupTriangles + triangleCounts[shapeIndex] > maxTriangles) {
+            groups.emplace_back();
+            groupTriangles = 0;
+        }
+        groups.back().push_back(shapeIndex);
+        groupTriangles += triangleCounts[shapeIndex];
+    }
+    return groups;
 }
 
 // create raytracing pipeline with shaders and associated data
 void PathTracerApp::createRaytracingPipeline() {
     // acceleration structure and resulting image layout bindings
     std::vector<vk::DescriptorSetLayoutBinding> bindingsRayGen{
-            {0, vk::DescriptorType::eAccelerationStructureKHR, 1,
-                                                                  vk::ShaderStageFlagBits::eRaygenKHR |
-                                                                  vk::ShaderStageFlagBits::eClosestHitKHR},
+            {0, vk::DescriptorType::eAccelerationStructureKHR, 1, vk::ShaderStageFlagBits::eRaygenKHR},
             {1, vk::DescriptorType::eStorageImage,             1, vk::ShaderStageFlagBits::eRaygenKHR},
-            {2, vk::DescriptorType::eUniformBuffer,            1, vk::ShaderStageFlagBits::eRaygenKHR}
+            {2, vk::DescriptorType::eUniformBufferDynamic,     1, vk::ShaderStageFlagBits::eRaygenKHR},
+            {3, vk::DescriptorType::eStorageImage,             1, vk::ShaderStageFlagBits::eRaygenKHR},
+            {4, vk::DescriptorType::eStorageImage,             1, vk::ShaderStageFlagBits::eRaygenKHR},
+            {5, vk::DescriptorType::eStorageBuffer,            1, vk::ShaderStageFlagBits::eRaygenKHR},
+            {6, vk::DescriptorType::eStorageBuffer,            1, vk::ShaderStageFlagBits::eRaygenKHR},
+            {7, vk::DescriptorType::eStorageBuffer,            1, vk::ShaderStageFlagBits::eRaygenKHR},
+            {8, vk::DescriptorType::eStorageBuffer,            1, vk::ShaderStageFlagBits::eRaygenKHR}
     };
     std::vector<vk::DescriptorSetLayoutBinding> bindingVertexBuffer{
             {0, vk::DescriptorType::eStorageBuffer, static_cast<uint32_t>(scene.vertexBuffers.size()),
@@ -661,38 +1649,109 @@ void PathTracerApp::createRaytracingPipeline() {
     std::vector<vk::DescriptorSetLayoutBinding> bindingMaterialBuffer{
             {0, vk::DescriptorType::eStorageBuffer, static_cast<uint32_t>(scene.materialBuffers.size()),
              vk::ShaderStageFlagBits::eClosestHitKHR}};
+    std::vector<vk::DescriptorSetLayoutBinding> bindingNormalBuffer{
+            {0, vk::DescriptorType::eStorageBuffer, static_cast<uint32_t>(scene.normalBuffers.size()),
+             vk::ShaderStageFlagBits::eClosestHitKHR}};
 
     descriptorSetLayouts.push_back(device.createDescriptorSetLayout({{ /* flags */ }, bindingsRayGen}));
     descriptorSetLayouts.push_back(device.createDescriptorSetLayout({{ /* flags */ }, bindingVertexBuffer}));
     descriptorSetLayouts.push_back(device.createDescriptorSetLayout({{ /* flags */ }, bindingIndexBuffer}));
     descriptorSetLayouts.push_back(device.createDescriptorSetLayout({{ /* flags */ }, bindingMaterialBuffer}));
+    descriptorSetLayouts.push_back(device.createDescriptorSetLayout({{ /* flags */ }, bindingNormalBuffer}));
 
     std::vector<vk::DescriptorSetLayout> layouts{};
     std::for_each(descriptorSetLayouts.begin(), descriptorSetLayouts.end(),
                   [&layouts](const auto &e) { layouts.push_back(*e); });
 
-    vk::PushConstantRange pushConstantRange(vk::ShaderStageFlagBits::eClosestHitKHR, 0, sizeof(uint32_t));
+    // maximum path depth, render mode and light sampling of the ray generation shader
+    vk::PushConstantRange pushConstantRange(vk::ShaderStageFlagBits::eRaygenKHR, 0, sizeof(PushConstants));
 
     pipelineLayout = device.createPipelineLayout({{ /* flags */ }, layouts, pushConstantRange});
 
-    vk::utils::Shader rayGenShader("../shaderBin/rayGen.bin", vk::ShaderStageFlagBits::eRaygenKHR);
+    // Reordering threads costs time on its own, it only pays off if there are enough rays in flight to regroup.
+    const uint32_t minReorderBatchSize = 512 * 512;
+    const bool reorderRays = settings.allowRayReordering && rayReorderingSupported &&
+                             settings.windowWidth * settings.windowHeight >= minReorderBatchSize;
+    std::cout << "Ray reordering: " << (reorderRays ? "on" : "off") << std::endl;
+
+    vk::utils::Shader rayGenShader(reorderRays ? "../shaderBin/rayGenSER.bin" : "../shaderBin/rayGen.bin",
+                                   vk::ShaderStageFlagBits::eRaygenKHR);
+    // without shader clock support the diagnostics group falls back to the regular shader and is never used
+    vk::utils::Shader rayGenDiagnosticsShader(diagnosticsSupported ? "../shaderBin/rayGenDiagnostics.bin"
+                                                                   : "../shaderBin/rayGen.bin",
+                                              vk::ShaderStageFlagBits::eRaygenKHR);
+    vk::utils::Shader rayGenLightShader(atomicFloatSupported ? "../shaderBin/rayGenLightAtomicFloat.bin"
+                                                             : "../shaderBin/rayGenLight.bin",
+                                        vk::ShaderStageFlagBits::eRaygenKHR);
     vk::utils::Shader rayMissShader("../shaderBin/rayMiss.bin", vk::ShaderStageFlagBits::eMissKHR);
+    vk::utils::Shader rayMissShadowShader("../shaderBin/rayMissShadow.bin", vk::ShaderStageFlagBits::eMissKHR);
     vk::utils::Shader rayChitShader("../shaderBin/rayChit.bin", vk::ShaderStageFlagBits::eClosestHitKHR);
+    vk::utils::Shader rayAhitShader("../shaderBin/rayAhit.bin", vk::ShaderStageFlagBits::eAnyHitKHR);
+
+    // Closest hit and ray generation shaders are specialized for the scene, the driver removes the branches for
+    // materials it doesn't contain, light sampling without lights and a variable path depth. The generic shaders keep
+    // all of them.
+    const bool specialize = settings.specializeShaders;
+    const bool fixedDepth = !settings.dynamicResolution || isUnattended(); // no previews at a lower depth
+    const struct {
+        VkBool32 precomputedNormals;
+        SceneFeatures features;
+    } rayChitConstants{settings.precomputeTriangleData,
+                       specialize ? sceneFeatures : SceneFeatures{VK_TRUE, VK_TRUE, VK_TRUE}};
+    const std::array<vk::SpecializationMapEntry, 4> rayChitEntries{{
+            {0, 0, sizeof(VkBool32)},
+            {1, sizeof(VkBool32), sizeof(VkBool32)},
+            {2, 2 * sizeof(VkBool32), sizeof(VkBool32)},
+            {3, 3 * sizeof(VkBool32), sizeof(VkBool32)}}};
+    const vk::SpecializationInfo rayChitSpecialization(rayChitEntries.size(), rayChitEntries.data(),
+                                                       sizeof(rayChitConstants), &rayChitConstants);
+
+    const struct {
+        VkBool32 sceneHasLights;
+        uint32_t fixedMaxDepth;
+    } rayGenConstants{!specialize || lightCount > 0, specialize && fixedDepth ? settings.maxRecursionDepth : 0u};
+    const std::array<vk::SpecializationMapEntry, 2> rayGenEntries{{
+            {0, 0, sizeof(VkBool32)},
+            {1, sizeof(VkBool32), sizeof(uint32_t)}}};
+    const vk::SpecializationInfo rayGenSpecialization(rayGenEntries.size(), rayGenEntries.data(),
+                                                      sizeof(rayGenConstants), &rayGenConstants);
+
+    std::cout << "Shaders: " << (specialize ? "specialized for" : "generic, scene has")
+              << (sceneFeatures.mirrors ? " mirrors" : "") << (sceneFeatures.diffuse ? " diffuse" : "")
+              << (sceneFeatures.emitters ? " emitters" : "") << ", " << lightCount << " lights, path depth "
+              << (rayGenConstants.fixedMaxDepth > 0 ? "fixed" : "variable") << std::endl;
+
+    vk::PipelineShaderStageCreateInfo rayChitStage = rayChitShader.getShaderStage();
+    rayChitStage.pSpecializationInfo = &rayChitSpecialization;
+    vk::PipelineShaderStageCreateInfo rayGenStage = rayGenShader.getShaderStage();
+    rayGenStage.pSpecializationInfo = &rayGenSpecialization;
+    vk::PipelineShaderStageCreateInfo rayGenDiagnosticsStage = rayGenDiagnosticsShader.getShaderStage();
+    rayGenDiagnosticsStage.pSpecializationInfo = &rayGenSpecialization;
 
     std::vector<vk::PipelineShaderStageCreateInfo> shaderStages{
-            rayGenShader.getShaderStage(),
+            rayGenStage,
+            rayGenDiagnosticsStage,
             rayMissShader.getShaderStage(),
-            rayChitShader.getShaderStage()
-
+            rayMissShadowShader.getShaderStage(),
+            rayChitStage,
+            rayAhitShader.getShaderStage(),
+            rayGenLightShader.getShaderStage()
     };
     std::vector<vk::RayTracingShaderGroupCreateInfoKHR> shaderGroups = {
             {vk::RayTracingShaderGroupTypeKHR::eGeneral, 0, VK_SHADER_UNUSED_KHR,           VK_SHADER_UNUSED_KHR, VK_SHADER_UNUSED_KHR},
             {vk::RayTracingShaderGroupTypeKHR::eGeneral, 1, VK_SHADER_UNUSED_KHR,           VK_SHADER_UNUSED_KHR, VK_SHADER_UNUSED_KHR},
-            {vk::RayTracingShaderGroupTypeKHR::eTrianglesHitGroup, VK_SHADER_UNUSED_KHR, 2, VK_SHADER_UNUSED_KHR, VK_SHADER_UNUSED_KHR}
+            {vk::RayTracingShaderGroupTypeKHR::eGeneral, 2, VK_SHADER_UNUSED_KHR,           VK_SHADER_UNUSED_KHR, VK_SHADER_UNUSED_KHR},
+            {vk::RayTracingShaderGroupTypeKHR::eGeneral, 3, VK_SHADER_UNUSED_KHR,           VK_SHADER_UNUSED_KHR, VK_SHADER_UNUSED_KHR},
+            // the any hit shader only runs for rays traced with gl_RayFlagsNoOpaqueEXT, as all geometry is opaque
+            {vk::RayTracingShaderGroupTypeKHR::eTrianglesHitGroup, VK_SHADER_UNUSED_KHR, 4, 5, VK_SHADER_UNUSED_KHR},
+            {vk::RayTracingShaderGroupTypeKHR::eGeneral, 6, VK_SHADER_UNUSED_KHR,           VK_SHADER_UNUSED_KHR, VK_SHADER_UNUSED_KHR}
     };
 
+    // rays are only traced from the ray generation shader, hit shaders never recurse
+    const uint32_t maxPipelineRayRecursionDepth = 1;
+
     pipelineRT = device.createRayTracingPipelineKHR(VK_NULL_HANDLE, VK_NULL_HANDLE,
-                                                    {{ /* flags */ }, shaderStages, shaderGroups, settings.maxRecursionDepth, { /* libraryInfo */ }, { /* libraryInterface */ },
+                                                    {{ /* flags */ }, shaderStages, shaderGroups, maxPipelineRayRecursionDepth, { /* libraryInfo */ }, { /* libraryInterface */ },
                                                      { /* dynamicState */ }, *pipelineLayout});
 }
 
@@ -702,7 +1761,7 @@ void PathTracerApp::createShaderBindingTable() {
             (pipelineProperties.shaderGroupHandleSize + (pipelineProperties.shaderGroupBaseAlignment - 1)) &
             (~(pipelineProperties.shaderGroupBaseAlignment - 1));
 
-    const uint32_t numGroups = 3;
+    const uint32_t numGroups = 6;
     const uint32_t shaderBindingTableSize = pipelineProperties.shaderGroupHandleSize * numGroups;
     const uint32_t shaderBindingTableSizeAligned = sbtChunkSize * numGroups;
 
@@ -715,9 +1774,10 @@ void PathTracerApp::createShaderBindingTable() {
     auto shaderGroupHandles = pipelineRT.getRayTracingShaderGroupHandlesKHR<uint8_t>(0, numGroups,
                                                                                      shaderBindingTableSize);
     std::vector<uint8_t> shaderGroupHandlesAligned(shaderBindingTableSizeAligned);
-    for (int i = 0; i < numGroups; ++i)
-        shaderGroupHandlesAligned[i * sbtChunkSize] = shaderGroupHandles[i *
-                                                                         pipelineProperties.shaderGroupHandleSize];
+    for (uint32_t i = 0; i < numGroups; ++i)
+        std::memcpy(shaderGroupHandlesAligned.data() + i * sbtChunkSize,
+                    shaderGroupHandles.data() + i * pipelineProperties.shaderGroupHandleSize,
+                    pipelineProperties.shaderGroupHandleSize);
 
     shaderBindingTable.uploadData(shaderGroupHandlesAligned.data(), shaderBindingTableSizeAligned);
 }
@@ -727,11 +1787,15 @@ void PathTracerApp::createDescriptorSets() {
     // Not sure if two pools are necessary
     std::vector<vk::DescriptorPoolSize> poolSizesRayGen{
             {vk::DescriptorType::eAccelerationStructureKHR, 1},
-            {vk::DescriptorType::eStorageImage,             1},
-            {vk::DescriptorType::eUniformBuffer,            1}
+            {vk::DescriptorType::eStorageImage,             3},
+            {vk::DescriptorType::eUniformBufferDynamic,     1},
+            {vk::DescriptorType::eStorageBuffer,            4}
     };
     std::vector<vk::DescriptorPoolSize> poolSizesCHit{
-            {vk::DescriptorType::eStorageBuffer, static_cast<uint32_t>(scene.bottomLevelAS.size())}};
+            {vk::DescriptorType::eStorageBuffer, static_cast<uint32_t>(scene.vertexBuffers.size() +
+                                                                       scene.indexBuffers.size() +
+                                                                       scene.materialBuffers.size() +
+                                                                       scene.normalBuffers.size())}};
     // Validation layers want the freeDescriptorSet flag to be set for destroying pools when exiting
     descriptorPoolRayGen = device.createDescriptorPool(
             {vk::DescriptorPoolCreateFlagBits::eFreeDescriptorSet, 1, poolSizesRayGen});
@@ -739,7 +1803,7 @@ void PathTracerApp::createDescriptorSets() {
             {vk::DescriptorPoolCreateFlagBits::eFreeDescriptorSet, 4, poolSizesCHit});
 
     std::vector<vk::DescriptorSetLayout> layoutsCHit{*descriptorSetLayouts[1], *descriptorSetLayouts[2],
-                                                     *descriptorSetLayouts[3]};
+                                                     *descriptorSetLayouts[3], *descriptorSetLayouts[4]};
 
     descriptorSets.push_back(
             std::move(device.allocateDescriptorSets({*descriptorPoolRayGen, *descriptorSetLayouts[0]}).front()));
@@ -760,11 +1824,41 @@ void PathTracerApp::createDescriptorSets() {
     vk::WriteDescriptorSet resultImageWrite(*descriptorSets[0], 1, 0, 1, vk::DescriptorType::eStorageImage,
                                             &descriptorOutputImageInfo);
 
-    // set 0, binding 2: instance data buffer
-    vk::DescriptorBufferInfo descriptorFrameDataBufferInfo(*frameDataBuffer.getBuffer(), 0, frameDataBuffer.getSize());
-    vk::WriteDescriptorSet frameDataWrite(*descriptorSets[0], 2, 0, vk::DescriptorType::eUniformBuffer, { /* imageInfo */ },
+    // set 0, binding 2: frame data, the offset of the swapchain image is given when binding
+    vk::DescriptorBufferInfo descriptorFrameDataBufferInfo(*frameDataBuffer.getBuffer(), 0, sizeof(FrameData));
+    vk::WriteDescriptorSet frameDataWrite(*descriptorSets[0], 2, 0, vk::DescriptorType::eUniformBufferDynamic, { /* imageInfo */ },
                                           descriptorFrameDataBufferInfo);
 
+    // set 0, binding 3 and 4: accumulation and first hit position history
+    vk::DescriptorImageInfo descriptorAccumulationImageInfo(VK_NULL_HANDLE, *accumulationImages.getImageView(),
+                                                            vk::ImageLayout::eGeneral);
+    vk::WriteDescriptorSet accumulationImageWrite(*descriptorSets[0], 3, 0, 1, vk::DescriptorType::eStorageImage,
+                                                  &descriptorAccumulationImageInfo);
+    vk::DescriptorImageInfo descriptorPositionImageInfo(VK_NULL_HANDLE, *positionImages.getImageView(),
+                                                        vk::ImageLayout::eGeneral);
+    vk::WriteDescriptorSet positionImageWrite(*descriptorSets[0], 4, 0, 1, vk::DescriptorType::eStorageImage,
+                                              &descriptorPositionImageInfo);
+
+    // set 0, binding 5 and 6: light tree nodes and the emissive triangles
+    vk::DescriptorBufferInfo descriptorLightNodeBufferInfo(*scene.lightNodeBuffer.getBuffer(), 0,
+                                                           scene.lightNodeBuffer.getSize());
+    vk::WriteDescriptorSet lightNodeWrite(*descriptorSets[0], 5, 0, vk::DescriptorType::eStorageBuffer, { /* imageInfo */ },
+                                          descriptorLightNodeBufferInfo);
+    vk::DescriptorBufferInfo descriptorLightTriangleBufferInfo(*scene.lightTriangleBuffer.getBuffer(), 0,
+                                                               scene.lightTriangleBuffer.getSize());
+    vk::WriteDescriptorSet lightTriangleWrite(*descriptorSets[0], 6, 0, vk::DescriptorType::eStorageBuffer,
+                                              { /* imageInfo */ }, descriptorLightTriangleBufferInfo);
+
+    // set 0, binding 7: direct light reservoirs
+    vk::DescriptorBufferInfo descriptorReservoirBufferInfo(*reservoirBuffer.getBuffer(), 0, reservoirBuffer.getSize());
+    vk::WriteDescriptorSet reservoirWrite(*descriptorSets[0], 7, 0, vk::DescriptorType::eStorageBuffer, { /* imageInfo */ },
+                                          descriptorReservoirBufferInfo);
+
+    // set 0, binding 8: light splatted by the light tracing pass
+    vk::DescriptorBufferInfo descriptorSplatBufferInfo(*splatBuffer.getBuffer(), 0, splatBuffer.getSize());
+    vk::WriteDescriptorSet splatWrite(*descriptorSets[0], 8, 0, vk::DescriptorType::eStorageBuffer, { /* imageInfo */ },
+                                      descriptorSplatBufferInfo);
+
     // set 1, binding 0: vertex buffers for each instance (shape)
     std::vector<vk::DescriptorBufferInfo> descriptorVertexBufferInfos{};
     for (const auto &buffer: scene.vertexBuffers)
@@ -786,9 +1880,18 @@ void PathTracerApp::createDescriptorSets() {
     vk::WriteDescriptorSet materialWrite(*descriptorSets[3], 0, 0, vk::DescriptorType::eStorageBuffer, { /* imageInfo */},
                                          descriptorMaterialBufferInfos);
 
+    // set 4, binding 0: face normal buffers for each instance (shape)
+    std::vector<vk::DescriptorBufferInfo> descriptorNormalBufferInfos{};
+    for (const auto &buffer: scene.normalBuffers)
+        descriptorNormalBufferInfos.emplace_back(*buffer.getBuffer(), 0, buffer.getSize());
+    vk::WriteDescriptorSet normalWrite(*descriptorSets[4], 0, 0, vk::DescriptorType::eStorageBuffer, { /* imageInfo */},
+                                       descriptorNormalBufferInfos);
+
     std::vector<vk::WriteDescriptorSet> descriptorWrites{accelerationStructureWrite,
                                                          resultImageWrite, frameDataWrite,
-                                                         vertexWrite, indexWrite, materialWrite};
+                                                         accumulationImageWrite, positionImageWrite,
+                                                         lightNodeWrite, lightTriangleWrite, reservoirWrite, splatWrite,
+                                                         vertexWrite, indexWrite, materialWrite, normalWrite};
 
     device.updateDescriptorSets(descriptorWrites, VK_NULL_HANDLE);
 }
@@ -802,14 +1905,38 @@ void PathTracerApp::drawFrame(const float dt) {
     const vk::Fence &fence = *waitForFrameFences[imageIndex];
     auto error = device.waitForFences(fence, VK_TRUE, UINT64_MAX);
     check_vk_result(error);
+    completedFrames = std::max(completedFrames, imageSubmissions[imageIndex]);
+
+    // the previous submission of this command buffer has finished, so its timestamps are available
+    auto [queryResult, timestamps] = timestampQueryPool.getResults<uint64_t>(2 * imageIndex, 2,
+                                                                             2 * sizeof(uint64_t),
+                                                                             sizeof(uint64_t),
+                                                                             vk::QueryResultFlagBits::e64);
+    if (queryResult == vk::Result::eSuccess)
+        traceTime = static_cast<float>(timestamps[1] - timestamps[0]) * timestampPeriod * 1e-6f;
 
     device.resetFences(fence);
 
-    // reset image on camera movement
-    if (updateCamera(dt))
-        frameData.frameID.x = 0;
+    frameData.previousCameraPos = frameData.cameraPos;
+    frameData.previousCameraDir = frameData.cameraDir;
+    frameData.previousCameraUp = frameData.cameraUp;
+    frameData.previousCameraSide = frameData.cameraSide;
+    frameData.previousCameraNearFarFOV = frameData.cameraNearFarFOV;
+
+    const vk::Extent2D previousRenderExtent = renderExtent;
+    const bool cameraMoved = updateCamera(dt);
+    updateRenderQuality(cameraMoved);
+
+    // on camera movement or resolution change the history is reprojected instead of being discarded
+    frameData.frameID.y = cameraMoved || renderExtent != previousRenderExtent;
+    frameData.renderSize = {renderExtent.width, renderExtent.height,
+                            previousRenderExtent.width, previousRenderExtent.height};
+
+    const bool readPreview = updateDenoisedPreview(cameraMoved);
+    recordCommandBuffer(imageIndex, readPreview);
 
-    frameDataBuffer.uploadData(&frameData, sizeof(frameData));
+    // the fence of this image has signaled, so no frame in flight reads its frame data anymore
+    frameDataBuffer.uploadData(&frameData, sizeof(frameData), imageIndex * frameDataStride);
 
     vk::PipelineStageFlags waitStageMask(vk::PipelineStageFlagBits::eColorAttachmentOutput);
     graphicsQueue.submit(vk::SubmitInfo(*semaphoreImageAvailable,
@@ -817,6 +1944,9 @@ void PathTracerApp::drawFrame(const float dt) {
                                         *commandBuffers[imageIndex],
                                         *semaphoreRenderFinished),
                          fence);
+    imageSubmissions[imageIndex] = ++submittedFrames;
+    if (readPreview)
+        previewReadbackFrame = submittedFrames;
 
     error = graphicsQueue.presentKHR(vk::PresentInfoKHR(*semaphoreRenderFinished,
                                                         *swapchain,
@@ -825,6 +1955,32 @@ void PathTracerApp::drawFrame(const float dt) {
     check_vk_result(error);
 
     frameData.frameID.x++;
+    frameData.frameID.z ^= 1u;
+}
+
+// While the camera moves, frames are traced at a reduced resolution and path depth to stay interactive. The resolution
+// scale is steered by the measured trace time towards the frame time target and full quality is restored as soon as
+// the camera stops.
+void PathTracerApp::updateRenderQuality(bool cameraMoved) {
+    const bool preview = settings.dynamicResolution && cameraMoved;
+
+    if (preview && previewActive && traceTime > 0) {
+        // trace time is proportional to the number of pixels, i.e. to the square of the scale, corrections are
+        // limited as the measured frame was traced at an older scale
+        const float scaleCorrection = std::clamp(std::sqrt(settings.targetFrameTime / traceTime), 0.8f, 1.25f);
+        previewScale = std::clamp(previewScale * scaleCorrection, settings.minResolutionScale, 1.0f);
+    }
+    previewActive = preview;
+
+    const float scale = preview ? previewScale : 1.0f;
+    renderExtent = vk::Extent2D(std::max(1u, static_cast<uint32_t>(static_cast<float>(fullExtent.width) * scale)),
+                                std::max(1u, static_cast<uint32_t>(static_cast<float>(fullExtent.height) * scale)));
+
+    // samples traced with a different path depth are biased differently, so they are not mixed
+    const uint32_t depth = preview ? settings.previewRecursionDepth : settings.maxRecursionDepth;
+    if (depth != renderDepth)
+        frameData.frameID.x = 0;
+    renderDepth = depth;
 }
 
 bool PathTracerApp::updateCamera(const float dt) {
@@ -884,6 +2040,12 @@ void PathTracerApp::keyCallback(GLFWwindow *callbackWindow, int key, int scancod
         else if (key == GLFW_KEY_Q) inputs.qPressed = false;
         else if (key == GLFW_KEY_E) inputs.ePressed = false;
         else if (key == GLFW_KEY_P) exportImage();
+        else if (key == GLFW_KEY_O) toggleAmbientOcclusion();
+        else if (key == GLFW_KEY_N) toggleDenoisedPreview();
+        else if (key == GLFW_KEY_H) toggleDiagnostics();
+        else if (key == GLFW_KEY_L) cycleLightSampling();
+        else if (key == GLFW_KEY_R) cycleResampling();
+        else if (key == GLFW_KEY_T) toggleLightTracing();
     }
 }
 
@@ -901,6 +2063,198 @@ void PathTracerApp::scrollCallback(GLFWwindow *callbackWindow, double xOffset, d
     inputs.scrollOffset = static_cast<float>(yOffset);
 }
 
+// switch between path tracing and ambient occlusion, accumulated samples of the other mode are discarded
+void PathTracerApp::toggleAmbientOcclusion() {
+    settings.renderMode = settings.renderMode == RENDER_MODE_AMBIENT_OCCLUSION ? RENDER_MODE_PATH_TRACING
+                                                                               : RENDER_MODE_AMBIENT_OCCLUSION;
+    frameData.frameID.x = 0;
+}
+
+// switch to the instrumented ray generation shader, the accumulation restarts so all AOVs cover the same samples
+void PathTracerApp::toggleDiagnostics() {
+    if (!diagnosticsSupported) {
+        std::cerr << "Diagnostics require shader clock support" << std::endl;
+        return;
+    }
+    diagnostics = !diagnostics;
+    frameData.frameID.x = 0;
+}
+
+// switch between the light sampling strategies, which converge to the same image with different noise
+void PathTracerApp::cycleLightSampling() {
+    settings.lightSampling = (settings.lightSampling + 1) % (LIGHT_SAMPLING_TREE + 1);
+    const char *names[] = {"off", "power", "light tree"};
+    std::cout << "Light sampling: " << names[settings.lightSampling] << std::endl;
+    frameData.frameID.x = 0;
+}
+
+// switch between the bias corrections of the direct light resampling, the reservoirs of the last frame are dropped
+void PathTracerApp::cycleResampling() {
+    settings.resampling = (settings.resampling + 1) % (RESAMPLING_UNBIASED + 1);
+    const char *names[] = {"off", "biased", "normalized", "unbiased"};
+    std::cout << "Direct light resampling: " << names[settings.resampling] << std::endl;
+    frameData.frameID.x = 0;
+}
+
+// add or remove the light tracing pass, the camera paths leave caustics on diffuse surfaces to it while it runs
+void PathTracerApp::toggleLightTracing() {
+    settings.lightTracing = !settings.lightTracing;
+    std::cout << "Light tracing: " << (settings.lightTracing ? "on" : "off") << std::endl;
+    frameData.frameID.x = 0;
+}
+
+// light tracing only adds to path traced images and needs something to start from, it splats onto a single camera
+bool PathTracerApp::tracesLights() const {
+    return settings.lightTracing && settings.renderMode == RENDER_MODE_PATH_TRACING && lightCount > 0 &&
+           frameData.views.x == 0;
+}
+
+void PathTracerApp::toggleDenoisedPreview() {
+    denoisedPreview = !denoisedPreview;
+    denoisedExtent = vk::Extent2D(0, 0);
+}
+
+// Read all accumulated quantities of the last submitted frame back, AOV_* selects the block of
+// renderExtent.width * renderExtent.height pixels.
+std::vector<glm::vec4> PathTracerApp::readAccumulation() {
+    device.waitIdle();
+
+    const uint32_t parity = frameData.frameID.z ^ 1u; // frameID.z is flipped after every submit
+    const size_t pixelCount = static_cast<size_t>(renderExtent.width) * renderExtent.height;
+    const vk::DeviceSize layerSize = pixelCount * sizeof(glm::vec4);
+
+    std::vector<vk::BufferImageCopy> copyRegions;
+    for (uint32_t aov = 0; aov < AOV_COUNT; ++aov)
+        copyRegions.emplace_back(aov * layerSize, 0, 0,
+                                 vk::ImageSubresourceLayers(vk::ImageAspectFlagBits::eColor, 0, 2 * aov + parity, 1),
+                                 vk::Offset3D{0, 0, 0},
+                                 vk::Extent3D{renderExtent.width, renderExtent.height, 1});
+
+    const vk::raii::CommandBuffer &commandBuffer = commandBuffers.back();
+    commandBuffer.begin({vk::CommandBufferUsageFlagBits::eOneTimeSubmit});
+    vk::utils::imageBarrier(commandBuffer,
+                            *accumulationImages.getImage(),
+                            {vk::ImageAspectFlagBits::eColor, 0, 1, 0, VK_REMAINING_ARRAY_LAYERS},
+                            vk::AccessFlagBits::eShaderWrite,
+                            vk::AccessFlagBits::eTransferRead,
+                            vk::ImageLayout::eGeneral,
+                            vk::ImageLayout::eGeneral);
+    commandBuffer.copyImageToBuffer(*accumulationImages.getImage(), vk::ImageLayout::eGeneral,
+                                    *readbackBuffer.getBuffer(), copyRegions);
+    commandBuffer.end();
+    graphicsQueue.submit(vk::SubmitInfo(VK_NULL_HANDLE, VK_NULL_HANDLE, *commandBuffer, VK_NULL_HANDLE));
+    graphicsQueue.waitIdle();
+
+    std::vector<glm::vec4> aovs(AOV_COUNT * pixelCount);
+    readbackBuffer.downloadData(aovs.data(), AOV_COUNT * layerSize);
+    return aovs;
+}
+
+// filter the accumulated color of the last submitted frame on the CPU
+std::vector<glm::vec4> PathTracerApp::denoiseLastFrame() {
+    const std::vector<glm::vec4> aovs = readAccumulation();
+    const size_t pixelCount = static_cast<size_t>(renderExtent.width) * renderExtent.height;
+
+    return Denoiser(settings.denoiserIterations).denoise(aovs.data() + AOV_COLOR * pixelCount,
+                                                         aovs.data() + AOV_ALBEDO * pixelCount,
+                                                         aovs.data() + AOV_NORMAL * pixelCount,
+                                                         renderExtent.width, renderExtent.height);
+}
+
+// Mean relative standard error of the accumulated pixel luminance. Pixels darker than the offset are weighted down,
+// otherwise a few almost black pixels would dominate the estimate.
+float PathTracerApp::estimateNoise() {
+    const float darkOffset = 0.01f;
+
+    const std::vector<glm::vec4> aovs = readAccumulation();
+    const size_t pixelCount = static_cast<size_t>(renderExtent.width) * renderExtent.height;
+    const glm::vec4 *moments = aovs.data() + AOV_MOMENTS * pixelCount;
+
+    double errorSum = 0;
+    size_t errorCount = 0;
+    for (size_t i = 0; i < pixelCount; ++i) {
+        const float samples = moments[i].w;
+        if (samples < 2.0f) continue;
+
+        const float mean = moments[i].x;
+        const float variance = std::max(0.0f, moments[i].y - mean * mean) * samples / (samples - 1.0f);
+        errorSum += std::sqrt(variance / samples) / (mean + darkOffset);
+        ++errorCount;
+    }
+    return errorCount > 0 ? static_cast<float>(errorSum / static_cast<double>(errorCount)) : -1.0f;
+}
+
+// same conversion as at the end of the ray generation shader
+static uint8_t toDisplayValue(float linear) {
+    return static_cast<uint8_t>(std::clamp(std::pow(linear, 1.0f / 2.2f), 0.0f, 1.0f) * 255.0f + 0.5f);
+}
+
+// The denoised preview never stalls the render loop: the accumulation is copied as part of a frame, filtered on
+// worker threads once that frame has finished and shown as soon as the filter is done and no frame in flight reads
+// the half of displayBuffer it goes to. Returns whether the frame about to be recorded copies its accumulation.
+bool PathTracerApp::updateDenoisedPreview(bool cameraMoved) {
+    // a denoised frame of an earlier view would lag behind the camera, the traced frames are shown instead
+    const bool viewChanged = cameraMoved || frameData.frameID.x == 0;
+    if (viewChanged) {
+        denoisedExtent = vk::Extent2D(0, 0);
+        previewReadbackFrame = 0;
+        previewDenoiseStale = previewDenoise.valid();
+    }
+
+    if (previewReadbackFrame > 0 && previewReadbackFrame <= completedFrames) {
+        const size_t pixelCount = static_cast<size_t>(previewReadbackExtent.width) * previewReadbackExtent.height;
+        std::vector<glm::vec4> aovs(3 * pixelCount);
+        previewReadbackBuffer.downloadData(aovs.data(), aovs.size() * sizeof(glm::vec4));
+        previewReadbackFrame = 0;
+
+        // channel order of the result image
+        const bool bgra = surfaceFormat.format == vk::Format::eB8G8R8A8Unorm ||
+                          surfaceFormat.format == vk::Format::eB8G8R8A8Srgb;
+        previewDenoiseExtent = previewReadbackExtent;
+        previewDenoise = std::async(std::launch::async, [aovs = std::move(aovs), pixelCount, bgra,
+                                                         extent = previewReadbackExtent,
+                                                         iterations = settings.denoiserIterations]() {
+            const std::vector<glm::vec4> denoised = Denoiser(iterations).denoise(aovs.data(),
+                                                                                 aovs.data() + pixelCount,
+                                                                                 aovs.data() + 2 * pixelCount,
+                                                                                 extent.width, extent.height);
+            std::vector<uint8_t> pixels(4 * denoised.size());
+            for (size_t i = 0; i < denoised.size(); ++i) {
+                pixels[4 * i + (bgra ? 2 : 0)] = toDisplayValue(denoised[i].r);
+                pixels[4 * i + 1] = toDisplayValue(denoised[i].g);
+                pixels[4 * i + (bgra ? 0 : 2)] = toDisplayValue(denoised[i].b);
+                pixels[4 * i + 3] = 255;
+            }
+            return pixels;
+        });
+    }
+
+    const uint32_t nextHalf = displayHalf ^ 1u;
+    if (previewDenoise.valid() &&
+        previewDenoise.wait_for(std::chrono::seconds(0)) == std::future_status::ready &&
+        displayHalfUse[nextHalf] <= completedFrames) {
+        const std::vector<uint8_t> pixels = previewDenoise.get();
+        if (denoisedPreview && !previewDenoiseStale) {
+            const vk::DeviceSize halfSize =
+                    static_cast<vk::DeviceSize>(settings.windowWidth) * settings.windowHeight * 4;
+            displayBuffer.uploadData(pixels.data(), pixels.size(), nextHalf * halfSize);
+            displayHalf = nextHalf;
+            denoisedExtent = previewDenoiseExtent;
+        }
+        previewDenoiseStale = false;
+    }
+
+    // one frame at a time is filtered, and not more often than the interval allows
+    const auto now = std::chrono::steady_clock::now();
+    if (!denoisedPreview || viewChanged || previewReadbackFrame > 0 || previewDenoise.valid() ||
+        std::chrono::duration<float>(now - lastPreviewReadback).count() < settings.previewDenoiseInterval)
+        return false;
+
+    lastPreviewReadback = now;
+    previewReadbackExtent = renderExtent;
+    return true;
+}
+
 void PathTracerApp::exportImage() {
     std::ofstream file(
             std::string("../screenshots/") + settings.modelName + '-' + std::to_string(frameData.frameID.x) + ".ppm",
@@ -913,7 +2267,8 @@ void PathTracerApp::exportImage() {
     vk::utils::Image screenshot(vk::ImageType::e2D, vk::Format::eR8G8B8A8Unorm,
                                 {settings.windowWidth, settings.windowHeight, 1}, vk::ImageTiling::eLinear,
                                 vk::ImageUsageFlagBits::eTransferDst,
-                                vk::MemoryPropertyFlagBits::eHostVisible | vk::MemoryPropertyFlagBits::eHostCoherent);
+                                vk::MemoryPropertyFlagBits::eHostVisible | vk::MemoryPropertyFlagBits::eHostCoherent,
+                                1, vk::utils::AllocationStrategy::linear);
 
     computeCommandBuffer.begin({vk::CommandBufferUsageFlagBits::eOneTimeSubmit});
 
@@ -948,7 +2303,7 @@ void PathTracerApp::exportImage() {
     computeQueue.submit(vk::SubmitInfo(VK_NULL_HANDLE, VK_NULL_HANDLE, *computeCommandBuffer, VK_NULL_HANDLE));
     computeQueue.waitIdle();
 
-    const void *data = screenshot.getDeviceMemory().mapMemory(0, VK_WHOLE_SIZE);
+    const void *data = screenshot.getMappedData();
     file << "P6\n" << settings.windowWidth << " " << settings.windowHeight << "\n255\n";
 
     for (int i = 0; i < settings.windowWidth * settings.windowHeight * 4; i += 4) {
@@ -957,5 +2312,425 @@ void PathTracerApp::exportImage() {
         file << static_cast<const uint8_t *>(data)[i + 0];
     }
 
-    screenshot.getDeviceMemory().unmapMemory();
+    if (diagnostics)
+        exportDiagnostics(std::string("../screenshots/") + settings.modelName + '-' +
+                          std::to_string(frameData.frameID.x));
+
+    if (!settings.denoiseOnExport)
+        return;
+
+    std::ofstream denoisedFile(std::string("../screenshots/") + settings.modelName + '-' +
+                               std::to_string(frameData.frameID.x) + "-denoised.ppm", std::ios::binary);
+    if (!denoisedFile) {
+        std::cerr << "Could not open file for writing" << std::endl;
+        return;
+    }
+
+    const std::vector<glm::vec4> denoised = denoiseLastFrame();
+    denoisedFile << "P6\n" << renderExtent.width << " " << renderExtent.height << "\n255\n";
+    for (const auto &pixel: denoised)
+        denoisedFile << toDisplayValue(pixel.r) << toDisplayValue(pixel.g) << toDisplayValue(pixel.b);
+}
+
+namespace {
+    // maps 0..1 to blue, cyan, green, yellow, red
+    glm::vec3 falseColor(float t) {
+        t = std::clamp(t, 0.0f, 1.0f) * 4.0f;
+        return glm::clamp(glm::vec3(t - 2.0f, t < 2.0f ? t : 4.0f - t, 2.0f - t), 0.0f, 1.0f);
+    }
+}
+
+// Write one diagnostic quantity as raw floats (PFM) and as a false color image (PPM). The color scale ends at the
+// 99th percentile, so a few extreme pixels don't hide the differences between all others.
+void PathTracerApp::exportHeatmap(const std::string &fileName, const std::vector<float> &values) const {
+    const uint32_t width = renderExtent.width;
+    const uint32_t height = renderExtent.height;
+
+    if (!pfm::write(fileName + ".pfm", {width, height, 1, values})) {
+        std::cerr << "Could not open file for writing" << std::endl;
+        return;
+    }
+
+    std::ofstream heatmapFile(fileName + "-heatmap.ppm", std::ios::binary);
+    if (!heatmapFile) {
+        std::cerr << "Could not open file for writing" << std::endl;
+        return;
+    }
+
+    std::vector<float> sorted(values);
+    const auto percentile = sorted.begin() + static_cast<std::ptrdiff_t>(0.99 * static_cast<double>(sorted.size() - 1));
+    std::nth_element(sorted.begin(), percentile, sorted.end());
+    const float scale = *percentile > 0 ? 1.0f / *percentile : 1.0f;
+
+    heatmapFile << "P6\n" << width << " " << height << "\n255\n";
+    for (const float value: values) {
+        const glm::vec3 color = falseColor(value * scale);
+        heatmapFile << static_cast<uint8_t>(color.r * 255.0f) << static_cast<uint8_t>(color.g * 255.0f)
+                    << static_cast<uint8_t>(color.b * 255.0f);
+    }
+}
+
+// per pixel cost of the accumulated samples, available while diagnostics are active
+void PathTracerApp::exportDiagnostics(const std::string &baseName) {
+    const std::vector<glm::vec4> aovs = readAccumulation();
+    const size_t pixelCount = static_cast<size_t>(renderExtent.width) * renderExtent.height;
+    const glm::vec4 *counters = aovs.data() + AOV_DIAGNOSTICS * pixelCount;
+    const glm::vec4 *color = aovs.data() + AOV_COLOR * pixelCount;
+
+    std::vector<float> cycles(pixelCount), intersections(pixelCount), bounces(pixelCount), samples(pixelCount);
+    for (size_t i = 0; i < pixelCount; ++i) {
+        cycles[i] = counters[i].x;
+        intersections[i] = counters[i].y;
+        bounces[i] = counters[i].z;
+        samples[i] = color[i].w;
+    }
+
+    exportHeatmap(baseName + "-cycles", cycles);
+    exportHeatmap(baseName + "-intersections", intersections);
+    exportHeatmap(baseName + "-bounces", bounces);
+    exportHeatmap(baseName + "-samples", samples);
+}
+
+// Render server: jobs run one after another in the hidden window. Scenes of earlier jobs stay resident on the device,
+// so a job for a model which was rendered before only pays for rendering.
+void PathTracerApp::serve() {
+    RenderServer server(settings.serverSocket);
+    if (!server.listen()) {
+        exitCode = 2;
+        return;
+    }
+
+    const Camera defaultCamera = camera;
+    while (!server.shutdownRequested() && !glfwWindowShouldClose(window)) {
+        server.poll(server.hasJob() ? 0 : 100);
+        glfwPollEvents();
+        if (server.hasJob())
+            renderServerJob(server, server.nextJob(), defaultCamera);
+    }
+}
+
+void PathTracerApp::renderServerJob(RenderServer &server, const RenderServer::Job &job, const Camera &defaultCamera) {
+    const std::string id = std::to_string(job.id);
+    const uint32_t width = job.width > 0 ? job.width : settings.windowWidth;
+    const uint32_t height = job.height > 0 ? job.height : settings.windowHeight;
+    // images are allocated for the window, smaller frames are traced in their top left corner like previews
+    if (width > settings.windowWidth || height > settings.windowHeight) {
+        server.finish(job, "error " + id + " resolution is limited to " + std::to_string(settings.windowWidth) + "x" +
+                           std::to_string(settings.windowHeight));
+        return;
+    }
+    if (!std::ifstream("../models/" + job.model + ".obj")) {
+        server.finish(job, "error " + id + " unknown model " + job.model);
+        return;
+    }
+    server.send(job, "started " + id);
+
+    const auto loadStart = std::chrono::steady_clock::now();
+    bool resident;
+    try {
+        resident = activateScene(job.model);
+    } catch (const std::exception &error) {
+        // the previous scene stays active, the reason may span several lines of the obj parser
+        std::string reason = error.what();
+        std::replace(reason.begin(), reason.end(), '\n', ' ');
+        server.finish(job, "error " + id + " could not load " + job.model + ": " + reason);
+        std::cerr << "Job " << id << ": " << error.what() << std::endl;
+        return;
+    }
+    const std::chrono::duration<float, std::milli> loadTime = std::chrono::steady_clock::now() - loadStart;
+
+    camera = defaultCamera;
+    if (job.hasCamera) {
+        const glm::vec3 direction = glm::normalize(job.direction);
+        const glm::vec3 right = glm::normalize(glm::cross(job.up, direction));
+        camera = Camera(job.position, direction, glm::cross(direction, right), defaultCamera.getNear(),
+                        defaultCamera.getFar(), defaultCamera.getFov());
+    }
+    if (job.fov > 0)
+        camera.setFov(job.fov);
+    fullExtent = vk::Extent2D(width, height);
+    frameData.frameID.x = 0;
+
+    // progress is streamed a few times per second, requests arriving meanwhile are queued behind this job
+    const double progressInterval = 0.5;
+    double lastProgress = 0;
+    renderController = RenderController(job.timeBudget, job.maxSamples, job.noiseTarget);
+    const RenderController::StopReason stopReason = renderUntilStopped([&]() {
+        const double elapsed = renderController.getElapsedTime();
+        if (elapsed - lastProgress >= progressInterval) {
+            server.send(job, "progress " + id + " " + std::to_string(frameData.frameID.x) + " " +
+                             std::to_string(elapsed) + " " + std::to_string(renderController.estimateRemainingTime()));
+            lastProgress = elapsed;
+        }
+        server.poll(0);
+    });
+
+    writeImage("../screenshots/" + job.output);
+    server.finish(job, "done " + id + " " + job.output + " " + std::to_string(frameData.frameID.x) + " " +
+                       std::to_string(renderController.getElapsedTime()) + " " + RenderController::toString(stopReason) +
+                       " " + (resident ? "resident " : "loaded ") + std::to_string(loadTime.count()));
+    std::cout << "Job " << id << ": " << job.model << " " << width << "x" << height << ", " << frameData.frameID.x
+              << " samples per pixel in " << renderController.getElapsedTime() << " s, scene "
+              << (resident ? "resident" : "loaded in " + std::to_string(loadTime.count()) + " ms") << std::endl;
+
+    fullExtent = vk::Extent2D(settings.windowWidth, settings.windowHeight);
+}
+
+// Makes a model the active scene. The previously active scene is parked on the device, the least recently rendered
+// scenes are released once more than maxResidentScenes would be kept. A scene whose obj file or conversion settings
+// changed since it was loaded is loaded again.
+bool PathTracerApp::activateScene(const std::string &modelName) {
+    const SceneCache::Key key = SceneCache::makeKey("../models/" + modelName + ".obj", settings.precomputeTriangleData,
+                                                    settings.triangleSplitBudget);
+    ++sceneActivations;
+    if (modelName == settings.modelName && key == sceneKey)
+        return true;
+
+    // A scene which isn't resident is converted and validated before the active scene is parked, so a model which
+    // can't be loaded throws while the active scene is still intact.
+    const auto parkedScene = residentScenes.find(modelName);
+    const bool resident = parkedScene != residentScenes.end() && parkedScene->second.key == key;
+    SceneCache cache;
+    SceneCache::Key cacheKey{};
+    if (!resident)
+        cacheKey = openSceneCache(modelName, cache);
+
+    // descriptors and pipeline layout depend on the number of scene buffers, they are created again below
+    device.waitIdle();
+    descriptorSets.clear();
+    descriptorSetLayouts.clear();
+
+    residentScenes[settings.modelName] = {std::move(scene), lightCount, sceneFeatures, frameData.sceneMin,
+                                          frameData.sceneMax, sceneKey, sceneActivations};
+    scene = {};
+
+    const auto residentScene = residentScenes.find(modelName);
+    if (residentScene != residentScenes.end()) {
+        if (resident) {
+            scene = std::move(residentScene->second.scene);
+            lightCount = residentScene->second.lightCount;
+            sceneFeatures = residentScene->second.features;
+            frameData.sceneMin = residentScene->second.sceneMin;
+            frameData.sceneMax = residentScene->second.sceneMax;
+            sceneKey = key;
+        }
+        residentScenes.erase(residentScene);
+    }
+
+    // released before loading, so the new scene can use their memory
+    while (!residentScenes.empty() && residentScenes.size() + 1 > settings.maxResidentScenes) {
+        const auto leastRecent = std::min_element(residentScenes.begin(), residentScenes.end(),
+                                                  [](const auto &a, const auto &b) {
+                                                      return a.second.lastUse < b.second.lastUse;
+                                                  });
+        std::cout << "Releasing resident scene " << leastRecent->first << std::endl;
+        residentScenes.erase(leastRecent);
+    }
+
+    settings.modelName = modelName;
+    if (!resident)
+        createScene(cache, cacheKey);
+    createRaytracingPipeline();
+    createShaderBindingTable();
+    createDescriptorSets();
+    return resident;
+}
+
+// accumulated color of the last frame, as raw floats for .pfm files and as displayed for .ppm files
+void PathTracerApp::writeImage(const std::string &fileName) {
+    writeImage(fileName, readAccumulation(), renderExtent, vk::Offset2D(0, 0), renderExtent);
+}
+
+void PathTracerApp::writeImage(const std::string &fileName, const std::vector<glm::vec4> &aovs, vk::Extent2D aovExtent,
+                               vk::Offset2D offset, vk::Extent2D extent) {
+    const size_t pixelCount = static_cast<size_t>(aovExtent.width) * aovExtent.height;
+    const auto color = [&](uint32_t x, uint32_t y) -> const glm::vec4 & {
+        return aovs[AOV_COLOR * pixelCount + (offset.y + y) * aovExtent.width + offset.x + x];
+    };
+
+    if (fileName.size() < 4 || fileName.compare(fileName.size() - 4, 4, ".ppm") != 0) {
+        pfm::Image image{extent.width, extent.height, 3, {}};
+        image.pixels.reserve(3 * static_cast<size_t>(extent.width) * extent.height);
+        for (uint32_t y = 0; y < extent.height; ++y)
+            for (uint32_t x = 0; x < extent.width; ++x)
+                image.pixels.insert(image.pixels.end(), {color(x, y).r, color(x, y).g, color(x, y).b});
+        if (!pfm::write(fileName, image))
+            std::cerr << "Could not write " << fileName << std::endl;
+        return;
+    }
+
+    std::ofstream file(fileName, std::ios::binary);
+    if (!file) {
+        std::cerr << "Could not open " << fileName << " for writing" << std::endl;
+        return;
+    }
+    file << "P6\n" << extent.width << " " << extent.height << "\n255\n";
+    for (uint32_t y = 0; y < extent.height; ++y)
+        for (uint32_t x = 0; x < extent.width; ++x)
+            file << toDisplayValue(color(x, y).r) << toDisplayValue(color(x, y).g) << toDisplayValue(color(x, y).b);
+}
+
+RenderController::StopReason PathTracerApp::renderUntilStopped(const std::function<void()> &afterPass) {
+    renderController.start();
+    RenderController::StopReason stopReason = RenderController::StopReason::none;
+    while (stopReason == RenderController::StopReason::none) {
+        drawFrame(0.0f);
+        renderController.passFinished(frameData.frameID.x);
+        if (renderController.noiseCheckDue())
+            renderController.setNoise(estimateNoise());
+        stopReason = renderController.shouldStop();
+        afterPass();
+        glfwPollEvents();
+    }
+    device.waitIdle();
+    return stopReason;
+}
+
+// Camera animation: scene and acceleration structures are loaded once, every frame is accumulated from scratch until
+// the render limits are reached and streamed as raw 8 bit RGB, e.g. into
+// ffmpeg -f rawvideo -pix_fmt rgb24 -s <width>x<height> -r <fps> -i - out.mp4
+void PathTracerApp::renderSequence() {
+    if (!(settings.sequenceFps > 0.0f && std::isfinite(settings.sequenceFps))) {
+        std::cerr << "The frame rate of a sequence must be positive" << std::endl;
+        exitCode = 2;
+        return;
+    }
+    CameraPath cameraPath;
+    if (!cameraPath.load(settings.cameraPath)) {
+        exitCode = 2;
+        return;
+    }
+    renderController = RenderController(settings.timeBudget, settings.maxSamples, settings.noiseTarget);
+    if (!renderController.hasLimits()) {
+        std::cerr << "A sequence needs a per frame limit, pass --spp, --time or --noise" << std::endl;
+        exitCode = 2;
+        return;
+    }
+
+    std::FILE *output = stdout;
+    if (settings.sequenceOutput != "-")
+        output = std::fopen(settings.sequenceOutput.c_str(), "wb");
+#ifdef _WIN32
+    else
+        _setmode(_fileno(stdout), _O_BINARY);
+#endif
+    if (!output) {
+        std::cerr << "Could not open " << settings.sequenceOutput << " for writing" << std::endl;
+        exitCode = 2;
+        return;
+    }
+
+    const auto frameCount = static_cast<uint32_t>(std::floor(cameraPath.getDuration() * settings.sequenceFps)) + 1;
+    const size_t pixelCount = static_cast<size_t>(fullExtent.width) * fullExtent.height;
+    std::cout << "Streaming " << frameCount << " frames of " << fullExtent.width << "x" << fullExtent.height
+              << " rgb24 at " << settings.sequenceFps << " fps" << std::endl;
+
+    std::vector<uint8_t> pixels(3 * pixelCount);
+    const auto sequenceStart = std::chrono::steady_clock::now();
+    uint32_t frame = 0;
+    for (; frame < frameCount && !glfwWindowShouldClose(window); ++frame) {
+        camera = cameraPath.evaluate(static_cast<float>(frame) / settings.sequenceFps, camera.getNear(),
+                                     camera.getFar());
+        frameData.frameID.x = 0;
+        renderController = RenderController(settings.timeBudget, settings.maxSamples, settings.noiseTarget);
+        renderUntilStopped([]() {});
+
+        const std::vector<glm::vec4> aovs = readAccumulation();
+        for (size_t i = 0; i < pixelCount; ++i) {
+            const glm::vec4 &color = aovs[AOV_COLOR * pixelCount + i];
+            pixels[3 * i] = toDisplayValue(color.r);
+            pixels[3 * i + 1] = toDisplayValue(color.g);
+            pixels[3 * i + 2] = toDisplayValue(color.b);
+        }
+        if (std::fwrite(pixels.data(), 1, pixels.size(), output) != pixels.size() || std::fflush(output) != 0) {
+            std::cerr << "Frame stream closed after " << frame << " frames" << std::endl;
+            exitCode = 1;
+            break;
+        }
+        std::cout << "Frame " << frame + 1 << "/" << frameCount << ": " << frameData.frameID.x
+                  << " samples per pixel in " << renderController.getElapsedTime() << " s" << std::endl;
+    }
+    if (output != stdout)
+        std::fclose(output);
+
+    const std::chrono::duration<double> sequenceTime = std::chrono::steady_clock::now() - sequenceStart;
+    std::cout << "Sequence: " << frame << " frames in " << sequenceTime.count() << " s, "
+              << static_cast<double>(frame) * 3600.0 / sequenceTime.count() << " frames per hour" << std::endl;
+}
+
+// Multi-view job: all views are tiled into one launch, so every pass traces the rays of all cameras together through
+// the same acceleration structure instead of one camera after another.
+void PathTracerApp::renderViews() {
+    CameraPath viewPath;
+    if (!viewPath.load(settings.viewsFile)) {
+        exitCode = 2;
+        return;
+    }
+    const std::vector<CameraPath::Keyframe> &keyframes = viewPath.getKeyframes();
+    if (keyframes.size() > MAX_VIEWS) {
+        std::cerr << "A multi-view job has at most " << MAX_VIEWS << " views, " << settings.viewsFile << " has "
+                  << keyframes.size() << std::endl;
+        exitCode = 2;
+        return;
+    }
+    renderController = RenderController(settings.timeBudget, settings.maxSamples, settings.noiseTarget);
+    if (!renderController.hasLimits()) {
+        std::cerr << "A multi-view job needs a limit, pass --spp, --time or --noise" << std::endl;
+        exitCode = 2;
+        return;
+    }
+
+    // the grid of views has to fit into the images allocated for the window
+    const auto viewCount = static_cast<uint32_t>(keyframes.size());
+    const auto columns = static_cast<uint32_t>(std::ceil(std::sqrt(static_cast<float>(viewCount))));
+    const uint32_t rows = (viewCount + columns - 1) / columns;
+    const vk::Extent2D viewExtent(settings.windowWidth / columns, settings.windowHeight / rows);
+    std::vector<Camera> cameras;
+    for (uint32_t i = 0; i < viewCount; ++i) {
+        cameras.push_back(viewPath.evaluate(keyframes[i].time, camera.getNear(), camera.getFar()));
+        frameData.viewCameras[i] = {{cameras[i].getPosition(), 1.0f}, {cameras[i].getDirection(), 1.0f},
+                                    {cameras[i].getUp(), 1.0f}, {cameras[i].getRight(), 1.0f},
+                                    {cameras[i].getNear(), cameras[i].getFar(), cameras[i].getFov(), 1.0f}};
+    }
+    frameData.views = {viewCount, columns, viewExtent.width, viewExtent.height};
+    fullExtent = vk::Extent2D(columns * viewExtent.width, rows * viewExtent.height);
+    frameData.frameID.x = 0;
+
+    const RenderController::StopReason stopReason = renderUntilStopped([]() {});
+    const uint32_t samples = frameData.frameID.x;
+    const double batchedTime = renderController.getElapsedTime();
+    const std::vector<glm::vec4> aovs = readAccumulation();
+
+    // view i is written to the output file name with i inserted before the extension
+    const size_t extension = std::min(settings.viewOutput.rfind('.'), settings.viewOutput.size());
+    for (uint32_t i = 0; i < viewCount; ++i) {
+        const vk::Offset2D offset(static_cast<int32_t>(i % columns * viewExtent.width),
+                                  static_cast<int32_t>(i / columns * viewExtent.height));
+        writeImage(settings.viewOutput.substr(0, extension) + std::to_string(i) + settings.viewOutput.substr(extension),
+                   aovs, renderExtent, offset, viewExtent);
+    }
+
+    // throughput in camera samples, pixels of the grid which don't belong to a view are not counted
+    const double viewSamples = static_cast<double>(viewCount) * viewExtent.width * viewExtent.height * samples;
+    std::cout << "Multi-view: " << viewCount << " views of " << viewExtent.width << "x" << viewExtent.height << ", "
+              << samples << " samples per pixel in " << batchedTime << " s (" << RenderController::toString(stopReason)
+              << "), " << viewSamples / batchedTime * 1e-6 << " Msamples/s" << std::endl;
+
+    frameData.views.x = 0;
+    if (settings.sequentialBaseline) {
+        // the same views and sample count, one camera per launch
+        fullExtent = viewExtent;
+        double sequentialTime = 0;
+        for (const Camera &view: cameras) {
+            camera = view;
+            frameData.frameID.x = 0;
+            renderController = RenderController(0, samples, 0);
+            renderUntilStopped([]() {});
+            sequentialTime += renderController.getElapsedTime();
+        }
+        std::cout << "Sequential: " << viewCount << " views in " << sequentialTime << " s, "
+                  << viewSamples / sequentialTime * 1e-6 << " Msamples/s, multi-view speedup "
+                  << sequentialTime / batchedTime << "x" << std::endl;
+    }
+    fullExtent = vk::Extent2D(settings.windowWidth, settings.windowHeight);
 }
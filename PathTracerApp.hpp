@@ -5,6 +5,10 @@
 #ifndef PATHTRACER_PATHTRACERAPP_HPP
 #define PATHTRACER_PATHTRACERAPP_HPP
 
+#include <chrono>
+#include <functional>
+#include <future>
+#include <map>
 #include <memory>
 
 #define GLFW_INCLUDE_VULKAN
@@ -19,13 +23,63 @@
 #include "VulkanUtils.hpp"
 #include "shaderStructs.hpp"
 #include "Camera.hpp"
+#include "SceneCache.hpp"
+#include "RenderController.hpp"
+#include "ConvergenceTest.hpp"
+#include "RenderServer.hpp"
 
 class PathTracerApp {
 public:
     void initSettings(std::string appName, uint32_t windowWidth, uint32_t windowHeight, std::string modelName,
               uint32_t maxRecursionDepth);
 
-    void run(); // run application
+    // end the render after timeBudget seconds, maxSamples samples per pixel or when the estimated relative error
+    // falls below noiseTarget, whichever comes first, and export the image, 0 disables a limit
+    void setRenderLimits(double timeBudget, uint32_t maxSamples, float noiseTarget);
+
+    // render headlessly, compare the image with the PFM reference after each of the time budgets and write the
+    // convergence curve, the run fails if the error grew compared to the curve in baselineFile (if not empty)
+    void setConvergenceTest(const std::string &referenceFile, const std::vector<double> &timeBudgets,
+                            const std::string &baselineFile);
+
+    // write the accumulated color as PFM when a render job ends, used to create convergence test references
+    void setReferenceOutput(const std::string &fileName);
+
+    // merge nearby shapes into larger objects, on by default
+    void setFlattenShapes(bool flatten);
+
+    // trade-off between acceleration structure build speed and traversal speed of the loaded scenes, fast trace by
+    // default
+    void setBuildQuality(bool fastBuild);
+
+    // split long triangles of the loaded scenes, adding at most budget times their triangle count, 0 (off) by default
+    void setTriangleSplitBudget(float budget);
+
+    // specialize the shaders for the material kinds and lights of the scene, on by default
+    void setSpecializeShaders(bool specialize);
+
+    // LIGHT_SAMPLING_* from shaderStructs.hpp, the light tree is used by default
+    void setLightSampling(uint32_t lightSampling);
+
+    // RESAMPLING_* from shaderStructs.hpp, reservoir resampling of the direct light at primary hits is off by default
+    void setResampling(uint32_t resampling);
+
+    // adds a light tracing pass for caustics on diffuse surfaces, off by default
+    void setLightTracing(bool lightTracing);
+
+    // instead of rendering interactively, serve render jobs on a Unix domain socket until a client asks for shutdown
+    void setServer(const std::string &socketPath);
+
+    // render the camera path in cameraPathFile at fps frames per second, each frame until the render limits are
+    // reached, and stream the frames as raw 8 bit RGB to output, "-" for stdout
+    void setSequence(const std::string &cameraPathFile, float fps, const std::string &output);
+
+    // render every keyframe of viewsFile as a view of one multi-view job until the render limits are reached, view i
+    // is written to output with i inserted before the extension, sequentialBaseline renders the views one by one
+    // afterwards for comparison
+    void setViews(const std::string &viewsFile, const std::string &output, bool sequentialBaseline);
+
+    int run(); // run application, returns the process exit code
 
     static PathTracerApp &instance();
 
@@ -41,17 +95,43 @@ private:
 
     void mainLoop();
 
+    void finishJob(RenderController::StopReason reason);
+
+    void finishConvergenceTest();
+
+    bool isUnattended() const;
+
+    void serve();
+
+    void renderSequence();
+
+    void renderViews();
+
+    // renders passes until renderController stops, afterPass runs after each one
+    RenderController::StopReason renderUntilStopped(const std::function<void()> &afterPass);
+
+    void renderServerJob(RenderServer &server, const RenderServer::Job &job, const Camera &defaultCamera);
+
+    // returns true if the scene was still resident from an earlier job
+    bool activateScene(const std::string &modelName);
+
+    void writeImage(const std::string &fileName);
+
+    // writes the pixels of aovs, as returned by readAccumulation, in the given rectangle
+    static void writeImage(const std::string &fileName, const std::vector<glm::vec4> &aovs, vk::Extent2D aovExtent,
+                           vk::Offset2D offset, vk::Extent2D extent);
+
     void initGLFW();                    // Create glfw window
     void initVulkan();                  // Initialize vulkan instance
     void initDevicesAndQueues();        // Create vulkan devices, queue families and queues
     void initSurface();                 // Create vulkan window using glfw
     void initSwapchain();               //
     void initSyncObjects();             //
-    void initImages();                  // Initialize resultImage for displaying and previousImage for blending
+    void initImages();                  // Initialize resultImage for displaying and history images for blending
     void initCommandPoolAndBuffers();   //
-    void fillCommandBuffers();          //
+    void recordCommandBuffer(uint32_t imageIndex, bool readPreview);
 
-    void fillCommandBuffer(const vk::raii::CommandBuffer &commandBuffer);
+    void fillCommandBuffer(const vk::raii::CommandBuffer &commandBuffer, uint32_t imageIndex);
 
     void keyCallback(GLFWwindow *callbackWindow, int key, int scancode, int action, int mods);
 
@@ -64,11 +144,35 @@ private:
     // returns true if perspective has changed
     bool updateCamera(float dt);
 
+    // choose resolution and path depth of the next frame
+    void updateRenderQuality(bool cameraMoved);
+
+    // primitiveCount is the number of triangles of bottom level structures and ignored for top level ones
     void createAS(const vk::AccelerationStructureTypeKHR &type,
                   const vk::AccelerationStructureGeometryKHR &geometry,
+                  uint32_t primitiveCount,
                   vk::utils::RTAccelerationStructure &_as);
 
-    void createScene();
+    // throws std::runtime_error if the obj file can't be parsed or references missing vertices or materials
+    void convertObj(const std::string &fileName, SceneCache::Writer &cacheWriter);
+
+    // Opens the scene cache of the model, converting its obj file first if the cache is missing or outdated. Throws
+    // std::runtime_error if the model can't be converted or has no triangles, nothing on the device is changed then.
+    SceneCache::Key openSceneCache(const std::string &modelName, SceneCache &cache);
+
+    void createScene(const SceneCache &cache, const SceneCache::Key &cacheKey);
+
+    static size_t splitLongTriangles(std::vector<glm::vec4> &vertices,
+                                     std::vector<uint32_t> &indices,
+                                     std::vector<Material> &materials,
+                                     float maxEdgeLength,
+                                     size_t budget);
+
+    static std::vector<std::vector<size_t>> groupShapes(const std::vector<glm::vec3> &centers,
+                                                        const std::vector<uint64_t> &triangleCounts,
+                                                        glm::vec3 sceneMin,
+                                                        glm::vec3 sceneMax,
+                                                        uint64_t maxTriangles);
 
     void createRaytracingPipeline();
 
@@ -76,15 +180,85 @@ private:
 
     void createDescriptorSets();
 
+    void toggleAmbientOcclusion();
+
+    void toggleDenoisedPreview();
+
+    void toggleDiagnostics();
+
+    void cycleLightSampling();
+
+    void cycleResampling();
+
+    void toggleLightTracing();
+
+    bool tracesLights() const;
+
+    void exportHeatmap(const std::string &fileName, const std::vector<float> &values) const;
+
+    void exportDiagnostics(const std::string &baseName);
+
+    std::vector<glm::vec4> readAccumulation();
+
+    std::vector<glm::vec4> denoiseLastFrame();
+
+    float estimateNoise();
+
+    bool updateDenoisedPreview(bool cameraMoved);
+
     void exportImage();
 
+    void exportReference(const std::string &fileName);
+
+    // trade-off between acceleration structure build speed and traversal speed
+    enum class BuildQuality {
+        fastTrace, // for static scenes where the build cost amortizes
+        fastBuild  // for scenes which are rebuilt often, e.g. while editing or animating
+    };
+
     struct Settings {
         bool initialized;
         std::string name;
         uint32_t windowWidth;
         uint32_t windowHeight;
         std::string modelName;
-        uint32_t maxRecursionDepth;
+        uint32_t maxRecursionDepth; // maximum number of bounces per path
+        bool compactAccelerationStructures; // shrink bottom level acceleration structures after building
+        bool precomputeTriangleData;        // store face normals per triangle instead of deriving them on hit
+        BuildQuality buildQuality;          // acceleration structure build preference for the loaded scene
+        float triangleSplitBudget;          // triangles added by splitting long ones, as fraction of the input
+        bool reuseSceneCache;               // load the converted scene from disk instead of parsing the obj file
+        bool flattenShapes;                 // merge nearby shapes into shared buffers and bottom level structures
+        uint32_t maxObjectTriangles;        // merged objects stay below this size, larger shapes remain on their own
+        bool allowRayReordering;            // regroup secondary rays by origin and direction if supported
+        bool specializeShaders;             // remove shading branches for features the scene doesn't use
+        uint32_t renderMode;                // RENDER_MODE_* from shaderStructs.hpp
+        uint32_t lightSampling;             // LIGHT_SAMPLING_* from shaderStructs.hpp
+        uint32_t resampling;                // RESAMPLING_* from shaderStructs.hpp
+        bool lightTracing;                  // trace paths from the lights as well, they find caustics seen on diffuse surfaces
+        bool dynamicResolution;             // trace at reduced resolution and depth while the camera moves
+        float targetFrameTime;              // trace time in milliseconds the preview resolution is steered to
+        float minResolutionScale;           // lower bound of the preview resolution relative to the window
+        uint32_t previewRecursionDepth;     // maximum number of bounces per path while the camera moves
+        uint32_t denoiserIterations;        // à-trous passes, the filter footprint doubles with each one
+        bool denoiseOnExport;               // write a denoised copy next to every screenshot
+        float previewDenoiseInterval;       // minimum seconds between two denoised preview frames
+        double timeBudget;                  // seconds until a render job ends, 0: no limit
+        uint32_t maxSamples;                // samples per pixel after which a render job ends, 0: no limit
+        float noiseTarget;                  // estimated relative error at which a render job ends, 0: no limit
+        std::string referenceOutput;        // PFM file the accumulated color is written to when a render job ends
+        std::string convergenceReference;   // PFM reference of the convergence test, empty: no test
+        std::vector<double> convergenceBudgets; // render times in seconds the error is measured at
+        std::string convergenceBaseline;    // convergence curve of an earlier run, empty: no comparison
+        double convergenceTolerance;        // relative error increase at equal time accepted as timing noise
+        std::string serverSocket;           // Unix domain socket render jobs are received on, empty: no server
+        uint32_t maxResidentScenes;         // scenes the render server keeps on the device, including the active one
+        std::string cameraPath;             // keyframes of the camera animation to render, empty: no animation
+        float sequenceFps;                  // frames per second of animation time
+        std::string sequenceOutput;         // file or pipe the frames are streamed to, "-": stdout
+        std::string viewsFile;              // cameras of a multi-view job, empty: no multi-view job
+        std::string viewOutput;             // image of each view, .pfm or .ppm
+        bool sequentialBaseline;            // also render the views one after another and compare the throughput
     };
     Settings settings;
 
@@ -103,13 +277,13 @@ private:
     };
     Inputs inputs;
 
-    bool initialized{};
     GLFWwindow *window;
 
     vk::raii::Context context;
     vk::raii::Instance vkInstance;
     vk::raii::PhysicalDevice physicalDevice;
     vk::raii::Device device;
+    std::unique_ptr<vk::utils::MemoryAllocator> memoryAllocator; // outlives all buffers and images declared below
 
     VkSurfaceKHR glfwSurface;
     vk::SurfaceFormatKHR surfaceFormat;
@@ -121,6 +295,13 @@ private:
     std::vector<uint32_t> queueFamilyIndices;
     std::vector<vk::raii::Fence> waitForFrameFences;
     vk::utils::Image resultImage;
+    vk::utils::Image accumulationImages; // layer pairs per AOV, running average and sample count of this and the last frame
+    vk::utils::Image positionImages;     // two layers, first hit position of this and the last frame
+    vk::utils::Buffer reservoirBuffer;   // direct light reservoirs of this and the last frame, interleaved per pixel
+    vk::utils::Buffer splatBuffer;       // rgb light splatted onto the film by the light tracing pass of the frame
+    vk::utils::Buffer readbackBuffer;    // accumulated AOVs of the last frame, read by the denoiser
+    vk::utils::Buffer previewReadbackBuffer; // accumulated color, albedo and normal of a frame for the denoised preview
+    vk::utils::Buffer displayBuffer;     // two halves, denoised frames in the format of the result image
     vk::raii::CommandPool graphicsPool;
     vk::raii::CommandPool computePool;
     std::vector<vk::raii::CommandBuffer> commandBuffers;
@@ -133,6 +314,10 @@ private:
 
     // RayTracing pipeline stuff
     vk::PhysicalDeviceRayTracingPipelinePropertiesKHR pipelineProperties;
+    bool rayReorderingSupported{};
+    bool diagnosticsSupported{};  // shader clock is available
+    bool diagnostics{};           // trace with the instrumented ray generation shader
+    bool atomicFloatSupported{};  // light tracing splats with float atomics instead of compare and swap loops
     std::vector<vk::raii::DescriptorSetLayout> descriptorSetLayouts;
     vk::raii::PipelineLayout pipelineLayout;
     vk::raii::Pipeline pipelineRT;
@@ -141,11 +326,67 @@ private:
     std::vector<vk::raii::DescriptorSet> descriptorSets;
     vk::utils::Buffer shaderBindingTable;
 
+    // Performance measurement
+    vk::raii::QueryPool timestampQueryPool;
+    float timestampPeriod{}; // nanoseconds per timestamp tick
+    vk::DeviceSize frameDataStride{}; // size of FrameData rounded up to the uniform buffer offset alignment
+    float traceTime{};       // duration of the last ray tracing dispatch in milliseconds
+
+    // Render quality of the current frame
+    vk::Extent2D renderExtent;   // traced region in the top left corner of the result and history images
+    vk::Extent2D fullExtent;     // render extent while the camera rests, the window size unless a job asks for less
+    uint32_t renderDepth{};      // maximum number of bounces per path
+    float previewScale{0.5f};    // resolution scale while the camera moves, kept between movements
+    bool previewActive{};
+
+    RenderController renderController;
+    ConvergenceTest convergenceTest;
+    int exitCode{};
+
+    // Frames in flight, fences signal in submission order, so all frames up to a finished one have finished
+    uint64_t submittedFrames{};
+    uint64_t completedFrames{};
+    std::vector<uint64_t> imageSubmissions; // number of the last frame submitted with each swapchain image
+
+    // Denoised preview, filtered in the background while the render loop goes on
+    bool denoisedPreview{};
+    vk::Extent2D denoisedExtent;  // size of the frame shown from displayBuffer, 0 if there is none yet
+    uint32_t displayHalf{};       // half of displayBuffer that is shown, the other one receives the next result
+    uint64_t displayHalfUse[2]{}; // last frame that copied from each half
+    uint64_t previewReadbackFrame{}; // frame that copies its accumulation into previewReadbackBuffer, 0: none
+    vk::Extent2D previewReadbackExtent;
+    std::future<std::vector<uint8_t>> previewDenoise; // display pixels of the frame being filtered
+    vk::Extent2D previewDenoiseExtent;
+    bool previewDenoiseStale{};   // the view changed since the filtered frame was read
+    std::chrono::steady_clock::time_point lastPreviewReadback;
+
     // Scene data
     FrameData frameData; // Camera position and frame index
-    vk::utils::Buffer frameDataBuffer;
+    vk::utils::Buffer frameDataBuffer; // one FrameData per swapchain image, frames in flight keep theirs
     Camera camera;
     vk::utils::RTScene scene;
+    size_t lightCount{}; // emissive triangles of the scene, light tracing is skipped without them
+    // material kinds of the scene, specialization constants of the closest hit shader
+    struct SceneFeatures {
+        VkBool32 mirrors;
+        VkBool32 diffuse;
+        VkBool32 emitters; // diffuse surfaces with emittance, emission of mirrors is never picked up
+    };
+    SceneFeatures sceneFeatures{};
+    SceneCache::Key sceneKey{}; // source file and settings the active scene was loaded from
+
+    // scenes of earlier server jobs which stay on the device while another one is rendered
+    struct ResidentScene {
+        vk::utils::RTScene scene;
+        size_t lightCount;
+        SceneFeatures features;
+        glm::vec4 sceneMin;
+        glm::vec4 sceneMax;
+        SceneCache::Key key;
+        uint64_t lastUse; // value of sceneActivations when the scene was last rendered
+    };
+    std::map<std::string, ResidentScene> residentScenes; // by model name, without the active scene
+    uint64_t sceneActivations{};
 };
 
 #endif //PATHTRACER_PATHTRACERAPP_HPP
@@ -0,0 +1,43 @@
+//
+// Reading and writing of portable float maps, an uncompressed format for raw float images
+//
+
+#include "Pfm.hpp"
+
+#include <fstream>
+
+namespace pfm {
+
+    // Rows are stored bottom to top, a negative scale in the header marks little endian data.
+    bool write(const std::string &fileName, const Image &image) {
+        std::ofstream file(fileName, std::ios::binary);
+        if (!file) return false;
+
+        file << (image.channels == 3 ? "PF" : "Pf") << "\n" << image.width << " " << image.height << "\n-1.0\n";
+        const size_t rowSize = static_cast<size_t>(image.width) * image.channels;
+        for (uint32_t y = image.height; y-- > 0;)
+            file.write(reinterpret_cast<const char *>(image.pixels.data() + y * rowSize),
+                       static_cast<std::streamsize>(sizeof(float) * rowSize));
+        return static_cast<bool>(file);
+    }
+
+    bool read(const std::string &fileName, Image &image) {
+        std::ifstream file(fileName, std::ios::binary);
+        if (!file) return false;
+
+        std::string type;
+        float scale;
+        file >> type >> image.width >> image.height >> scale;
+        file.get(); // single whitespace character before the data
+        if (!file || (type != "PF" && type != "Pf") || scale >= 0) return false;
+
+        image.channels = type == "PF" ? 3 : 1;
+        const size_t rowSize = static_cast<size_t>(image.width) * image.channels;
+        image.pixels.resize(rowSize * image.height);
+        for (uint32_t y = image.height; y-- > 0;)
+            file.read(reinterpret_cast<char *>(image.pixels.data() + y * rowSize),
+                      static_cast<std::streamsize>(sizeof(float) * rowSize));
+        return static_cast<bool>(file);
+    }
+
+} // namespace pfm
@@ -0,0 +1,29 @@
+//
+// Reading and writing of portable float maps, an uncompressed format for raw float images
+//
+
+#ifndef PATHTRACER_PFM_HPP
+#define PATHTRACER_PFM_HPP
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+namespace pfm {
+
+    // pixels are stored top to bottom with 1 (grayscale) or 3 (RGB) interleaved channels
+    struct Image {
+        uint32_t width = 0;
+        uint32_t height = 0;
+        uint32_t channels = 0;
+        std::vector<float> pixels;
+    };
+
+    bool write(const std::string &fileName, const Image &image);
+
+    // returns false if the file can't be read or isn't a little endian PFM
+    bool read(const std::string &fileName, Image &image);
+
+} // namespace pfm
+
+#endif //PATHTRACER_PFM_HPP
@@ -0,0 +1,95 @@
+//
+// Decides when a progressive render job is finished: on a wall-clock deadline, a samples per pixel cap or an
+// estimated noise target
+//
+
+#include "RenderController.hpp"
+
+#include <algorithm>
+#include <limits>
+
+namespace {
+    const double noiseCheckInterval = 1.0; // seconds
+    const double passTimeSmoothing = 0.1;  // weight of the latest pass in the smoothed pass time
+    const uint32_t minNoiseSamples = 16;   // the variance estimate is unreliable with fewer samples
+}
+
+RenderController::RenderController(double timeBudget, uint32_t maxSamples, float noiseTarget)
+        : timeBudget(timeBudget), maxSamples(maxSamples), noiseTarget(noiseTarget) {}
+
+bool RenderController::hasLimits() const {
+    return timeBudget > 0 || maxSamples > 0 || noiseTarget > 0;
+}
+
+void RenderController::start() {
+    startTime = Clock::now();
+    lastPassTime = startTime;
+    lastNoiseCheckTime = startTime;
+    passTime = 0;
+    samples = 0;
+    noise = -1;
+    noiseSamples = 0;
+}
+
+void RenderController::passFinished(uint32_t samplesPerPixel) {
+    const Clock::time_point now = Clock::now();
+    const double duration = std::chrono::duration<double>(now - lastPassTime).count();
+    passTime = passTime > 0 ? (1.0 - passTimeSmoothing) * passTime + passTimeSmoothing * duration : duration;
+    lastPassTime = now;
+    samples = samplesPerPixel;
+}
+
+bool RenderController::noiseCheckDue() const {
+    return noiseTarget > 0 &&
+           std::chrono::duration<double>(Clock::now() - lastNoiseCheckTime).count() >= noiseCheckInterval;
+}
+
+void RenderController::setNoise(float relativeError) {
+    noise = relativeError;
+    noiseSamples = samples;
+    lastNoiseCheckTime = Clock::now();
+}
+
+RenderController::StopReason RenderController::shouldStop() const {
+    if (maxSamples > 0 && samples >= maxSamples)
+        return StopReason::sampleCap;
+    if (noiseTarget > 0 && noise >= 0 && noiseSamples >= minNoiseSamples && noise <= noiseTarget)
+        return StopReason::noiseTarget;
+    // stop before a pass which can't be completed in time instead of cutting it off
+    if (timeBudget > 0 && getElapsedTime() + passTime > timeBudget)
+        return StopReason::deadline;
+    return StopReason::none;
+}
+
+double RenderController::estimateRemainingTime() const {
+    double remaining = std::numeric_limits<double>::max();
+    if (timeBudget > 0)
+        remaining = std::min(remaining, timeBudget - getElapsedTime());
+    if (passTime > 0 && maxSamples > 0)
+        remaining = std::min(remaining, static_cast<double>(maxSamples - std::min(samples, maxSamples)) * passTime);
+    if (passTime > 0 && noiseTarget > 0 && noise > 0) {
+        // the standard error falls with the square root of the sample count
+        const double requiredSamples = noiseSamples * (noise / noiseTarget) * (noise / noiseTarget);
+        remaining = std::min(remaining, std::max(0.0, requiredSamples - samples) * passTime);
+    }
+    return remaining == std::numeric_limits<double>::max() ? -1.0 : std::max(0.0, remaining);
+}
+
+double RenderController::getElapsedTime() const {
+    return std::chrono::duration<double>(Clock::now() - startTime).count();
+}
+
+float RenderController::getNoise() const { return noise; }
+
+std::string RenderController::toString(StopReason reason) {
+    switch (reason) {
+        case StopReason::deadline:
+            return "time budget";
+        case StopReason::sampleCap:
+            return "sample cap";
+        case StopReason::noiseTarget:
+            return "noise target";
+        default:
+            return "none";
+    }
+}
@@ -0,0 +1,64 @@
+//
+// Decides when a progressive render job is finished: on a wall-clock deadline, a samples per pixel cap or an
+// estimated noise target
+//
+
+#ifndef PATHTRACER_RENDERCONTROLLER_HPP
+#define PATHTRACER_RENDERCONTROLLER_HPP
+
+#include <chrono>
+#include <cstdint>
+#include <string>
+
+class RenderController {
+public:
+    enum class StopReason {
+        none,
+        deadline,    // the next pass would not finish within the time budget
+        sampleCap,   // maximum number of samples per pixel reached
+        noiseTarget  // estimated relative error dropped below the target
+    };
+
+    RenderController() = default;
+
+    // limits which are 0 are not checked
+    RenderController(double timeBudget, uint32_t maxSamples, float noiseTarget);
+
+    bool hasLimits() const;
+
+    void start();
+
+    // called after every complete pass over the image, samplesPerPixel counts all passes since the last reset
+    void passFinished(uint32_t samplesPerPixel);
+
+    // the noise estimate is expensive, it is only refreshed about once per noiseCheckInterval
+    bool noiseCheckDue() const;
+    void setNoise(float relativeError);
+
+    StopReason shouldStop() const;
+
+    // seconds until the first limit is reached, predicted from the measured pass time, negative if unknown
+    double estimateRemainingTime() const;
+
+    double getElapsedTime() const;
+    float getNoise() const;
+
+    static std::string toString(StopReason reason);
+
+private:
+    using Clock = std::chrono::steady_clock;
+
+    double timeBudget = 0;  // seconds
+    uint32_t maxSamples = 0;
+    float noiseTarget = 0;  // relative standard error of a pixel
+
+    Clock::time_point startTime;
+    Clock::time_point lastPassTime;
+    Clock::time_point lastNoiseCheckTime;
+    double passTime = 0;   // smoothed duration of a pass in seconds
+    uint32_t samples = 0;
+    float noise = -1;      // negative until estimated
+    uint32_t noiseSamples = 0;
+};
+
+#endif //PATHTRACER_RENDERCONTROLLER_HPP
@@ -0,0 +1,267 @@
+//
+// Render jobs received over a Unix domain socket, one request per line. Jobs wait in a priority queue and every
+// client gets the progress of its jobs streamed back over its connection.
+//
+
+#include "RenderServer.hpp"
+#include "Camera.hpp"
+
+#include <cmath>
+#include <iostream>
+#include <sstream>
+#include <stdexcept>
+#include <utility>
+
+#ifndef _WIN32
+#include <cerrno>
+#include <csignal>
+#include <cstring>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+#endif
+
+namespace {
+    // "x,y,z"
+    bool parseVec3(const std::string &text, glm::vec3 &value) {
+        std::istringstream stream(text);
+        char comma1 = 0, comma2 = 0;
+        stream >> value.x >> comma1 >> value.y >> comma2 >> value.z;
+        return stream && comma1 == ',' && comma2 == ',' && stream.peek() == std::char_traits<char>::eof();
+    }
+
+    bool endsWith(const std::string &text, const std::string &suffix) {
+        return text.size() >= suffix.size() && text.compare(text.size() - suffix.size(), suffix.size(), suffix) == 0;
+    }
+
+    // a plain file name, which can't point outside of the directory it is looked up in
+    bool isFileName(const std::string &name) {
+        return !name.empty() && name.find("..") == std::string::npos && name.find('/') == std::string::npos &&
+               name.find('\\') == std::string::npos;
+    }
+
+    // requests are short, a client which sends more without a line break is dropped
+    const size_t maxRequestLength = 4096;
+}
+
+RenderServer::RenderServer(std::string socketPath) : socketPath(std::move(socketPath)) {}
+
+RenderServer::~RenderServer() {
+#ifndef _WIN32
+    for (const auto &client: clients)
+        close(client.first);
+    if (listenSocket >= 0) {
+        close(listenSocket);
+        unlink(socketPath.c_str());
+    }
+#endif
+}
+
+bool RenderServer::JobOrder::operator()(const Job &a, const Job &b) const {
+    return a.priority != b.priority ? a.priority < b.priority : a.id > b.id;
+}
+
+bool RenderServer::listen() {
+#ifdef _WIN32
+    std::cerr << "The render server needs Unix domain sockets, which are not supported on this platform" << std::endl;
+    return false;
+#else
+    sockaddr_un address{};
+    address.sun_family = AF_UNIX;
+    if (socketPath.size() >= sizeof(address.sun_path)) {
+        std::cerr << "Socket path too long: " << socketPath << std::endl;
+        return false;
+    }
+    std::strncpy(address.sun_path, socketPath.c_str(), sizeof(address.sun_path) - 1);
+
+    listenSocket = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (listenSocket < 0) {
+        std::cerr << "Could not create socket: " << std::strerror(errno) << std::endl;
+        return false;
+    }
+    unlink(socketPath.c_str());
+    if (bind(listenSocket, reinterpret_cast<const sockaddr *>(&address), sizeof(address)) < 0 ||
+        ::listen(listenSocket, 16) < 0) {
+        std::cerr << "Could not listen on " << socketPath << ": " << std::strerror(errno) << std::endl;
+        close(listenSocket);
+        listenSocket = -1;
+        return false;
+    }
+    fcntl(listenSocket, F_SETFL, fcntl(listenSocket, F_GETFL) | O_NONBLOCK);
+    signal(SIGPIPE, SIG_IGN); // writing to a client which left must not end the server
+    std::cout << "Render server listening on " << socketPath << std::endl;
+    return true;
+#endif
+}
+
+void RenderServer::poll(int timeoutMs) {
+#ifndef _WIN32
+    std::vector<pollfd> descriptors{{listenSocket, POLLIN, 0}};
+    for (const auto &client: clients)
+        if (!client.second.disconnected)
+            descriptors.push_back({client.first, POLLIN, 0});
+    if (::poll(descriptors.data(), descriptors.size(), timeoutMs) <= 0)
+        return;
+
+    if (descriptors[0].revents & POLLIN) {
+        for (int client; (client = accept(listenSocket, nullptr, nullptr)) >= 0;) {
+            fcntl(client, F_SETFL, fcntl(client, F_GETFL) | O_NONBLOCK);
+            clients[client] = {};
+        }
+    }
+
+    for (size_t i = 1; i < descriptors.size(); ++i) {
+        if (!(descriptors[i].revents & (POLLIN | POLLHUP | POLLERR)))
+            continue;
+        const int client = descriptors[i].fd;
+
+        char buffer[4096];
+        ssize_t received;
+        bool tooLong = false;
+        while (!tooLong && (received = recv(client, buffer, sizeof(buffer), 0)) > 0) {
+            std::string &input = clients[client].input;
+            input.append(buffer, static_cast<size_t>(received));
+            for (size_t end; (end = input.find('\n')) != std::string::npos;) {
+                const std::string line = input.substr(0, end);
+                input.erase(0, end + 1);
+                handleRequest(client, line);
+            }
+            tooLong = input.size() > maxRequestLength;
+        }
+        if (tooLong) {
+            sendLine(client, "error requests are limited to " + std::to_string(maxRequestLength) + " bytes");
+            clients[client].input.clear();
+        }
+        if (tooLong || received == 0 || (errno != EAGAIN && errno != EWOULDBLOCK)) {
+            // jobs of a client which left are still rendered, their output is written as requested
+            clients[client].disconnected = true;
+            if (clients[client].pendingJobs == 0)
+                closeClient(client);
+        }
+    }
+#endif
+}
+
+// render model=<name> output=<file> [priority=<n>] [width=<px>] [height=<px>] [spp=<n>] [time=<s>] [noise=<e>]
+//        [position=<x,y,z>] [direction=<x,y,z>] [up=<x,y,z>] [fov=<degrees>]
+// shutdown
+void RenderServer::handleRequest(int client, const std::string &line) {
+    std::istringstream words(line);
+    std::string command;
+    words >> command;
+    if (command.empty())
+        return;
+    if (command == "shutdown") {
+        shutdown = true;
+        sendLine(client, "ok shutdown");
+        return;
+    }
+    if (command != "render") {
+        sendLine(client, "error unknown command " + command);
+        return;
+    }
+
+    Job job;
+    job.client = client;
+    try {
+        for (std::string word; words >> word;) {
+            const size_t separator = word.find('=');
+            if (separator == std::string::npos)
+                throw std::invalid_argument("expected key=value instead of " + word);
+            const std::string key = word.substr(0, separator);
+            const std::string value = word.substr(separator + 1);
+            if (key == "model") job.model = value;
+            else if (key == "output") job.output = value;
+            else if (key == "priority") job.priority = std::stoi(value);
+            else if (key == "width") job.width = static_cast<uint32_t>(std::stoul(value));
+            else if (key == "height") job.height = static_cast<uint32_t>(std::stoul(value));
+            else if (key == "spp") job.maxSamples = static_cast<uint32_t>(std::stoul(value));
+            else if (key == "time") job.timeBudget = std::stod(value);
+            else if (key == "noise") job.noiseTarget = std::stof(value);
+            else if (key == "fov") job.fov = std::stof(value);
+            else if (key == "position" || key == "direction" || key == "up") {
+                glm::vec3 &vector = key == "position" ? job.position : key == "direction" ? job.direction : job.up;
+                if (!parseVec3(value, vector))
+                    throw std::invalid_argument("expected x,y,z for " + key);
+                job.hasCamera = true;
+            } else throw std::invalid_argument("unknown key " + key);
+        }
+    } catch (const std::exception &exception) { // std::sto* throw std::invalid_argument and std::out_of_range
+        sendLine(client, std::string("error ") + exception.what());
+        return;
+    }
+
+    // models are looked up in models/ and images are written to screenshots/, so names must not leave them
+    if (!isFileName(job.model)) {
+        sendLine(client, "error model must be the name of an obj file in models/");
+        return;
+    }
+    if (!isFileName(job.output) || (!endsWith(job.output, ".pfm") && !endsWith(job.output, ".ppm"))) {
+        sendLine(client, "error output must be the name of a .pfm or .ppm file, which is written to screenshots/");
+        return;
+    }
+    if (job.hasCamera && !Camera::isValidOrientation(job.direction, job.up)) {
+        sendLine(client, "error direction and up must be non-zero and not parallel");
+        return;
+    }
+    // std::stof and std::stod accept nan and inf
+    if (!std::isfinite(job.position.x + job.position.y + job.position.z) || !std::isfinite(job.timeBudget) ||
+        !std::isfinite(job.noiseTarget) || !(job.fov >= 0.0f && job.fov < 180.0f)) {
+        sendLine(client, "error values must be finite and fov between 0 and 180 degrees");
+        return;
+    }
+    if (job.timeBudget <= 0 && job.maxSamples == 0 && job.noiseTarget <= 0) {
+        sendLine(client, "error a job needs at least one of time, spp and noise");
+        return;
+    }
+
+    job.id = nextJobId++;
+    ++clients[client].pendingJobs;
+    queue.push(job);
+    sendLine(client, "queued " + std::to_string(job.id) + " " + std::to_string(queue.size()));
+}
+
+bool RenderServer::hasJob() const {
+    return !queue.empty();
+}
+
+RenderServer::Job RenderServer::nextJob() {
+    Job job = queue.top();
+    queue.pop();
+    return job;
+}
+
+void RenderServer::send(const Job &job, const std::string &line) {
+    const auto client = clients.find(job.client);
+    if (client != clients.end() && !client->second.disconnected)
+        sendLine(job.client, line);
+}
+
+void RenderServer::finish(const Job &job, const std::string &line) {
+    send(job, line);
+    const auto client = clients.find(job.client);
+    if (client != clients.end() && --client->second.pendingJobs == 0 && client->second.disconnected)
+        closeClient(job.client);
+}
+
+bool RenderServer::shutdownRequested() const {
+    return shutdown;
+}
+
+// Progress lines are short and clients are expected to read them, a client whose socket buffer is full misses lines
+// instead of stalling the renderer.
+void RenderServer::sendLine(int client, const std::string &line) {
+#ifndef _WIN32
+    const std::string message = line + '\n';
+    ::send(client, message.data(), message.size(), MSG_DONTWAIT);
+#endif
+}
+
+void RenderServer::closeClient(int client) {
+#ifndef _WIN32
+    close(client);
+#endif
+    clients.erase(client);
+}
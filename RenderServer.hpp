@@ -0,0 +1,83 @@
+//
+// Render jobs received over a Unix domain socket, one request per line. Jobs wait in a priority queue and every
+// client gets the progress of its jobs streamed back over its connection.
+//
+
+#ifndef PATHTRACER_RENDERSERVER_HPP
+#define PATHTRACER_RENDERSERVER_HPP
+
+#include <cstdint>
+#include <map>
+#include <queue>
+#include <string>
+#include <vector>
+
+#include "glm/glm.hpp"
+
+class RenderServer {
+public:
+    struct Job {
+        uint64_t id = 0;
+        int priority = 0;             // higher priorities run first, jobs of equal priority in order of arrival
+        int client = -1;              // connection the job arrived on
+        std::string model;            // name of the obj file in models/, without extension
+        uint32_t width = 0;           // 0: server window size
+        uint32_t height = 0;
+        double timeBudget = 0;        // same limits as a render job on the command line, at least one is set
+        uint32_t maxSamples = 0;
+        float noiseTarget = 0;
+        bool hasCamera = false;       // otherwise the default camera of the server is used
+        glm::vec3 position{0.0f};
+        glm::vec3 direction{0.0f, 0.0f, 1.0f};
+        glm::vec3 up{0.0f, 1.0f, 0.0f};
+        float fov = 0;                // 0: field of view of the default camera
+        std::string output;           // file name in screenshots/, .pfm for the raw accumulated color, .ppm as displayed
+    };
+
+    explicit RenderServer(std::string socketPath);
+    ~RenderServer();
+
+    RenderServer(const RenderServer &) = delete;
+    RenderServer &operator=(const RenderServer &) = delete;
+
+    // creates the socket, replacing a stale socket file of an earlier server, returns false on failure
+    bool listen();
+
+    // accepts new clients and reads their requests, waits at most timeoutMs milliseconds for either
+    void poll(int timeoutMs);
+
+    bool hasJob() const;
+    Job nextJob(); // removes the job with the highest priority from the queue
+
+    // sends a line to the client of a job, clients which went away are skipped
+    void send(const Job &job, const std::string &line);
+
+    // sends the last line of a job, the connection is closed once the client left and none of its jobs is pending
+    void finish(const Job &job, const std::string &line);
+
+    bool shutdownRequested() const;
+
+private:
+    struct Client {
+        std::string input;     // received bytes up to the next line break
+        uint32_t pendingJobs = 0;
+        bool disconnected = false;
+    };
+
+    struct JobOrder {
+        bool operator()(const Job &a, const Job &b) const;
+    };
+
+    void handleRequest(int client, const std::string &line);
+    void sendLine(int client, const std::string &line);
+    void closeClient(int client);
+
+    std::string socketPath;
+    int listenSocket = -1;
+    std::map<int, Client> clients;
+    std::priority_queue<Job, std::vector<Job>, JobOrder> queue;
+    uint64_t nextJobId = 1;
+    bool shutdown = false;
+};
+
+#endif //PATHTRACER_RENDERSERVER_HPP
@@ -0,0 +1,282 @@
+//
+// Binary on-disk copy of a converted scene which is memory mapped and streamed shape by shape
+//
+
+#include "SceneCache.hpp"
+
+#include <cstring>
+#include <filesystem>
+#include <limits>
+#include <sstream>
+#include <stdexcept>
+
+#ifdef _WIN32
+#define NOMINMAX
+#include <windows.h>
+#include <process.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+namespace {
+    const uint32_t cacheMagic = 0x43535450; // "PTSC"
+    const uint32_t cacheVersion = 4;
+    const uint64_t dataAlignment = 16;      // keeps vec4 arrays aligned inside the mapping
+
+    struct Header {
+        uint32_t magic;
+        uint32_t version;
+        SceneCache::Key key;
+        uint64_t shapeCount;
+        uint64_t shapeTableOffset;
+        uint64_t shapeBoundsOffset;
+    };
+
+    // shape table entry layout, all values are uint64_t
+    enum ShapeTableEntry {
+        vertexOffset, vertexCount, indexOffset, indexCount, materialOffset, normalOffset, shapeTableStride
+    };
+
+    // count elements of elementSize starting at offset lie within a file of fileSize bytes, offset is aligned
+    bool fitsInFile(uint64_t offset, uint64_t count, uint64_t elementSize, uint64_t fileSize) {
+        return offset >= sizeof(Header) && offset % dataAlignment == 0 && offset <= fileSize &&
+               count <= (fileSize - offset) / elementSize;
+    }
+
+    int processId() {
+#ifdef _WIN32
+        return _getpid();
+#else
+        return static_cast<int>(getpid());
+#endif
+    }
+}
+
+bool SceneCache::Key::operator==(const Key &other) const {
+    return sourceSize == other.sourceSize && sourceTime == other.sourceTime &&
+           materialSize == other.materialSize && materialTime == other.materialTime &&
+           precomputedNormals == other.precomputedNormals && triangleSplitBudget == other.triangleSplitBudget;
+}
+
+SceneCache::Key SceneCache::makeKey(const std::string &sourceFileName, bool precomputedNormals,
+                                    float triangleSplitBudget) {
+    std::error_code error;
+    Key key{};
+    key.sourceSize = std::filesystem::file_size(sourceFileName, error);
+    key.sourceTime = static_cast<int64_t>(
+            std::filesystem::last_write_time(sourceFileName, error).time_since_epoch().count());
+    key.precomputedNormals = precomputedNormals;
+    key.triangleSplitBudget = triangleSplitBudget;
+
+    // mtl files are referenced relative to the obj file, like the obj loader resolves them
+    const std::filesystem::path directory = std::filesystem::path(sourceFileName).parent_path();
+    std::ifstream source(sourceFileName);
+    for (std::string line; std::getline(source, line);) {
+        std::istringstream words(line);
+        std::string statement;
+        words >> statement;
+        if (statement == "v" || statement == "f")
+            break;
+        if (statement != "mtllib")
+            continue;
+        for (std::string materialFile; words >> materialFile;) {
+            const std::filesystem::path path = directory / materialFile;
+            key.materialSize += std::filesystem::file_size(path, error);
+            key.materialTime += static_cast<int64_t>(
+                    std::filesystem::last_write_time(path, error).time_since_epoch().count());
+        }
+    }
+    return key;
+}
+
+SceneCache::Writer::Writer(const std::string &fileName, const Key &key)
+        : fileName(fileName), temporaryFileName(fileName + "." + std::to_string(processId()) + ".tmp"),
+          file(temporaryFileName, std::ios::binary | std::ios::trunc), key(key) {
+    if (!file)
+        throw std::runtime_error("Could not create scene cache " + temporaryFileName);
+
+    // header is written by finish() once the shape table location is known
+    Header header{};
+    file.write(reinterpret_cast<const char *>(&header), sizeof(header));
+}
+
+uint64_t SceneCache::Writer::write(const void *data, uint64_t size) {
+    const char padding[dataAlignment]{};
+    auto offset = static_cast<uint64_t>(file.tellp());
+    if (offset % dataAlignment != 0) {
+        file.write(padding, static_cast<std::streamsize>(dataAlignment - offset % dataAlignment));
+        offset += dataAlignment - offset % dataAlignment;
+    }
+    file.write(static_cast<const char *>(data), static_cast<std::streamsize>(size));
+    return offset;
+}
+
+void SceneCache::Writer::addShape(const std::vector<glm::vec4> &vertices,
+                                  const std::vector<uint32_t> &indices,
+                                  const std::vector<Material> &materials,
+                                  const std::vector<glm::vec4> &normals) {
+    shapeTable.push_back(write(vertices.data(), sizeof(glm::vec4) * vertices.size()));
+    shapeTable.push_back(vertices.size());
+    shapeTable.push_back(write(indices.data(), sizeof(uint32_t) * indices.size()));
+    shapeTable.push_back(indices.size());
+    shapeTable.push_back(write(materials.data(), sizeof(Material) * materials.size()));
+    shapeTable.push_back(normals.empty() ? 0 : write(normals.data(), sizeof(glm::vec4) * normals.size()));
+
+    glm::vec4 boundsMin(std::numeric_limits<float>::max());
+    glm::vec4 boundsMax(std::numeric_limits<float>::lowest());
+    for (const glm::vec4 &vertex: vertices) {
+        boundsMin = glm::min(boundsMin, vertex);
+        boundsMax = glm::max(boundsMax, vertex);
+    }
+    shapeBounds.push_back(boundsMin);
+    shapeBounds.push_back(boundsMax);
+}
+
+void SceneCache::Writer::finish() {
+    Header header{};
+    header.magic = cacheMagic;
+    header.version = cacheVersion;
+    header.key = key;
+    header.shapeCount = shapeTable.size() / shapeTableStride;
+    header.shapeTableOffset = write(shapeTable.data(), sizeof(uint64_t) * shapeTable.size());
+    header.shapeBoundsOffset = write(shapeBounds.data(), sizeof(glm::vec4) * shapeBounds.size());
+
+    file.seekp(0);
+    file.write(reinterpret_cast<const char *>(&header), sizeof(header));
+    file.close();
+    if (file.fail())
+        throw std::runtime_error("Could not write scene cache " + temporaryFileName);
+
+    // replaces the old cache atomically, a mapping of it stays valid
+    std::filesystem::rename(temporaryFileName, fileName);
+    finished = true;
+}
+
+SceneCache::Writer::~Writer() {
+    if (finished)
+        return;
+    file.close();
+    std::error_code error;
+    std::filesystem::remove(temporaryFileName, error);
+}
+
+SceneCache::~SceneCache() { close(); }
+
+bool SceneCache::open(const std::string &fileName, const Key &key) {
+    close();
+
+#ifdef _WIN32
+    fileHandle = CreateFileA(fileName.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING,
+                             FILE_ATTRIBUTE_NORMAL, nullptr);
+    if (fileHandle == INVALID_HANDLE_VALUE) {
+        fileHandle = nullptr;
+        return false;
+    }
+    LARGE_INTEGER fileSize;
+    GetFileSizeEx(fileHandle, &fileSize);
+    size = static_cast<uint64_t>(fileSize.QuadPart);
+    mappingHandle = CreateFileMappingA(fileHandle, nullptr, PAGE_READONLY, 0, 0, nullptr);
+    if (mappingHandle)
+        data = static_cast<const uint8_t *>(MapViewOfFile(mappingHandle, FILE_MAP_READ, 0, 0, 0));
+#else
+    int fileDescriptor = ::open(fileName.c_str(), O_RDONLY);
+    if (fileDescriptor < 0) return false;
+
+    struct stat fileStatus{};
+    fstat(fileDescriptor, &fileStatus);
+    size = static_cast<uint64_t>(fileStatus.st_size);
+
+    // pages are only read from disk when a shape is accessed
+    void *mapping = size > 0 ? mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fileDescriptor, 0) : MAP_FAILED;
+    ::close(fileDescriptor);
+    if (mapping != MAP_FAILED)
+        data = static_cast<const uint8_t *>(mapping);
+#endif
+
+    if (!data || size < sizeof(Header)) {
+        close();
+        return false;
+    }
+
+    Header header{};
+    std::memcpy(&header, data, sizeof(header));
+    if (header.magic != cacheMagic || header.version != cacheVersion || !(header.key == key) ||
+        !fitsInFile(header.shapeTableOffset, header.shapeCount, shapeTableStride * sizeof(uint64_t), size) ||
+        !fitsInFile(header.shapeBoundsOffset, header.shapeCount, 2 * sizeof(glm::vec4), size)) {
+        close();
+        return false;
+    }
+
+    // a truncated or damaged file must not lead to reads outside of the mapping
+    const auto *table = reinterpret_cast<const uint64_t *>(data + header.shapeTableOffset);
+    for (uint64_t shape = 0; shape < header.shapeCount; ++shape) {
+        const uint64_t *entry = table + shape * shapeTableStride;
+        const uint64_t triangleCount = entry[indexCount] / 3;
+        if (entry[indexCount] % 3 != 0 ||
+            !fitsInFile(entry[vertexOffset], entry[vertexCount], sizeof(glm::vec4), size) ||
+            !fitsInFile(entry[indexOffset], entry[indexCount], sizeof(uint32_t), size) ||
+            !fitsInFile(entry[materialOffset], triangleCount, sizeof(Material), size) ||
+            (entry[normalOffset] != 0 && !fitsInFile(entry[normalOffset], triangleCount, sizeof(glm::vec4), size))) {
+            close();
+            return false;
+        }
+    }
+
+    shapeTable = table;
+    shapeBounds = reinterpret_cast<const glm::vec4 *>(data + header.shapeBoundsOffset);
+    shapeCount = header.shapeCount;
+    return true;
+}
+
+void SceneCache::close() {
+#ifdef _WIN32
+    if (data) UnmapViewOfFile(data);
+    if (mappingHandle) CloseHandle(mappingHandle);
+    if (fileHandle) CloseHandle(fileHandle);
+    mappingHandle = nullptr;
+    fileHandle = nullptr;
+#else
+    if (data) munmap(const_cast<uint8_t *>(data), size);
+#endif
+    data = nullptr;
+    size = 0;
+    shapeTable = nullptr;
+    shapeBounds = nullptr;
+    shapeCount = 0;
+}
+
+size_t SceneCache::getShapeCount() const { return shapeCount; }
+
+SceneCache::Shape SceneCache::getShape(size_t index) const {
+    const uint64_t *entry = shapeTable + index * shapeTableStride;
+    Shape shape{};
+    shape.vertices = reinterpret_cast<const glm::vec4 *>(data + entry[vertexOffset]);
+    shape.vertexCount = entry[vertexCount];
+    shape.indices = reinterpret_cast<const uint32_t *>(data + entry[indexOffset]);
+    shape.indexCount = entry[indexCount];
+    shape.materials = reinterpret_cast<const Material *>(data + entry[materialOffset]);
+    shape.normals = entry[normalOffset] ? reinterpret_cast<const glm::vec4 *>(data + entry[normalOffset]) : nullptr;
+    shape.boundsMin = glm::vec3(shapeBounds[2 * index]);
+    shape.boundsMax = glm::vec3(shapeBounds[2 * index + 1]);
+    return shape;
+}
+
+void SceneCache::release(size_t index) const {
+#ifndef _WIN32
+    const uint64_t *entry = shapeTable + index * shapeTableStride;
+    const Shape shape = getShape(index);
+    const uint64_t triangleCount = shape.indexCount / 3;
+
+    // shape data is stored contiguously, from its vertices up to the end of its materials or normals
+    const uint64_t begin = entry[vertexOffset];
+    const uint64_t end = entry[normalOffset] ? entry[normalOffset] + sizeof(glm::vec4) * triangleCount
+                                             : entry[materialOffset] + sizeof(Material) * triangleCount;
+
+    const auto pageSize = static_cast<uint64_t>(sysconf(_SC_PAGESIZE));
+    const uint64_t alignedBegin = begin / pageSize * pageSize;
+    madvise(const_cast<uint8_t *>(data) + alignedBegin, end - alignedBegin, MADV_DONTNEED);
+#endif
+}
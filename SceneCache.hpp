@@ -0,0 +1,105 @@
+//
+// Binary on-disk copy of a converted scene which is memory mapped and streamed shape by shape
+//
+
+#ifndef PATHTRACER_SCENECACHE_HPP
+#define PATHTRACER_SCENECACHE_HPP
+
+#include <cstdint>
+#include <fstream>
+#include <string>
+#include <vector>
+
+#include "glm/glm.hpp"
+#include "shaderStructs.hpp"
+
+class SceneCache {
+public:
+    // identifies the source files and the conversion settings a cache file was created from
+    struct Key {
+        uint64_t sourceSize;
+        int64_t sourceTime;
+        uint64_t materialSize;  // of all mtl files the obj file references
+        int64_t materialTime;   // sum of their modification times
+        uint32_t precomputedNormals;
+        float triangleSplitBudget;
+
+        bool operator==(const Key &other) const;
+    };
+
+    // view of a single shape inside the mapped file
+    struct Shape {
+        const glm::vec4 *vertices;
+        uint64_t vertexCount;
+        const uint32_t *indices;
+        uint64_t indexCount;
+        const Material *materials; // one per triangle
+        const glm::vec4 *normals;  // one per triangle, nullptr if normals were not precomputed
+        glm::vec3 boundsMin;       // bounding box of the vertices, stored apart from them so reading it doesn't
+        glm::vec3 boundsMax;       // page in the shape data
+    };
+
+    // Streams converted shapes into a new cache file. The file is written under a temporary name and replaces an
+    // existing cache only once it is complete, so processes which have the old one mapped keep reading valid data.
+    class Writer {
+    public:
+        Writer(const std::string &fileName, const Key &key);
+        ~Writer(); // removes the temporary file unless finish() succeeded
+
+        Writer(const Writer &) = delete;
+        Writer &operator=(const Writer &) = delete;
+
+        void addShape(const std::vector<glm::vec4> &vertices,
+                      const std::vector<uint32_t> &indices,
+                      const std::vector<Material> &materials,
+                      const std::vector<glm::vec4> &normals);
+
+        // write shape table and header and move the file into place, the cache can't be opened before this.
+        // Throws std::runtime_error if any write failed.
+        void finish();
+
+    private:
+        uint64_t write(const void *data, uint64_t size);
+
+        std::string fileName;
+        std::string temporaryFileName;
+        std::ofstream file;
+        Key key;
+        std::vector<uint64_t> shapeTable;
+        std::vector<glm::vec4> shapeBounds; // minimum and maximum per shape
+        bool finished = false;
+    };
+
+    SceneCache() = default;
+    ~SceneCache();
+
+    SceneCache(const SceneCache &) = delete;
+    SceneCache &operator=(const SceneCache &) = delete;
+
+    // the mtl files are found through the mtllib statements before the first geometry of the obj file
+    static Key makeKey(const std::string &sourceFileName, bool precomputedNormals, float triangleSplitBudget);
+
+    // map cache file, returns false if it doesn't exist, was created from a different source or settings or its shape
+    // table points outside of the file
+    bool open(const std::string &fileName, const Key &key);
+    void close();
+
+    size_t getShapeCount() const;
+    Shape getShape(size_t index) const;
+
+    // tell the OS that the pages of a shape are no longer needed, they are read from disk again on next access
+    void release(size_t index) const;
+
+private:
+    const uint8_t *data = nullptr;
+    uint64_t size = 0;
+    const uint64_t *shapeTable = nullptr;
+    const glm::vec4 *shapeBounds = nullptr;
+    uint64_t shapeCount = 0;
+#ifdef _WIN32
+    void *fileHandle = nullptr;
+    void *mappingHandle = nullptr;
+#endif
+};
+
+#endif //PATHTRACER_SCENECACHE_HPP
@@ -0,0 +1,147 @@
+//
+// Uploads into device local buffers through a host visible ring buffer, copies are batched into few transfer
+// submissions whose completion is tracked with a timeline semaphore
+//
+
+#include "StagingRing.hpp"
+
+#include <algorithm>
+
+namespace vk::utils {
+
+    namespace {
+        const vk::DeviceSize copyAlignment = 16;
+
+        vk::raii::Semaphore createTimeline(const vk::raii::Device &device) {
+            vk::SemaphoreTypeCreateInfo typeInfo(vk::SemaphoreType::eTimeline, 0);
+            vk::SemaphoreCreateInfo createInfo;
+            createInfo.pNext = &typeInfo;
+            return device.createSemaphore(createInfo);
+        }
+    }
+
+    StagingRing::StagingRing(const vk::raii::Device &device, const vk::raii::Queue &queue, uint32_t queueFamilyIndex,
+                             vk::DeviceSize size)
+            : device(device), queue(queue),
+              commandPool(device.createCommandPool({vk::CommandPoolCreateFlagBits::eResetCommandBuffer |
+                                                    vk::CommandPoolCreateFlagBits::eTransient, queueFamilyIndex})),
+              timeline(createTimeline(device)),
+              stagingBuffer({{ /* flags */ }, size, vk::BufferUsageFlagBits::eTransferSrc},
+                            vk::MemoryPropertyFlagBits::eHostVisible | vk::MemoryPropertyFlagBits::eHostCoherent),
+              recording(VK_NULL_HANDLE) {}
+
+    // command buffers and staging memory must not be freed while copies are in flight
+    StagingRing::~StagingRing() {
+        wait(flush());
+    }
+
+    // Large uploads are split, so a single one never needs the whole ring. A batch is submitted once it holds a
+    // quarter of the ring, which lets the device copy while the host fills the rest.
+    void StagingRing::upload(const Buffer &destination, const void *data, vk::DeviceSize size, vk::DeviceSize offset) {
+        const vk::DeviceSize maxChunkSize = stagingBuffer.getSize() / 4;
+
+        for (vk::DeviceSize chunkOffset = 0; chunkOffset < size; chunkOffset += maxChunkSize) {
+            const vk::DeviceSize chunkSize = std::min(maxChunkSize, size - chunkOffset);
+
+            retire();
+            vk::DeviceSize stagingOffset;
+            while (!reserve(chunkSize, stagingOffset)) {
+                // the oldest region is either pending or in flight, wait for it in both cases
+                const uint64_t value = regions.front().value > submittedValue ? flush() : regions.front().value;
+                wait(value);
+                retire();
+                ++statistics.stallCount;
+            }
+
+            stagingBuffer.uploadData(static_cast<const char *>(data) + chunkOffset, chunkSize, stagingOffset);
+
+            if (!*recording) {
+                if (freeCommandBuffers.empty()) {
+                    recording = std::move(device.allocateCommandBuffers(
+                            {*commandPool, vk::CommandBufferLevel::ePrimary, 1}).front());
+                } else {
+                    recording = std::move(freeCommandBuffers.back());
+                    freeCommandBuffers.pop_back();
+                    recording.reset();
+                }
+                recording.begin({vk::CommandBufferUsageFlagBits::eOneTimeSubmit});
+            }
+            recording.copyBuffer(*stagingBuffer.getBuffer(), *destination.getBuffer(),
+                                 vk::BufferCopy(stagingOffset, offset + chunkOffset, chunkSize));
+
+            regions.push_back({stagingOffset, stagingOffset + chunkSize, submittedValue + 1});
+            pendingBytes += chunkSize;
+            statistics.uploadedBytes += chunkSize;
+            ++statistics.copyCount;
+
+            if (pendingBytes >= maxChunkSize)
+                flush();
+        }
+    }
+
+    uint64_t StagingRing::flush() {
+        if (!*recording)
+            return submittedValue;
+
+        recording.end();
+
+        const uint64_t value = submittedValue + 1;
+        vk::TimelineSemaphoreSubmitInfo timelineInfo({ /* waitSemaphoreValues */ }, value);
+        vk::SubmitInfo submitInfo({ /* waitSemaphores */ }, { /* waitDstStageMask */ }, *recording, *timeline);
+        submitInfo.pNext = &timelineInfo;
+        queue.submit(submitInfo);
+
+        batches.push_back({std::move(recording), value});
+        submittedValue = value;
+        pendingBytes = 0;
+        ++statistics.submissionCount;
+        return value;
+    }
+
+    void StagingRing::waitOnQueue(const vk::raii::Queue &waitingQueue, uint64_t value) const {
+        const vk::PipelineStageFlags waitStage = vk::PipelineStageFlagBits::eAllCommands;
+        vk::TimelineSemaphoreSubmitInfo timelineInfo(value, { /* signalSemaphoreValues */ });
+        vk::SubmitInfo submitInfo(*timeline, waitStage, { /* commandBuffers */ }, { /* signalSemaphores */ });
+        submitInfo.pNext = &timelineInfo;
+        waitingQueue.submit(submitInfo);
+    }
+
+    void StagingRing::wait(uint64_t value) const {
+        check_vk_result(device.waitSemaphores(vk::SemaphoreWaitInfo({ /* flags */ }, *timeline, value), UINT64_MAX));
+    }
+
+    const StagingRing::Statistics &StagingRing::getStatistics() const { return statistics; }
+
+    bool StagingRing::reserve(vk::DeviceSize size, vk::DeviceSize &offset) {
+        const vk::DeviceSize ringSize = stagingBuffer.getSize();
+        const vk::DeviceSize start = (head + copyAlignment - 1) / copyAlignment * copyAlignment;
+
+        if (regions.empty()) {
+            offset = 0;
+        } else {
+            const vk::DeviceSize tail = regions.front().begin;
+            if (head > tail && start + size <= ringSize)
+                offset = start;
+            else if (head > tail && size <= tail)
+                offset = 0;  // wrap around
+            else if (head < tail && start + size <= tail)
+                offset = start;
+            else
+                return false;
+        }
+
+        head = offset + size;
+        return true;
+    }
+
+    void StagingRing::retire() {
+        const uint64_t completedValue = timeline.getCounterValue();
+        while (!regions.empty() && regions.front().value <= completedValue)
+            regions.pop_front();
+        while (!batches.empty() && batches.front().value <= completedValue) {
+            freeCommandBuffers.push_back(std::move(batches.front().commandBuffer));
+            batches.pop_front();
+        }
+    }
+
+} // namespace vk::utils
@@ -0,0 +1,83 @@
+//
+// Uploads into device local buffers through a host visible ring buffer, copies are batched into few transfer
+// submissions whose completion is tracked with a timeline semaphore
+//
+
+#ifndef PATHTRACER_STAGINGRING_HPP
+#define PATHTRACER_STAGINGRING_HPP
+
+#include <deque>
+#include <vector>
+
+#include "VulkanUtils.hpp"
+
+namespace vk::utils {
+
+    class StagingRing {
+    public:
+        struct Statistics {
+            vk::DeviceSize uploadedBytes = 0;
+            uint32_t copyCount = 0;
+            uint32_t submissionCount = 0;
+            uint32_t stallCount = 0;  // uploads which had to wait for a submission to finish
+        };
+
+        // queue and queueFamilyIndex: where the copies are executed, usually the transfer queue
+        StagingRing(const vk::raii::Device &device, const vk::raii::Queue &queue, uint32_t queueFamilyIndex,
+                    vk::DeviceSize size = vk::DeviceSize(64) << 20);
+
+        ~StagingRing();
+
+        // destination buffers need eTransferDst usage, data can be reused as soon as this returns
+        void upload(const Buffer &destination, const void *data, vk::DeviceSize size, vk::DeviceSize offset = 0);
+
+        // submit all pending copies, returns the timeline value signalled once they are complete
+        uint64_t flush();
+
+        // Make later submissions to queue wait until the copies up to value are complete, without blocking the host.
+        // The wait also makes the copied data visible to these submissions.
+        void waitOnQueue(const vk::raii::Queue &queue, uint64_t value) const;
+
+        // block until the copies up to value are complete
+        void wait(uint64_t value) const;
+
+        const Statistics &getStatistics() const;
+
+    private:
+        struct Region {
+            vk::DeviceSize begin;
+            vk::DeviceSize end;
+            uint64_t value;  // timeline value after which the region can be overwritten
+        };
+
+        struct Batch {
+            vk::raii::CommandBuffer commandBuffer;
+            uint64_t value;
+        };
+
+        // returns false if the ring has no contiguous space of the given size left
+        bool reserve(vk::DeviceSize size, vk::DeviceSize &offset);
+
+        // forget regions and batches which the device has finished with
+        void retire();
+
+        const vk::raii::Device &device;
+        const vk::raii::Queue &queue;
+        vk::raii::CommandPool commandPool;
+        vk::raii::Semaphore timeline;
+        Buffer stagingBuffer;
+
+        vk::DeviceSize head = 0;
+        std::deque<Region> regions;        // in allocation order, so the oldest one is the tail of the ring
+        std::deque<Batch> batches;         // submitted, in order of their timeline values
+        std::vector<vk::raii::CommandBuffer> freeCommandBuffers;
+        vk::raii::CommandBuffer recording; // batch which collects copies until the next flush
+        vk::DeviceSize pendingBytes = 0;
+        uint64_t submittedValue = 0;
+
+        Statistics statistics;
+    };
+
+} // namespace vk::utils
+
+#endif //PATHTRACER_STAGINGRING_HPP
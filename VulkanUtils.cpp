@@ -20,11 +20,13 @@ namespace vk::utils {
     void Initialize(vk::raii::PhysicalDevice *physicalDevice,
                     vk::raii::Device *device,
                     vk::raii::CommandPool *commandPool,
-                    vk::raii::Queue *transferQueue) {
+                    vk::raii::Queue *transferQueue,
+                    MemoryAllocator *allocator) {
         context::physicalDevice = physicalDevice;
         context::device = device;
         context::commandPool = commandPool;
         context::transferQueue = transferQueue;
+        context::allocator = allocator;
 
         context::physicalMemoryProperties = physicalDevice->getMemoryProperties();
     }
@@ -77,41 +79,31 @@ namespace vk::utils {
                                       imageMemoryBarrier);
     }
 
-    Buffer::Buffer() : buffer(VK_NULL_HANDLE), memory(VK_NULL_HANDLE), size() {}
+    Buffer::Buffer() : buffer(VK_NULL_HANDLE), size() {}
 
-    vk::utils::Buffer::Buffer(vk::BufferCreateInfo bufferCreateInfo, vk::MemoryPropertyFlags memoryProperties) : size(
-            bufferCreateInfo.size),
-                                                                                                                 buffer(context::device->createBuffer(
-                                                                                                                         bufferCreateInfo)),
-                                                                                                                 memory(VK_NULL_HANDLE) {
+    vk::utils::Buffer::Buffer(vk::BufferCreateInfo bufferCreateInfo, vk::MemoryPropertyFlags memoryProperties,
+                              AllocationStrategy allocationStrategy) : buffer(context::device->createBuffer(
+            bufferCreateInfo)), size(bufferCreateInfo.size) {
         vk::MemoryRequirements memoryRequirements = buffer.getMemoryRequirements();
 
-        vk::MemoryAllocateInfo allocateInfo(memoryRequirements.size,
-                                            getMemoryType(memoryRequirements, memoryProperties));
+        allocation = context::allocator->allocate(memoryRequirements,
+                                                  getMemoryType(memoryRequirements, memoryProperties),
+                                                  true,
+                                                  allocationStrategy);
 
-        vk::MemoryAllocateFlagsInfo memoryAllocateFlagsInfo(vk::MemoryAllocateFlagBits::eDeviceAddress);
-        allocateInfo.pNext = &memoryAllocateFlagsInfo;
-
-        memory = std::move(context::device->allocateMemory(
-                allocateInfo));
-
-        buffer.bindMemory(*memory, 0);
+        buffer.bindMemory(*allocation.getMemory(), allocation.getOffset());
     }
 
-    // map memory region to void pointer
-    void *vk::utils::Buffer::map(vk::DeviceSize size, vk::DeviceSize offset) const {
-        size = std::min(this->size, size); // we can't map more than is allocated
-        return memory.mapMemory(offset, size);
+    // copy data to memory region, the memory stays mapped for the lifetime of its block
+    void vk::utils::Buffer::uploadData(const void *data, vk::DeviceSize size, vk::DeviceSize offset) const {
+        memcpy(static_cast<char *>(allocation.getMappedData()) + offset, data, size);
+        allocation.flush(offset, size);
     }
 
-    // unmap mapped memory region
-    void vk::utils::Buffer::unmap() const { memory.unmapMemory(); }
-
-    // copy data to memory region
-    void vk::utils::Buffer::uploadData(const void *data, vk::DeviceSize size, vk::DeviceSize offset) const {
-        void *mem = this->map(size, offset);
-        memcpy(mem, data, size);
-        this->unmap();
+    // copy data from memory region
+    void vk::utils::Buffer::downloadData(void *data, vk::DeviceSize size, vk::DeviceSize offset) const {
+        allocation.invalidate(offset, size);
+        memcpy(data, static_cast<const char *>(allocation.getMappedData()) + offset, size);
     }
 
     const vk::raii::Buffer &Buffer::getBuffer() const { return buffer; }
@@ -123,12 +115,11 @@ namespace vk::utils {
     }
 
     Image::Image()
-            : format(), image(VK_NULL_HANDLE), imageView(VK_NULL_HANDLE), memory(VK_NULL_HANDLE),
-              sampler(VK_NULL_HANDLE) {}
+            : format(), image(VK_NULL_HANDLE), imageView(VK_NULL_HANDLE), sampler(VK_NULL_HANDLE) {}
 
     Image::Image(vk::ImageType imageType, vk::Format format, vk::Extent3D extent, vk::ImageTiling tiling,
-                 vk::ImageUsageFlags usage, vk::MemoryPropertyFlags memoryProperties) : format(format),
-                                                                                        memory(VK_NULL_HANDLE),
+                 vk::ImageUsageFlags usage, vk::MemoryPropertyFlags memoryProperties,
+                 uint32_t arrayLayers, AllocationStrategy allocationStrategy) : format(format),
                                                                                         image(VK_NULL_HANDLE),
                                                                                         imageView(VK_NULL_HANDLE),
                                                                                         sampler(VK_NULL_HANDLE) {
@@ -137,7 +128,7 @@ namespace vk::utils {
                                               this->format,
                                               extent,
                                               1,
-                                              1,
+                                              arrayLayers,
                                               vk::SampleCountFlagBits::e1,
                                               tiling,
                                               usage,
@@ -145,16 +136,12 @@ namespace vk::utils {
 
         vk::MemoryRequirements memoryRequirements = image.getMemoryRequirements();
 
-        vk::MemoryAllocateInfo allocateInfo(memoryRequirements.size,
-                                            getMemoryType(memoryRequirements, memoryProperties));
-
-        vk::MemoryAllocateFlagsInfo memoryAllocateFlagsInfo(vk::MemoryAllocateFlagBits::eDeviceAddress);
-        allocateInfo.pNext = &memoryAllocateFlagsInfo;
-
-        memory = std::move(context::device->allocateMemory(
-                allocateInfo));
+        allocation = context::allocator->allocate(memoryRequirements,
+                                                  getMemoryType(memoryRequirements, memoryProperties),
+                                                  tiling == vk::ImageTiling::eLinear,
+                                                  allocationStrategy);
 
-        image.bindMemory(*memory, 0);
+        image.bindMemory(*allocation.getMemory(), allocation.getOffset());
     }
 
     void Image::createImageView(vk::ImageViewType imageViewType, vk::Format format,
@@ -194,7 +181,7 @@ namespace vk::utils {
 
     const vk::raii::Image &Image::getImage() const { return image; }
 
-    const vk::raii::DeviceMemory &Image::getDeviceMemory() const { return memory; }
+    const void *Image::getMappedData() const { return allocation.getMappedData(); }
 
     const vk::raii::ImageView &Image::getImageView() const { return imageView; }
 
@@ -6,6 +6,7 @@
 #define PATHTRACER_VULKANUTILS_HPP
 
 #include "vulkan/vulkan_raii.hpp"
+#include "MemoryAllocator.hpp"
 
 // vulkan error handling
 void check_vk_result(vk::Result err);
@@ -19,6 +20,7 @@ namespace vk::utils {
         static vk::raii::CommandPool*               commandPool;
         static vk::raii::Queue*                     transferQueue;
         static vk::PhysicalDeviceMemoryProperties   physicalMemoryProperties;
+        static MemoryAllocator*                     allocator;
     } // namespace context
 
     enum QueueFamilyIndex {graphics, compute, transfer};
@@ -26,9 +28,11 @@ namespace vk::utils {
     class Buffer {
     public:
         Buffer();
-        Buffer(BufferCreateInfo bufferCreateInfo, MemoryPropertyFlags memoryProperties);
+        Buffer(BufferCreateInfo bufferCreateInfo, MemoryPropertyFlags memoryProperties,
+               AllocationStrategy allocationStrategy = AllocationStrategy::buddy);
 
         void uploadData(const void* data, vk::DeviceSize size, vk::DeviceSize offset = 0) const;
+        void downloadData(void* data, vk::DeviceSize size, vk::DeviceSize offset = 0) const;
 
         // getters
         const vk::raii::Buffer& getBuffer() const;
@@ -36,11 +40,8 @@ namespace vk::utils {
         vk::DeviceAddress getAddress() const;
 
     private:
-        void* map(vk::DeviceSize size = UINT64_MAX, vk::DeviceSize offset = 0) const;
-        void unmap() const;
-
+        Allocation allocation; // declared first, so the buffer is destroyed before its memory is released
         vk::raii::Buffer buffer;
-        vk::raii::DeviceMemory memory;
         vk::DeviceSize size;
     };
 
@@ -53,20 +54,22 @@ namespace vk::utils {
                           Extent3D extent,
                           vk::ImageTiling tiling,
                           vk::ImageUsageFlags usage,
-                          vk::MemoryPropertyFlags memoryProperties);
+                          vk::MemoryPropertyFlags memoryProperties,
+                          uint32_t arrayLayers = 1,
+                          AllocationStrategy allocationStrategy = AllocationStrategy::buddy);
 
         void createImageView(vk::ImageViewType imageViewType, vk::Format format, vk::ImageSubresourceRange imageSubresourceRange);
         void createSampler(vk::Filter magFilter, vk::Filter minFilter, vk::SamplerMipmapMode mipmapMode, vk::SamplerAddressMode addressMode);
 
         Format getFormat() const;
         const vk::raii::Image& getImage() const;
-        const vk::raii::DeviceMemory& getDeviceMemory() const;
+        const void* getMappedData() const; // nullptr if the image isn't host visible
         const vk::raii::ImageView& getImageView() const;
         const raii::Sampler& getSampler() const;
     private:
         vk::Format format;
+        Allocation allocation;
         vk::raii::Image image;
-        vk::raii::DeviceMemory memory;
         vk::raii::ImageView imageView;
         vk::raii::Sampler sampler;
     };
@@ -84,6 +87,8 @@ namespace vk::utils {
         vk::utils::Buffer buffer;
         vk::raii::AccelerationStructureKHR accelerationStructure{VK_NULL_HANDLE};
         vk::utils::Buffer instancesBuffer;
+        vk::DeviceSize uncompactedSize{}; // size required by the build before compaction
+        float buildTime{};                // GPU build duration in milliseconds
         vk::DeviceAddress getAddress() const;
     };
 
@@ -94,12 +99,17 @@ namespace vk::utils {
         std::vector<vk::utils::Buffer> vertexBuffers;
         std::vector<vk::utils::Buffer> indexBuffers;
         std::vector<vk::utils::Buffer> materialBuffers;
+        std::vector<vk::utils::Buffer> normalBuffers;
+
+        vk::utils::Buffer lightNodeBuffer;     // light tree over the emissive triangles
+        vk::utils::Buffer lightTriangleBuffer; // emissive triangles in the order of the light tree leaves
     };
 
     void Initialize(vk::raii::PhysicalDevice* physicalDevice,
                     vk::raii::Device* device,
                     vk::raii::CommandPool* commandPool,
-                    vk::raii::Queue* transferQueue);
+                    vk::raii::Queue* transferQueue,
+                    MemoryAllocator* allocator);
 
     // check if list of extensions contains specific extension by name
     bool contains(const std::vector<vk::ExtensionProperties> &extensionProperties, const std::string &extensionName);
@@ -11,7 +11,13 @@ setlocal
 set PATH=%PATH%;lib/glslang/bin
 
 glslangValidator --target-env vulkan1.2 -V -S rgen shaders/rayGen.glsl -o shaderBin/rayGen.bin
+glslangValidator --target-env vulkan1.2 -V -S rgen -DUSE_SER shaders/rayGen.glsl -o shaderBin/rayGenSER.bin
+glslangValidator --target-env vulkan1.2 -V -S rgen -DDIAGNOSTICS shaders/rayGen.glsl -o shaderBin/rayGenDiagnostics.bin
+glslangValidator --target-env vulkan1.2 -V -S rgen shaders/rayGenLight.glsl -o shaderBin/rayGenLight.bin
+glslangValidator --target-env vulkan1.2 -V -S rgen -DATOMIC_FLOAT shaders/rayGenLight.glsl -o shaderBin/rayGenLightAtomicFloat.bin
 glslangValidator --target-env vulkan1.2 -V -S rchit shaders/rayChit.glsl -o shaderBin/rayChit.bin
+glslangValidator --target-env vulkan1.2 -V -S rahit shaders/rayAhit.glsl -o shaderBin/rayAhit.bin
 glslangValidator --target-env vulkan1.2 -V -S rmiss shaders/rayMiss.glsl -o shaderBin/rayMiss.bin
+glslangValidator --target-env vulkan1.2 -V -S rmiss shaders/rayMissShadow.glsl -o shaderBin/rayMissShadow.bin
 
 :end
\ No newline at end of file
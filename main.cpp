@@ -1,9 +1,152 @@
 #include "PathTracerApp.hpp"
 
+#include <cmath>
 #include <iostream>
+#include <limits>
+#include <map>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+static const char *const usage =
+        "usage: PathTracer [--time seconds] [--spp samples] [--noise relativeError] [--reference output.pfm]\n"
+        "                  [--converge reference.pfm] [--budgets seconds,...] [--baseline curve.csv] [--flatten on|off]\n"
+        "                  [--lights off|power|tree] [--resampling off|biased|normalized|unbiased]\n"
+        "                  [--light-tracing on|off] [--server socket] [--sequence path.txt] [--fps n] [--frames file|-]\n"
+        "                  [--views views.txt] [--view-output view.pfm] [--sequential on|off] [--specialize on|off]\n"
+        "                  [--build fast-trace|fast-build] [--split-budget fraction]\n";
+
+// the whole value has to be a finite number of at least minimum, throws std::invalid_argument otherwise
+static double toNumber(const std::string &value, double minimum) {
+    size_t end = 0;
+    const double number = std::stod(value, &end);
+    if (end != value.size() || !std::isfinite(number) || number < minimum)
+        throw std::invalid_argument(value);
+    return number;
+}
+
+static uint32_t toCount(const std::string &value) {
+    const double number = toNumber(value, 0);
+    if (number != std::floor(number) || number > std::numeric_limits<uint32_t>::max())
+        throw std::invalid_argument(value);
+    return static_cast<uint32_t>(number);
+}
+
+// one of the names of the option, throws std::invalid_argument otherwise
+template<typename T>
+static T toChoice(const std::string &value, const std::map<std::string, T> &choices) {
+    const auto choice = choices.find(value);
+    if (choice == choices.end())
+        throw std::invalid_argument(value);
+    return choice->second;
+}
+
+static bool toSwitch(const std::string &value) {
+    return toChoice<bool>(value, {{"on", true}, {"off", false}});
+}
+
+// Any of the limits turns the run into an unattended render job which exports the image when it ends. --converge
+// measures the error against the reference after each budget instead and exits with 1 if it regressed against the
+// baseline curve. --server keeps running and renders the jobs sent to the socket, see RenderServer. --sequence
+// renders every frame of a camera path until the limits are reached and streams it as raw RGB to --frames. --views
+// renders several cameras in one pass and writes an image per view, --sequential compares with one view at a time.
+// Invalid arguments print the usage and exit with 2.
+int main(int argc, char **argv) {
+    double timeBudget = 0;
+    uint32_t maxSamples = 0;
+    float noiseTarget = 0;
+    std::string referenceOutput;
+    std::string convergenceReference;
+    std::vector<double> convergenceBudgets{1, 2, 4, 8, 16};
+    std::string convergenceBaseline;
+    bool flattenShapes = true;
+    bool specializeShaders = true;
+    bool fastBuild = false;
+    float triangleSplitBudget = 0;
+    uint32_t lightSampling = LIGHT_SAMPLING_TREE;
+    uint32_t resampling = RESAMPLING_OFF;
+    bool lightTracing = false;
+    std::string serverSocket;
+    std::string cameraPath;
+    float sequenceFps = 30.0f;
+    std::string sequenceOutput = "-";
+    std::string viewsFile;
+    std::string viewOutput = "view.pfm";
+    bool sequentialBaseline = false;
+
+    for (int i = 1; i < argc; i += 2) {
+        const std::string option = argv[i];
+        if (i + 1 == argc) {
+            std::cerr << "Missing value for " << option << '\n' << usage;
+            return 2;
+        }
+        const std::string value = argv[i + 1];
+
+        try {
+            if (option == "--time") timeBudget = toNumber(value, 0);
+            else if (option == "--spp") maxSamples = toCount(value);
+            else if (option == "--noise") noiseTarget = static_cast<float>(toNumber(value, 0));
+            else if (option == "--reference") referenceOutput = value;
+            else if (option == "--converge") convergenceReference = value;
+            else if (option == "--baseline") convergenceBaseline = value;
+            else if (option == "--flatten") flattenShapes = toSwitch(value);
+            else if (option == "--specialize") specializeShaders = toSwitch(value);
+            else if (option == "--build")
+                fastBuild = toChoice<bool>(value, {{"fast-trace", false}, {"fast-build", true}});
+            else if (option == "--split-budget") triangleSplitBudget = static_cast<float>(toNumber(value, 0));
+            else if (option == "--light-tracing") lightTracing = toSwitch(value);
+            else if (option == "--server") serverSocket = value;
+            else if (option == "--sequence") cameraPath = value;
+            else if (option == "--fps") sequenceFps = static_cast<float>(toNumber(value, 0));
+            else if (option == "--frames") sequenceOutput = value;
+            else if (option == "--views") viewsFile = value;
+            else if (option == "--view-output") viewOutput = value;
+            else if (option == "--sequential") sequentialBaseline = toSwitch(value);
+            else if (option == "--lights")
+                lightSampling = toChoice<uint32_t>(value, {{"off",   LIGHT_SAMPLING_OFF},
+                                                           {"power", LIGHT_SAMPLING_POWER},
+                                                           {"tree",  LIGHT_SAMPLING_TREE}});
+            else if (option == "--resampling")
+                resampling = toChoice<uint32_t>(value, {{"off",        RESAMPLING_OFF},
+                                                        {"biased",     RESAMPLING_BIASED},
+                                                        {"normalized", RESAMPLING_NORMALIZED},
+                                                        {"unbiased",   RESAMPLING_UNBIASED}});
+            else if (option == "--budgets") {
+                convergenceBudgets.clear();
+                std::istringstream budgets(value);
+                for (std::string budget; std::getline(budgets, budget, ',');)
+                    convergenceBudgets.push_back(toNumber(budget, 0));
+                if (convergenceBudgets.empty())
+                    throw std::invalid_argument(value);
+            } else {
+                std::cerr << "Unknown option " << option << '\n' << usage;
+                return 2;
+            }
+        } catch (const std::exception &) { // std::invalid_argument and std::out_of_range
+            std::cerr << "Invalid value " << value << " for " << option << '\n' << usage;
+            return 2;
+        }
+    }
+    if (!(sequenceFps > 0.0f)) {
+        std::cerr << "--fps must be positive" << std::endl;
+        return 2;
+    }
 
-int main() {
     auto& app = PathTracerApp::instance();
     app.initSettings("PathTracer", 1280, 720, "cornell_box", 16);
-    app.run();
-}
\ No newline at end of file
+    app.setRenderLimits(timeBudget, maxSamples, noiseTarget);
+    app.setReferenceOutput(referenceOutput);
+    app.setConvergenceTest(convergenceReference, convergenceBudgets, convergenceBaseline);
+    app.setFlattenShapes(flattenShapes);
+    app.setSpecializeShaders(specializeShaders);
+    app.setBuildQuality(fastBuild);
+    app.setTriangleSplitBudget(triangleSplitBudget);
+    app.setLightSampling(lightSampling);
+    app.setResampling(resampling);
+    app.setLightTracing(lightTracing);
+    app.setServer(serverSocket);
+    app.setSequence(cameraPath, sequenceFps, sequenceOutput);
+    app.setViews(viewsFile, viewOutput, sequentialBaseline);
+    return app.run();
+}
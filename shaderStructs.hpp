@@ -9,25 +9,115 @@ using namespace glm;
 #else
 #include "random.glsl"
 
+// state of a path which is carried from bounce to bounce by the ray generation loop
 struct Payload {
-    vec3 dir;
-    vec3 color;
-    uint depth;
+    vec3 origin;     // origin of the next ray
+    vec3 dir;        // direction of the current ray, replaced by direction of the next ray on hit
+    vec3 throughput; // attenuation of the path up to the current hit
+    vec3 radiance;   // radiance gathered along the path so far
+    vec3 normal;     // geometric normal at the last hit
+    vec3 albedo;     // reflectance at the last hit
+    bool done;       // path has left the scene
+    bool specular;   // last hit reflected the ray like a mirror, direct light can't be sampled there
+    bool countEmission; // hits add the emittance of the surface, unless it was already sampled as direct light
+    uint intersections; // candidate hits found during traversal, only counted by the diagnostics shader
     RNG rng;
 };
 
 #endif // __cplusplus
 
+// what the ray generation shader computes per sample
+#define RENDER_MODE_PATH_TRACING 0
+#define RENDER_MODE_AMBIENT_OCCLUSION 1
+
+// how paths gather light from emissive triangles
+#define LIGHT_SAMPLING_OFF 0   // only when they hit them
+#define LIGHT_SAMPLING_POWER 1 // one shadow ray per diffuse hit to a light picked by emitted power
+#define LIGHT_SAMPLING_TREE 2  // like LIGHT_SAMPLING_POWER, but lights are also weighed by distance and orientation
+
+// Reservoir resampling of the direct light at primary hits, in the style of ReSTIR (Bitterli et al. 2020). Candidates
+// drawn by the light sampling strategy are resampled together with the reservoirs of the last frame at the same
+// surface and at nearby pixels. The modes differ in how the reused reservoirs are normalized.
+#define RESAMPLING_OFF 0        // primary hits sample direct light like all other hits
+#define RESAMPLING_BIASED 1     // by all reused candidates, darkens where neighbors see different lights
+#define RESAMPLING_NORMALIZED 2 // by the candidates of pixels which could have picked the sample, ignoring occlusion
+#define RESAMPLING_UNBIASED 3   // like RESAMPLING_NORMALIZED, with a shadow ray from each reused pixel
+
+// quantities accumulated per pixel, each one has a pair of layers in the accumulation images
+#define AOV_COLOR 0
+#define AOV_ALBEDO 1  // first hit reflectance, guides the denoiser
+#define AOV_NORMAL 2  // first hit normal facing the camera, guides the denoiser
+#define AOV_MOMENTS 3 // x: luminance, y: squared luminance, used to estimate the remaining noise
+#define AOV_DIAGNOSTICS 4 // x: clock cycles in traceRayEXT, y: candidate intersections, z: bounces of a path
+#define AOV_COUNT 5
+
+struct PushConstants {
+    uint maxDepth;
+    uint renderMode;
+    uint lightSampling; // LIGHT_SAMPLING_*
+    uint resampling;    // RESAMPLING_*, only used with light sampling
+    uint lightTracing;  // 1 if the light tracing pass splatted caustics onto the film of this frame
+};
+
 struct Material {
     vec4 emittance;
     vec4 reflectance; // xyz: color, w: shininess
 };
 
+// emissive triangle, lights are two sided like all diffuse emitters
+struct LightTriangle {
+    vec4 v0; // w: area
+    vec4 v1;
+    vec4 v2;
+    vec4 emittance;
+};
+
+// light sample a pixel keeps between frames
+struct Reservoir {
+    vec2 barycentrics;        // of the point on the light triangle
+    uint light;               // index of the light triangle, ~0u for an empty reservoir
+    float targetPdf;          // unshadowed luminance of the sample at the surface of the pixel
+    float weightSum;          // of all candidates seen
+    float candidates;         // number of candidates seen
+    float contributionWeight; // estimate of the inverse density of the sample
+    float padding;
+};
+
+// Node of the light tree in depth first order, the first child directly follows its parent. The normals of all
+// triangles below the node or their opposites lie within the cone around axis.
+struct LightNode {
+    vec4 boundsMin; // w: emitted power
+    vec4 boundsMax; // w: cosine of the cone angle
+    vec4 axis;
+    uvec4 info;     // x: index of the second child or for leaves of the light triangle, y: 1 for leaves
+};
+
+// Multi-view jobs trace up to MAX_VIEWS cameras in one launch, the views are tiled in a grid over the render size.
+#define MAX_VIEWS 16
+
+struct ViewCamera {
+    vec4 position;
+    vec4 direction;
+    vec4 up;
+    vec4 side;
+    vec4 nearFarFOV;
+};
+
 struct FrameData {
     vec4 cameraPos;
     vec4 cameraDir;
     vec4 cameraUp;
     vec4 cameraSide;
     vec4 cameraNearFarFOV;
-    uvec4 frameID;
+    uvec4 frameID;    // x: frames since history was discarded, y: history must be reprojected, z: history layer
+    uvec4 renderSize; // xy: traced pixels of this frame, zw: of the previous frame
+    vec4 sceneMin; // scene bounds, used to group rays by origin
+    vec4 sceneMax;
+    vec4 previousCameraPos; // camera of the previous frame, used to reproject the accumulated history
+    vec4 previousCameraDir;
+    vec4 previousCameraUp;
+    vec4 previousCameraSide;
+    vec4 previousCameraNearFarFOV;
+    uvec4 views; // x: number of views, 0 for the single camera above, y: columns of the view grid, zw: view size
+    ViewCamera viewCameras[MAX_VIEWS];
 };
\ No newline at end of file
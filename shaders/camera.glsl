@@ -0,0 +1,31 @@
+#ifndef CAMERA_GLSL
+#define CAMERA_GLSL
+
+// Pinhole camera shared by the ray generation shaders. Screen coordinates run from -1 to 1 with y pointing down, the
+// image plane at distance 1 is 2 * imagePlaneWidth high. The basis direction, side, up is orthonormal, see Camera.
+
+float imagePlaneWidth(ViewCamera camera) {
+    return tan(camera.nearFarFOV.z * PI / 180 * 0.5f);
+}
+
+vec3 cameraRayDir(ViewCamera camera, vec2 screenUV, float aspect) {
+    const float planeWidth = imagePlaneWidth(camera);
+    return normalize(camera.direction.xyz + camera.side.xyz * (planeWidth * aspect * screenUV.x) -
+                     camera.up.xyz * (planeWidth * screenUV.y));
+}
+
+// inverse of cameraRayDir, screen coordinates position is seen at and its distance along the view direction, false
+// if it lies behind the camera
+bool projectToScreen(ViewCamera camera, vec3 position, float aspect, out vec2 screenUV, out float depth) {
+    const vec3 toPosition = position - camera.position.xyz;
+    depth = dot(toPosition, camera.direction.xyz);
+    if (depth <= 0.0f)
+        return false;
+
+    const float planeWidth = imagePlaneWidth(camera);
+    screenUV = vec2(dot(toPosition, camera.side.xyz) / (planeWidth * aspect),
+                    -dot(toPosition, camera.up.xyz) / planeWidth) / depth;
+    return true;
+}
+
+#endif
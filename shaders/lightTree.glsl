@@ -0,0 +1,107 @@
+#ifndef LIGHT_TREE_GLSL
+#define LIGHT_TREE_GLSL
+
+// Stochastic light selection by descending the light tree built by LightTree.cpp, the including shader declares the
+// LightNodes buffer.
+
+#include "random.glsl"
+
+// cos(a - b) for angles a, b in [0, pi] given by their sines and cosines, 1 if a < b
+float cosSubClamped(float sinA, float cosA, float sinB, float cosB) {
+    return cosA > cosB ? 1.0f : cosA * cosB + sinA * sinB;
+}
+
+// sin(a - b) for angles a, b in [0, pi] given by their sines and cosines, 0 if a < b
+float sinSubClamped(float sinA, float cosA, float sinB, float cosB) {
+    return cosA > cosB ? 0.0f : sinA * cosB - cosA * sinB;
+}
+
+// Upper bound of the light a node can send to a surface at position with the given normal, following Conty and
+// Kulla, "Importance Sampling of Many Lights with Adaptive Tree Splitting". The angles between the node axis, the
+// receiver normal and the direction to the node are reduced by the angle the node bounds subtend, as any point within
+// the bounds might emit. Triangles emit on both sides, so the angle to the axis is at most pi / 2.
+float nodeImportance(LightNode node, vec3 position, vec3 normal, bool spatial) {
+    const float power = node.boundsMin.w;
+    if (!spatial || power <= 0.0f)
+        return power;
+
+    const vec3 center = 0.5f * (node.boundsMin.xyz + node.boundsMax.xyz);
+    const vec3 diagonal = node.boundsMax.xyz - node.boundsMin.xyz;
+    const float radius2 = 0.25f * dot(diagonal, diagonal);
+    const vec3 toPosition = position - center;
+    const float distance2 = dot(toPosition, toPosition);
+    const vec3 wi = toPosition * inversesqrt(max(distance2, 1e-12f));
+
+    // angle of the bounding sphere as seen from the shading point
+    const float cosBounds = distance2 > radius2 ? sqrt(1.0f - radius2 / distance2) : -1.0f;
+    const float sinBounds = sqrt(max(0.0f, 1.0f - cosBounds * cosBounds));
+
+    // angle between the emitting side of the closest normal in the cone and the direction to the shading point
+    const float cosAxis = abs(dot(node.axis.xyz, wi));
+    const float sinAxis = sqrt(max(0.0f, 1.0f - cosAxis * cosAxis));
+    const float cosSpread = node.boundsMax.w;
+    const float sinSpread = sqrt(max(0.0f, 1.0f - cosSpread * cosSpread));
+    const float cosOutside = cosSubClamped(sinAxis, cosAxis, sinSpread, cosSpread);
+    const float sinOutside = sinSubClamped(sinAxis, cosAxis, sinSpread, cosSpread);
+    const float cosEmission = cosSubClamped(sinOutside, cosOutside, sinBounds, cosBounds);
+    if (cosEmission <= 0.0f)
+        return 0.0f;
+
+    // angle between the receiver normal and the direction to the node
+    const float cosReceiver = dot(-wi, normal);
+    const float sinReceiver = sqrt(max(0.0f, 1.0f - cosReceiver * cosReceiver));
+    const float cosIncident = cosSubClamped(sinReceiver, cosReceiver, sinBounds, cosBounds);
+    if (cosIncident <= 0.0f)
+        return 0.0f;
+
+    // closer than the node radius the distance is unreliable, as the lights may be anywhere within the bounds
+    return power * cosEmission * cosIncident / max(distance2, radius2);
+}
+
+// Picks one light triangle for a surface at position which reflects into the hemisphere of normal. Every node chooses
+// one of its children with probability proportional to their importance, pmf is the probability of the whole descent.
+// Without spatial importance lights are chosen by power alone. Returns false if no light can reach the surface.
+bool selectLight(vec3 position, vec3 normal, bool spatial, inout RNG rng, out uint triangleIndex, out float pmf) {
+    pmf = 1.0f;
+    LightNode node = LightNodes.nodes[0];
+    if (nodeImportance(node, position, normal, spatial) <= 0.0f)
+        return false;
+
+    uint nodeIndex = 0;
+    while (node.info.y == 0) {
+        const LightNode first = LightNodes.nodes[nodeIndex + 1];
+        const LightNode second = LightNodes.nodes[node.info.x];
+        const float firstImportance = nodeImportance(first, position, normal, spatial);
+        const float secondImportance = nodeImportance(second, position, normal, spatial);
+        if (firstImportance + secondImportance <= 0.0f)
+            return false;
+
+        const float firstProbability = firstImportance / (firstImportance + secondImportance);
+        if (next_float(rng) < firstProbability) {
+            nodeIndex = nodeIndex + 1;
+            node = first;
+            pmf *= firstProbability;
+        } else {
+            nodeIndex = node.info.x;
+            node = second;
+            pmf *= 1.0f - firstProbability;
+        }
+    }
+
+    triangleIndex = node.info.x;
+    return pmf > 0.0f;
+}
+
+// barycentric coordinates of a uniformly distributed point on a triangle, the density is 1 / area
+vec2 sampleTriangle(inout RNG rng) {
+    const float su = sqrt(next_float(rng));
+    const float v = next_float(rng) * su;
+    return vec2(su - v, v);
+}
+
+vec3 lightPoint(LightTriangle light, vec2 barycentrics) {
+    return light.v0.xyz * (1.0f - barycentrics.x - barycentrics.y) + light.v1.xyz * barycentrics.x +
+           light.v2.xyz * barycentrics.y;
+}
+
+#endif // LIGHT_TREE_GLSL
@@ -57,6 +57,16 @@ vec3 randomVecInHemisphere(RNG rng, vec3 normal) {
     return dot(normal, w) > 0 ? w : -w;
 }
 
+// cosine weighted direction in the hemisphere of a unit normal vector, the density is cos(theta) / pi
+vec3 randomCosineDirection(inout RNG rng, vec3 normal) {
+    const float phi = next_float(rng) * 2.0 * PI;
+    const float r2 = next_float(rng);
+    const vec3 tangent = normalize(abs(normal.x) > 0.5 ? cross(normal, vec3(0, 1, 0)) : cross(normal, vec3(1, 0, 0)));
+    const vec3 bitangent = cross(normal, tangent);
+    const float r = sqrt(r2);
+    return normalize(tangent * (r * cos(phi)) + bitangent * (r * sin(phi)) + normal * sqrt(max(0.0, 1.0 - r2)));
+}
+
 // Uses the Box-Muller transform to return a normally distributed (centered
 // at 0, standard deviation 1) 2D point.
 vec2 randomGaussian(inout RNG rng) {
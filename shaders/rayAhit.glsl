@@ -0,0 +1,13 @@
+#version 460
+#extension GL_EXT_ray_tracing : require
+#extension GL_GOOGLE_include_directive : require
+
+#include "../shaderStructs.hpp"
+
+rayPayloadInEXT Payload payloadIn;
+
+// Only invoked for rays traced with gl_RayFlagsNoOpaqueEXT by the diagnostics shader. Counts every candidate hit
+// traversal finds, the hit is accepted as usual so the closest hit is unchanged.
+void main() {
+    payloadIn.intersections++;
+}
\ No newline at end of file
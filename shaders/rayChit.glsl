@@ -20,7 +20,6 @@ vec3 barycentricToCartesian(vec3 v1, vec3 v2, vec3 v3, vec3 baryCoords) {
     return v1 * baryCoords.x + v2 * baryCoords.y + v3 * baryCoords.z;
 }
 
-layout(set = 0, binding = 0) uniform accelerationStructureEXT Scene;
 //array of vertex arrays for every shape
 layout(set = 1, binding = 0, std430) readonly buffer VertexBuffer {
     vec4 vertices[];
@@ -33,87 +32,74 @@ layout(set = 2, binding = 0, std430) readonly buffer IndexBuffer {
 layout(set = 3, binding = 0, std430) readonly buffer MaterialBuffer {
     Material materials[];
 } Materials[];
+// array with precomputed face normals for every shape
+layout(set = 4, binding = 0, std430) readonly buffer NormalBuffer {
+    vec4 normals[];
+} Normals[];
+
+// if disabled, normals are calculated from the indexed vertices instead to save memory
+layout(constant_id = 0) const bool precomputedNormals = true;
+// Material kinds the scene contains, the shader is specialized for each scene so branches for the others are removed.
+// All enabled is the generic shader.
+layout(constant_id = 1) const bool sceneHasMirrors = true;
+layout(constant_id = 2) const bool sceneHasDiffuse = true;
+layout(constant_id = 3) const bool sceneHasEmitters = true; // diffuse surfaces with emittance
 
 rayPayloadInEXT Payload payloadIn;
 hitAttributeEXT vec2 HitAttribs;
 
-layout(location = 0) rayPayloadEXT Payload payload;
+// Shades a single hit and prepares the next ray of the path.
+// No rays are traced from here, the path loop lives in the ray generation shader.
+void main() {
+    vec3 surfaceNormal;
+    vec3 hitPosition;
+
+    if (precomputedNormals) {
+        surfaceNormal = Normals[gl_InstanceID].normals[gl_PrimitiveID].xyz;
+        hitPosition = gl_WorldRayOriginEXT + gl_WorldRayDirectionEXT * gl_HitTEXT;
+    } else {
+        // get vertices of hit triangle
+        const uvec3 hitIndices = uvec3(
+            Indices[gl_InstanceID].indices[3 * gl_PrimitiveID + 0],
+            Indices[gl_InstanceID].indices[3 * gl_PrimitiveID + 1],
+            Indices[gl_InstanceID].indices[3 * gl_PrimitiveID + 2]
+        );
+        const vec3 v1 = Vertices[gl_InstanceID].vertices[hitIndices.x].xyz;
+        const vec3 v2 = Vertices[gl_InstanceID].vertices[hitIndices.y].xyz;
+        const vec3 v3 = Vertices[gl_InstanceID].vertices[hitIndices.z].xyz;
+
+        const vec3 barycentrics = vec3(1.0f - HitAttribs.x - HitAttribs.y, HitAttribs.x, HitAttribs.y);
+
+        surfaceNormal = normal(v1, v2, v3);
+        hitPosition = barycentricToCartesian(v1, v2, v3, barycentrics);
+    }
 
-layout(push_constant) uniform PushConstant {
-    uint maxDepth;
-} pushConstant;
+    // surfaces reflect on the side the ray came from, so direct light is sampled in the same hemisphere
+    surfaceNormal = faceforward(surfaceNormal, gl_WorldRayDirectionEXT, surfaceNormal);
 
-void main() {
-    // get vertices of hit triangle
-    const uvec3 hitIndices = uvec3(
-        Indices[gl_InstanceID].indices[3 * gl_PrimitiveID + 0],
-        Indices[gl_InstanceID].indices[3 * gl_PrimitiveID + 1],
-        Indices[gl_InstanceID].indices[3 * gl_PrimitiveID + 2]
-    );
-    const vec3 v1 = Vertices[gl_InstanceID].vertices[hitIndices.x].xyz;
-    const vec3 v2 = Vertices[gl_InstanceID].vertices[hitIndices.y].xyz;
-    const vec3 v3 = Vertices[gl_InstanceID].vertices[hitIndices.z].xyz;
-
-    const vec3 surfaceNormal = normal(v1, v2, v3);
-
-    const vec3 barycentrics = vec3(1.0f - HitAttribs.x - HitAttribs.y, HitAttribs.x, HitAttribs.y);
-
-    if (payloadIn.depth < pushConstant.maxDepth) {
-        const uint rayFlags = gl_RayFlagsNoneEXT;
-        const uint cullMask = 0xFF;
-        const uint sbtRecordOffset = 0;
-        const uint sbtRecordStride = 0;
-        const uint missIndex = 0;
-        const float tmin = 0.001f;
-        const float tmax = 1000.0f;
-        const int payloadLocation = 0;
-
-        payload.color = vec3(0.0f);
-        payload.depth = payloadIn.depth + 1;
-        payload.rng = payloadIn.rng;
-        rng_next(payload.rng);
-
-        const vec3 origin = barycentricToCartesian(v1, v2, v3, barycentrics);
-
-        if (Materials[gl_InstanceID].materials[gl_PrimitiveID].reflectance.w == 1.0) { // Mirror
-            const vec3 direction = payloadIn.dir - 2 * dot(payloadIn.dir, surfaceNormal) * surfaceNormal;
-            payload.dir = direction;
-
-            traceRayEXT(Scene,
-            rayFlags,
-            cullMask,
-            sbtRecordOffset,
-            sbtRecordStride,
-            missIndex,
-            origin,
-            tmin,
-            direction,
-            tmax,
-            payloadLocation);
-
-            payloadIn.color = Materials[gl_InstanceID].materials[gl_PrimitiveID].reflectance.xyz * payload.color;
-        } else { // Lambertian Reflectance (Diffuse)
-            const vec3 direction = randomVecInHemisphere(payload.rng, surfaceNormal);
-            payload.dir = direction;
-
-            const float p = 1 / (2.0 * PI);
-            const vec3 emittance = Materials[gl_InstanceID].materials[gl_PrimitiveID].emittance.xyz;
-            const float cos_theta = dot(direction, surfaceNormal);
-            const vec3 BDRF = Materials[gl_InstanceID].materials[gl_PrimitiveID].reflectance.xyz / PI;
-
-            traceRayEXT(Scene,
-            rayFlags,
-            cullMask,
-            sbtRecordOffset,
-            sbtRecordStride,
-            missIndex,
-            origin,
-            tmin,
-            direction,
-            tmax,
-            payloadLocation);
-
-            payloadIn.color = emittance + BDRF * payload.color * cos_theta / p;
-        }
+    const Material material = Materials[gl_InstanceID].materials[gl_PrimitiveID];
+
+    rng_next(payloadIn.rng);
+
+    if (sceneHasMirrors && (!sceneHasDiffuse || material.reflectance.w == 1.0)) { // Mirror
+        payloadIn.dir = payloadIn.dir - 2 * dot(payloadIn.dir, surfaceNormal) * surfaceNormal;
+        payloadIn.throughput *= material.reflectance.xyz;
+        payloadIn.specular = true;
+    } else { // Lambertian Reflectance (Diffuse)
+        const vec3 direction = randomVecInHemisphere(payloadIn.rng, surfaceNormal);
+
+        const float p = 1 / (2.0 * PI);
+        const float cos_theta = dot(direction, surfaceNormal);
+        const vec3 BDRF = material.reflectance.xyz / PI;
+
+        if (sceneHasEmitters && payloadIn.countEmission)
+            payloadIn.radiance += payloadIn.throughput * material.emittance.xyz;
+        payloadIn.throughput *= BDRF * cos_theta / p;
+        payloadIn.dir = direction;
+        payloadIn.specular = false;
     }
-}
\ No newline at end of file
+
+    payloadIn.origin = hitPosition;
+    payloadIn.normal = surfaceNormal;
+    payloadIn.albedo = material.reflectance.xyz;
+}
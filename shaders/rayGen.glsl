@@ -1,6 +1,12 @@
 #version 460
 #extension GL_EXT_ray_tracing : require
 #extension GL_GOOGLE_include_directive : require
+#ifdef USE_SER
+#extension GL_NV_shader_invocation_reorder : require
+#endif
+#ifdef DIAGNOSTICS
+#extension GL_ARB_shader_clock : require
+#endif
 
 #include "../shaderStructs.hpp"
 #include "random.glsl"
@@ -11,67 +17,554 @@ layout(set = 0, binding = 1, rgba8) uniform image2D ResultImage;
 layout(set = 0, binding = 2, std140) uniform Params {
     FrameData frameData;
 };
+// Two layers per quantity, layer frameData.frameID.z is written and the other one holds the previous frame.
+// Layer 2 * AOV_* + parity of AccumulationImages holds the running average in xyz and the sample count in w.
+layout(set = 0, binding = 3, rgba32f) uniform image2DArray AccumulationImages;
+layout(set = 0, binding = 4, rgba32f) uniform image2DArray PositionImages; // xyz: first hit, w: 1 if hit
+layout(set = 0, binding = 5, std430) readonly buffer LightNodeBuffer {
+    LightNode nodes[];
+} LightNodes;
+layout(set = 0, binding = 6, std430) readonly buffer LightTriangleBuffer {
+    LightTriangle triangles[];
+} LightTriangles;
+// reservoirs of this and the last frame, see reservoirIndex
+layout(set = 0, binding = 7, std430) buffer ReservoirBuffer {
+    Reservoir reservoirs[];
+} Reservoirs;
+// rgb light splatted per pixel by the light tracing ray generation shader, written before this shader runs
+layout(set = 0, binding = 8, std430) readonly buffer SplatBuffer {
+    float values[];
+} Splats;
+
+#include "lightTree.glsl"
+#include "reservoir.glsl"
+#include "camera.glsl"
 
 layout(location = 0) rayPayloadEXT Payload payload;
+layout(location = 1) rayPayloadEXT bool occluded;
+
+layout(push_constant) uniform PushConstant {
+    PushConstants pushConstant;
+};
+
+// Specialized per scene like the closest hit shader. Without lights no shadow rays are sampled whatever the light
+// sampling mode. A path depth which never changes during the run replaces the push constant, so the path loop has a
+// constant trip count.
+layout(constant_id = 0) const bool sceneHasLights = true;
+layout(constant_id = 1) const uint fixedMaxDepth = 0; // 0: pushConstant.maxDepth
 
-vec3 calcRayDir(vec2 screenUV, float aspect) {
-    vec3 u = frameData.cameraSide.xyz;
-    vec3 v = frameData.cameraUp.xyz;
+// number of occlusion rays per pixel and frame in ambient occlusion mode
+const uint aoSamples = 4;
 
-    const float planeWidth = tan(frameData.cameraNearFarFOV.z * PI / 180 * 0.5f);
+// Reprojected history is limited to this many samples, so view dependent effects like mirror reflections which
+// don't move with the surface fade out quickly.
+const float maxReprojectedSamples = 32.0f;
+// maximum distance between the reprojected and the current first hit relative to the distance to the camera
+const float reprojectionTolerance = 0.02f;
 
-    u *= (planeWidth * aspect);
-    v *= planeWidth;
+#ifdef DIAGNOSTICS
+// per sample cost of the path, accumulated into AOV_DIAGNOSTICS
+float traversalCycles = 0.0f;
+float bounces = 0.0f;
 
-    const vec3 rayDir = normalize(frameData.cameraDir.xyz + (u * screenUV.x) - (v * screenUV.y));
-    return rayDir;
+// clock2x32ARB returns the low and high half of a 64 bit counter
+float elapsedCycles(uvec2 start) {
+    const uvec2 end = clock2x32ARB();
+    const uint low = end.x - start.x;
+    const uint high = end.y - start.y - (end.x < start.x ? 1u : 0u);
+    return float(high) * 4294967296.0f + float(low);
 }
+#endif
 
-void main() {
-    payload.rng = rng_init(gl_LaunchIDEXT.xy + gl_LaunchSizeEXT.xy, frameData.frameID.x);
-    float aspect = float(gl_LaunchSizeEXT.x) / float(gl_LaunchSizeEXT.y);
+// camera of the view this pixel belongs to and the pixels covered by that view, see selectView
+ViewCamera view;
+ivec2 viewOrigin = ivec2(0);
+ivec2 viewSize;
+
+// first hit of the current sample, w is 0 if the primary ray missed
+vec4 primaryHit = vec4(0.0f);
+vec3 primaryAlbedo = vec3(0.0f);
+vec3 primaryNormal = vec3(0.0f);
+
+// called after the closest hit shader has replaced the ray direction, so the primary ray direction is passed in
+void recordPrimaryHit(vec3 rayDir) {
+    primaryHit = vec4(payload.origin, 1.0f);
+    primaryAlbedo = payload.albedo;
+    primaryNormal = faceforward(payload.normal, rayDir, payload.normal);
+}
+
+// Picks the camera of the pixel. Multi-view jobs trace all views in one launch, so their rays share the traversal
+// of the scene. Returns false for pixels of the last grid row which are not covered by a view.
+bool selectView() {
+    const uint viewCount = frameData.views.x;
+    if (viewCount == 0) {
+        view = ViewCamera(frameData.cameraPos, frameData.cameraDir, frameData.cameraUp, frameData.cameraSide,
+                          frameData.cameraNearFarFOV);
+        viewSize = ivec2(gl_LaunchSizeEXT.xy);
+        return true;
+    }
+
+    viewSize = ivec2(frameData.views.zw);
+    const ivec2 tile = ivec2(gl_LaunchIDEXT.xy) / viewSize;
+    const uint viewIndex = tile.y * frameData.views.y + tile.x;
+    viewOrigin = tile * viewSize;
+    view = frameData.viewCameras[min(viewIndex, viewCount - 1)];
+    return viewIndex < viewCount;
+}
+
+#ifdef USE_SER
+// 3 bits for the direction octant and 9 bits for the origin cell in an 8x8x8 grid over the scene
+const uint coherenceHintBits = 12;
+
+// spread the lower 3 bits of v so they can be interleaved into a morton code
+uint spreadBits3(uint v) {
+    return (v & 1u) | ((v & 2u) << 2) | ((v & 4u) << 4);
+}
+
+// Rays starting in the same region of the scene and pointing into the same octant are likely to visit the same
+// acceleration structure nodes. The octant takes the most significant bits as implementations may ignore lower ones.
+uint coherenceHint(vec3 origin, vec3 direction) {
+    const vec3 sceneExtent = max(frameData.sceneMax.xyz - frameData.sceneMin.xyz, vec3(1e-6));
+    const uvec3 cell = uvec3(clamp((origin - frameData.sceneMin.xyz) / sceneExtent * 8.0, vec3(0), vec3(7)));
+    const uint octant = (direction.x < 0 ? 1u : 0u) | (direction.y < 0 ? 2u : 0u) | (direction.z < 0 ? 4u : 0u);
+    const uint morton = spreadBits3(cell.x) | (spreadBits3(cell.y) << 1) | (spreadBits3(cell.z) << 2);
+    return (octant << 9) | morton;
+}
+#endif
+
+// Visibility query which only needs to know whether anything is hit at all. Traversal stops at the first
+// intersection found, no closest hit shader runs and no hit attributes are produced. The shadow miss shader
+// clears the flag if nothing was hit.
+bool isOccluded(vec3 origin, vec3 direction, float tmax) {
+    const uint rayFlags = gl_RayFlagsTerminateOnFirstHitEXT | gl_RayFlagsSkipClosestHitShaderEXT | gl_RayFlagsOpaqueEXT;
+    const uint shadowMissIndex = 1;
+    const int shadowPayloadLocation = 1;
+
+    occluded = true;
+    traceRayEXT(Scene, rayFlags, 0xFF, 0, 0, shadowMissIndex, origin, 0.001f, direction, tmax, shadowPayloadLocation);
+    return occluded;
+}
+
+// surface a light sample is evaluated for, the normal faces the incoming ray
+struct Surface {
+    vec3 position;
+    vec3 normal;
+    vec3 albedo;
+};
+
+// Radiance a diffuse surface reflects from a point on a light triangle, without occlusion and per unit light area.
+// Sets the direction of and the distance to the point.
+vec3 lightContribution(Surface surface, uint lightIndex, vec2 barycentrics, out vec3 direction,
+                       out float lightDistance) {
+    const LightTriangle light = LightTriangles.triangles[lightIndex];
+    const vec3 toLight = lightPoint(light, barycentrics) - surface.position;
+    const float distance2 = dot(toLight, toLight);
+    lightDistance = sqrt(distance2);
+    direction = toLight / lightDistance;
+
+    const vec3 lightNormal = normalize(cross(light.v1.xyz - light.v0.xyz, light.v2.xyz - light.v0.xyz));
+    const float cosSurface = dot(direction, surface.normal);
+    const float cosLight = abs(dot(direction, lightNormal));
+    if (cosSurface <= 0.0f || distance2 <= 0.0f)
+        return vec3(0.0f);
+    return surface.albedo / PI * light.emittance.xyz * cosSurface * cosLight / distance2;
+}
+
+float luminance(vec3 color) {
+    return dot(color, vec3(0.2126f, 0.7152f, 0.0722f));
+}
+
+// shadow ray which stops short of the light, so the light itself doesn't count as occluder
+bool isLightOccluded(vec3 position, vec3 direction, float lightDistance) {
+    return isOccluded(position, direction, lightDistance * 0.999f);
+}
+
+// Next event estimation: radiance reflected towards the ray by a diffuse surface from one point on a light, estimated
+// with a single shadow ray.
+vec3 sampleDirectLight(Surface surface) {
+    const bool spatial = pushConstant.lightSampling == LIGHT_SAMPLING_TREE;
+    uint lightIndex;
+    float pmf;
+    if (!selectLight(surface.position, surface.normal, spatial, payload.rng, lightIndex, pmf))
+        return vec3(0.0f);
+
+    vec3 direction;
+    float lightDistance;
+    const vec3 contribution = lightContribution(surface, lightIndex, sampleTriangle(payload.rng), direction,
+                                                lightDistance);
+    if (contribution == vec3(0.0f) || isLightOccluded(surface.position, direction, lightDistance))
+        return vec3(0.0f);
+
+    // the density of the point is pmf / area
+    return contribution * LightTriangles.triangles[lightIndex].v0.w / pmf;
+}
+
+// pixel a world space position was seen at by the camera of the previous frame, false if it was outside the view
+bool projectToPreviousFrame(vec3 position, out ivec2 pixel) {
+    const ViewCamera previousCamera = ViewCamera(frameData.previousCameraPos, frameData.previousCameraDir,
+                                                 frameData.previousCameraUp, frameData.previousCameraSide,
+                                                 frameData.previousCameraNearFarFOV);
+    // the previous frame may have been traced at a different resolution
+    const vec2 previousSize = vec2(frameData.renderSize.zw);
+    vec2 screenUV;
+    float depth;
+    if (!projectToScreen(previousCamera, position, previousSize.x / previousSize.y, screenUV, depth))
+        return false;
+
+    pixel = ivec2(floor((screenUV * 0.5f + 0.5f) * previousSize));
+    return all(greaterThanEqual(pixel, ivec2(0))) && all(lessThan(pixel, ivec2(frameData.renderSize.zw)));
+}
+
+// number of light candidates a pixel draws per frame
+const uint resamplingCandidates = 16;
+// Reused reservoirs stand for at most this many candidates, so the history can't outweigh new samples forever and
+// adapts to changed lighting.
+const float maxReusedCandidates = 20.0f * float(resamplingCandidates);
+// reservoirs of the last frame reused from random pixels within a radius around the reprojected pixel
+const uint resamplingNeighbors = 4;
+const float resamplingRadius = 30.0f;
+// neighbors only share samples if their surfaces are similar
+const float neighborNormalThreshold = 0.9f;
+const float neighborDepthThreshold = 0.1f;
+
+// reservoir of this pixel for the next frame, stays empty unless the direct light of the primary hit is resampled
+Reservoir pixelReservoir = emptyReservoir();
+
+// reservoirs of the current and the last frame are interleaved, the previous frame may have had another size
+uint reservoirIndex(ivec2 pixel, uint rowLength, uint parity) {
+    return 2u * (uint(pixel.y) * rowLength + uint(pixel.x)) + parity;
+}
+
+// first hit of a pixel of the last frame, false if its primary ray missed
+bool loadPreviousSurface(ivec2 pixel, uint previousParity, out Surface surface) {
+    const vec4 position = imageLoad(PositionImages, ivec3(pixel, previousParity));
+    const vec3 normal = imageLoad(AccumulationImages, ivec3(pixel, 2 * AOV_NORMAL + previousParity)).xyz;
+    if (position.w == 0.0f || dot(normal, normal) == 0.0f)
+        return false;
+
+    surface.position = position.xyz;
+    surface.normal = normalize(normal);
+    surface.albedo = imageLoad(AccumulationImages, ivec3(pixel, 2 * AOV_ALBEDO + previousParity)).xyz;
+    return true;
+}
+
+// target function of the resampling, the unshadowed luminance reflected from a light sample
+float evaluateTarget(Surface surface, uint lightIndex, vec2 barycentrics) {
+    if (lightIndex == ~0u)
+        return 0.0f;
+    vec3 direction;
+    float lightDistance;
+    return luminance(lightContribution(surface, lightIndex, barycentrics, direction, lightDistance));
+}
+
+// Direct light of the primary hit by resampled importance sampling. Candidates from the light sampling strategy are
+// resampled by their unshadowed contribution, then the reservoir of the same surface in the last frame and those of
+// a few similar neighbors are merged in.
+vec3 resampleDirectLight(Surface surface) {
+    const bool spatial = pushConstant.lightSampling == LIGHT_SAMPLING_TREE;
+    Reservoir reservoir = emptyReservoir();
+    for (uint i = 0; i < resamplingCandidates; ++i) {
+        uint lightIndex;
+        float pmf;
+        if (!selectLight(surface.position, surface.normal, spatial, payload.rng, lightIndex, pmf))
+            continue;
+        const vec2 barycentrics = sampleTriangle(payload.rng);
+        const float target = evaluateTarget(surface, lightIndex, barycentrics);
+        const float area = LightTriangles.triangles[lightIndex].v0.w;
+        updateReservoir(reservoir, lightIndex, barycentrics, target, target * area / pmf, next_float(payload.rng));
+    }
+    reservoir.candidates = float(resamplingCandidates);
+    reservoir.contributionWeight = reservoir.targetPdf > 0.0f
+            ? reservoir.weightSum / (reservoir.candidates * reservoir.targetPdf) : 0.0f;
+
+    // Occluded samples are dropped before they are shared, so neighbors don't keep resampling a light which is
+    // blocked. The shading below would discard them anyway.
+    vec3 direction;
+    float lightDistance;
+    if (reservoir.light != ~0u) {
+        lightContribution(surface, reservoir.light, reservoir.barycentrics, direction, lightDistance);
+        if (isLightOccluded(surface.position, direction, lightDistance))
+            reservoir.contributionWeight = 0.0f;
+    }
+
+    // reservoirs which took part, to normalize the result by those which could have produced the sample
+    Surface sources[2 + resamplingNeighbors];
+    float sourceCandidates[2 + resamplingNeighbors];
+    uint sourceCount = 0;
+
+    Reservoir combined = emptyReservoir();
+    mergeReservoir(combined, reservoir, reservoir.targetPdf, next_float(payload.rng));
+    sources[sourceCount] = surface;
+    sourceCandidates[sourceCount++] = reservoir.candidates;
+
+    // The last frame is only reused if its reservoirs were written with the same settings and the surface was in its
+    // view. Its neighbors are looked up around where the surface was seen.
+    ivec2 previousPixel = ivec2(gl_LaunchIDEXT.xy);
+    if (frameData.frameID.x > 0 &&
+        (frameData.frameID.y == 0 || projectToPreviousFrame(surface.position, previousPixel))) {
+        const uint previousParity = frameData.frameID.z ^ 1u;
+        const uint previousRowLength = frameData.renderSize.z;
+        const float depth = distance(surface.position, view.position.xyz);
+
+        // temporal reuse from the same surface
+        Surface previous;
+        if (loadPreviousSurface(previousPixel, previousParity, previous) &&
+            distance(previous.position, surface.position) <= reprojectionTolerance * depth) {
+            Reservoir history = Reservoirs.reservoirs[reservoirIndex(previousPixel, previousRowLength, previousParity)];
+            history.candidates = min(history.candidates, maxReusedCandidates);
+            mergeReservoir(combined, history, evaluateTarget(surface, history.light, history.barycentrics),
+                           next_float(payload.rng));
+            sources[sourceCount] = previous;
+            sourceCandidates[sourceCount++] = history.candidates;
+        }
+
+        // spatial reuse from similar surfaces nearby
+        for (uint i = 0; i < resamplingNeighbors; ++i) {
+            const vec2 offset = (vec2(next_float(payload.rng), next_float(payload.rng)) * 2.0f - 1.0f) *
+                                resamplingRadius;
+            const ivec2 neighborPixel = previousPixel + ivec2(offset);
+            if (any(lessThan(neighborPixel, ivec2(0))) ||
+                any(greaterThanEqual(neighborPixel, ivec2(frameData.renderSize.zw))) || neighborPixel == previousPixel ||
+                (frameData.views.x > 0 && (any(lessThan(neighborPixel, viewOrigin)) ||
+                                           any(greaterThanEqual(neighborPixel, viewOrigin + viewSize)))))
+                continue;
+
+            Surface neighbor;
+            if (!loadPreviousSurface(neighborPixel, previousParity, neighbor) ||
+                dot(neighbor.normal, surface.normal) < neighborNormalThreshold ||
+                abs(distance(neighbor.position, view.position.xyz) - depth) > neighborDepthThreshold * depth)
+                continue;
+
+            Reservoir neighborReservoir =
+                    Reservoirs.reservoirs[reservoirIndex(neighborPixel, previousRowLength, previousParity)];
+            neighborReservoir.candidates = min(neighborReservoir.candidates, maxReusedCandidates);
+            mergeReservoir(combined, neighborReservoir,
+                           evaluateTarget(surface, neighborReservoir.light, neighborReservoir.barycentrics),
+                           next_float(payload.rng));
+            sources[sourceCount] = neighbor;
+            sourceCandidates[sourceCount++] = neighborReservoir.candidates;
+        }
+    }
+
+    // Without correction the sum of the weights is divided by all candidates, including those of pixels which could
+    // never have picked the sample because it lies behind them or is occluded from there.
+    float normalization = combined.candidates;
+    if (pushConstant.resampling != RESAMPLING_BIASED && combined.light != ~0u) {
+        normalization = sourceCandidates[0];
+        for (uint i = 1; i < sourceCount; ++i) {
+            vec3 sourceDirection;
+            float sourceDistance;
+            const vec3 contribution = lightContribution(sources[i], combined.light, combined.barycentrics,
+                                                        sourceDirection, sourceDistance);
+            if (luminance(contribution) <= 0.0f)
+                continue;
+            if (pushConstant.resampling == RESAMPLING_UNBIASED &&
+                isLightOccluded(sources[i].position, sourceDirection, sourceDistance))
+                continue;
+            normalization += sourceCandidates[i];
+        }
+    }
+    combined.contributionWeight = combined.targetPdf > 0.0f
+            ? combined.weightSum / (normalization * combined.targetPdf) : 0.0f;
+    pixelReservoir = combined;
+
+    if (combined.contributionWeight == 0.0f)
+        return vec3(0.0f);
+    const vec3 contribution = lightContribution(surface, combined.light, combined.barycentrics, direction,
+                                                lightDistance);
+    if (isLightOccluded(surface.position, direction, lightDistance))
+        return vec3(0.0f);
+    return contribution * combined.contributionWeight;
+}
 
+vec3 tracePath(float tmin, float tmax) {
+#ifdef DIAGNOSTICS
+    // geometry is opaque, without this flag the any hit shader which counts candidate hits would be skipped
+    const uint rayFlags = gl_RayFlagsNoOpaqueEXT;
+#else
     const uint rayFlags = gl_RayFlagsNoneEXT;
+#endif
     const uint cullMask = 0xFF;
     const uint sbtRecordOffset = 0;
     const uint sbtRecordStride = 0;
     const uint missIndex = 0;
-    const float tmin = frameData.cameraNearFarFOV.x;
-    const float tmax = frameData.cameraNearFarFOV.y;
     const int payloadLocation = 0;
 
+    bool primaryDiffuse = false; // first hit reflected the ray diffusely
+    const uint maxDepth = fixedMaxDepth > 0 ? fixedMaxDepth : pushConstant.maxDepth;
+
+    // trace the path one bounce at a time, closest hit shader writes the next ray into the payload
+    for (uint depth = 0; depth < maxDepth && !payload.done; ++depth) {
+#ifdef USE_SER
+        // after the first bounce rays point in random directions, so threads are regrouped by where their rays
+        // start and point to before traversal to keep acceleration structure accesses coherent
+        if (depth > 0)
+            reorderThreadNV(coherenceHint(payload.origin, payload.dir), coherenceHintBits);
+#endif
+        const vec3 rayDir = payload.dir;
+        const vec3 throughput = payload.throughput; // up to the hit, the closest hit shader includes its reflectance
+#ifdef DIAGNOSTICS
+        const uvec2 clockStart = clock2x32ARB();
+#endif
+        traceRayEXT(Scene,
+        rayFlags,
+        cullMask,
+        sbtRecordOffset,
+        sbtRecordStride,
+        missIndex,
+        payload.origin,
+        tmin,
+        payload.dir,
+        tmax,
+        payloadLocation);
+#ifdef DIAGNOSTICS
+        // includes the hit or miss shader, which is cheap compared to traversal
+        traversalCycles += elapsedCycles(clockStart);
+        bounces += 1.0f;
+#endif
+
+        if (depth == 0 && !payload.done)
+            recordPrimaryHit(rayDir);
+
+        // Emitters reached by a ray leaving a diffuse surface were already accounted for by the shadow ray. The last
+        // hit samples no light, so paths have the same maximum length with and without light sampling.
+        const bool sampleLights = sceneHasLights && pushConstant.lightSampling != LIGHT_SAMPLING_OFF;
+        if (sampleLights && !payload.done && !payload.specular && depth + 1 < maxDepth) {
+            const Surface surface = Surface(payload.origin, payload.normal, payload.albedo);
+            const bool resample = depth == 0 && pushConstant.resampling != RESAMPLING_OFF;
+            payload.radiance += throughput * (resample ? resampleDirectLight(surface) : sampleDirectLight(surface));
+        }
+        // Light which reaches a diffuse primary hit through mirrors is left to the light tracing pass, which finds
+        // these caustics far more often. Every path is counted by exactly one of the two passes.
+        if (depth == 0 && !payload.done)
+            primaryDiffuse = !payload.specular;
+        payload.countEmission = payload.specular ? !(pushConstant.lightTracing != 0 && primaryDiffuse) : !sampleLights;
+
+        tmin = 0.001f;
+        tmax = 1000.0f;
+    }
+
+    return payload.radiance;
+}
+
+// fraction of the hemisphere around the primary hit which is unoccluded within a radius relative to the scene size
+vec3 ambientOcclusion(float tmin, float tmax) {
+    const vec3 rayDir = payload.dir;
+    traceRayEXT(Scene, gl_RayFlagsNoneEXT, 0xFF, 0, 0, 0, payload.origin, tmin, rayDir, tmax, 0);
+    if (payload.done)
+        return vec3(0.0f);
+
+    recordPrimaryHit(rayDir);
+    primaryAlbedo = vec3(1.0f); // occlusion is not modulated by the surface color
+    const vec3 normal = primaryNormal;
+
+    const float radius = 0.1f * length(frameData.sceneMax.xyz - frameData.sceneMin.xyz);
+
+    // cosine weighted estimate with uniform hemisphere samples
+    float visibility = 0.0f;
+    for (uint i = 0; i < aoSamples; ++i) {
+        rng_next(payload.rng); // randomVecInHemisphere takes the generator by value
+        const vec3 direction = randomVecInHemisphere(payload.rng, normal);
+        if (!isOccluded(payload.origin, direction, radius))
+            visibility += 2.0f * dot(direction, normal);
+    }
+
+    return vec3(visibility / float(aoSamples));
+}
+
+// Pixel of the previous frame which holds the accumulated samples of the surface seen by this pixel, returns how
+// many of its samples are reused. After camera movement the first hit is projected into the previous view, history
+// of pixels which were disoccluded or off screen is rejected by comparing against the first hit stored there.
+float findHistory(uint previousParity, out ivec2 historyPixel) {
+    historyPixel = ivec2(gl_LaunchIDEXT.xy);
+    if (frameData.frameID.x == 0)
+        return 0.0f;
+    if (frameData.frameID.y == 0)
+        return imageLoad(AccumulationImages, ivec3(historyPixel, 2 * AOV_COLOR + previousParity)).w;
+
+    // rays which left the scene have no position to reproject, their contribution is cheap to recompute
+    if (primaryHit.w == 0.0f || !projectToPreviousFrame(primaryHit.xyz, historyPixel))
+        return 0.0f;
+
+    const vec4 previousHit = imageLoad(PositionImages, ivec3(historyPixel, previousParity));
+    const float tolerance = reprojectionTolerance * distance(primaryHit.xyz, view.position.xyz);
+    if (previousHit.w == 0.0f || distance(previousHit.xyz, primaryHit.xyz) > tolerance)
+        return 0.0f;
+
+    const ivec3 historyTexel = ivec3(historyPixel, 2 * AOV_COLOR + previousParity);
+    return min(imageLoad(AccumulationImages, historyTexel).w, maxReprojectedSamples);
+}
+
+// add a sample to the running average of one accumulated quantity
+vec3 accumulate(uint aov, vec3 value, ivec2 historyPixel, float historySamples) {
+    const uint currentParity = frameData.frameID.z;
+    const uint previousParity = currentParity ^ 1u;
+
+    const vec3 history = historySamples > 0.0f
+            ? imageLoad(AccumulationImages, ivec3(historyPixel, 2 * aov + previousParity)).xyz : vec3(0.0f);
+    const vec3 average = (history * historySamples + value) / (historySamples + 1.0f);
+
+    imageStore(AccumulationImages, ivec3(gl_LaunchIDEXT.xy, 2 * aov + currentParity),
+               vec4(average, historySamples + 1.0f));
+    return average;
+}
+
+void main() {
+    payload.rng = rng_init(gl_LaunchIDEXT.xy + gl_LaunchSizeEXT.xy, frameData.frameID.x);
+    if (!selectView()) {
+        // nothing is accumulated here, so the noise estimate skips these pixels
+        for (uint layer = 0; layer < 2 * AOV_COUNT; ++layer)
+            imageStore(AccumulationImages, ivec3(gl_LaunchIDEXT.xy, layer), vec4(0.0f));
+        imageStore(ResultImage, ivec2(gl_LaunchIDEXT.xy), vec4(0.0f, 0.0f, 0.0f, 1.0f));
+        return;
+    }
+    float aspect = float(viewSize.x) / float(viewSize.y);
+
     const vec2 jitter = 0.5 * (randomGaussian(payload.rng) + 1);
-    const vec2 target = (gl_LaunchIDEXT.xy + jitter) / gl_LaunchSizeEXT.xy * 2.0 - 1.0;
-    const vec3 origin = frameData.cameraPos.xyz;
+    const vec2 target = (vec2(ivec2(gl_LaunchIDEXT.xy) - viewOrigin) + jitter) / vec2(viewSize) * 2.0 - 1.0;
     //const vec3 direction = vec3(target.x * aspect, target.y, 1) * cameraDir.xyz;
-    const vec3 direction = calcRayDir(target, aspect);
-
-    payload.color = vec3(0.0f);
-    payload.depth = 0;
-    payload.dir = direction;
-
-    traceRayEXT(Scene,
-    rayFlags,
-    cullMask,
-    sbtRecordOffset,
-    sbtRecordStride,
-    missIndex,
-    origin,
-    tmin,
-    direction.xyz,
-    tmax,
-    payloadLocation);
-
-    if (frameData.frameID.x == 0) {
-        vec3 resultColor = pow(payload.color, vec3(1.0 / 2.2)); // convert to linear
-        imageStore(ResultImage, ivec2(gl_LaunchIDEXT.xy), vec4(resultColor, 1));
-    } else { // calculate running average
-        vec3 previousColor = imageLoad(ResultImage, ivec2(gl_LaunchIDEXT.xy)).xyz;
-        previousColor = pow(previousColor, vec3(2.2)); // perform calculation in sRGB
-
-        vec3 resultColor = ((float(frameData.frameID.x) * previousColor + payload.color) / float(frameData.frameID.x+1));
-        resultColor = pow(resultColor, vec3(1.0 / 2.2)); // convert to linear
-
-        imageStore(ResultImage, ivec2(gl_LaunchIDEXT.xy), vec4(resultColor, 1));
+
+    payload.origin = view.position.xyz;
+    payload.dir = cameraRayDir(view, target, aspect);
+    payload.throughput = vec3(1.0f);
+    payload.radiance = vec3(0.0f);
+    payload.done = false;
+    payload.specular = false;
+    payload.countEmission = true;
+    payload.intersections = 0;
+
+    // primary rays are clipped by the camera planes, secondary rays start just off the surface
+    const float tmin = view.nearFarFOV.x;
+    const float tmax = view.nearFarFOV.y;
+
+    vec3 radiance = pushConstant.renderMode == RENDER_MODE_AMBIENT_OCCLUSION ? ambientOcclusion(tmin, tmax)
+                                                                             : tracePath(tmin, tmax);
+    if (pushConstant.lightTracing != 0) {
+        const uint splatIndex = 3u * (gl_LaunchIDEXT.y * gl_LaunchSizeEXT.x + gl_LaunchIDEXT.x);
+        radiance += vec3(Splats.values[splatIndex], Splats.values[splatIndex + 1], Splats.values[splatIndex + 2]);
     }
-}
+
+    const uint currentParity = frameData.frameID.z;
+    const uint previousParity = currentParity ^ 1u;
+    const ivec2 pixel = ivec2(gl_LaunchIDEXT.xy);
+
+    // running averages seeded with the (reprojected) history
+    ivec2 historyPixel;
+    const float historySamples = findHistory(previousParity, historyPixel);
+    const vec3 average = accumulate(AOV_COLOR, radiance, historyPixel, historySamples);
+    accumulate(AOV_ALBEDO, primaryAlbedo, historyPixel, historySamples);
+    accumulate(AOV_NORMAL, primaryNormal, historyPixel, historySamples);
+    const float pixelLuminance = luminance(radiance);
+    accumulate(AOV_MOMENTS, vec3(pixelLuminance, pixelLuminance * pixelLuminance, 0.0f), historyPixel, historySamples);
+#ifdef DIAGNOSTICS
+    accumulate(AOV_DIAGNOSTICS, vec3(traversalCycles, float(payload.intersections), bounces), historyPixel,
+               historySamples);
+#endif
+
+    imageStore(PositionImages, ivec3(pixel, currentParity), primaryHit);
+    if (pushConstant.resampling != RESAMPLING_OFF)
+        Reservoirs.reservoirs[reservoirIndex(pixel, frameData.renderSize.x, currentParity)] = pixelReservoir;
+
+    vec3 resultColor = pow(average, vec3(1.0 / 2.2)); // convert to linear
+    imageStore(ResultImage, pixel, vec4(resultColor, 1));
+}
\ No newline at end of file
@@ -0,0 +1,147 @@
+#version 460
+#extension GL_EXT_ray_tracing : require
+#extension GL_GOOGLE_include_directive : require
+#ifdef ATOMIC_FLOAT
+#extension GL_EXT_shader_atomic_float : require
+#endif
+
+#include "../shaderStructs.hpp"
+#include "random.glsl"
+#include "camera.glsl"
+
+// Light tracing: paths start at a light and every diffuse vertex is connected to the camera, the contribution is
+// splatted into whichever pixel the vertex is seen in. Only paths which leave the light through a mirror are traced
+// further than the first hit, these are caustics which camera paths hardly ever find as they can't sample lights
+// through mirrors. The camera paths skip exactly these paths, so adding both images doesn't count any light twice.
+
+layout(set = 0, binding = 0) uniform accelerationStructureEXT Scene;
+layout(set = 0, binding = 2, std140) uniform Params {
+    FrameData frameData;
+};
+layout(set = 0, binding = 5, std430) readonly buffer LightNodeBuffer {
+    LightNode nodes[];
+} LightNodes;
+layout(set = 0, binding = 6, std430) readonly buffer LightTriangleBuffer {
+    LightTriangle triangles[];
+} LightTriangles;
+// rgb sums of the splatted contributions of this frame per traced pixel, cleared before every frame
+layout(set = 0, binding = 8, std430) buffer SplatBuffer {
+#ifdef ATOMIC_FLOAT
+    float values[];
+#else
+    uint values[];
+#endif
+} Splats;
+
+#include "lightTree.glsl"
+
+layout(location = 0) rayPayloadEXT Payload payload;
+layout(location = 1) rayPayloadEXT bool occluded;
+
+layout(push_constant) uniform PushConstant {
+    PushConstants pushConstant;
+};
+
+// Lock-free accumulation of one channel. Without float atomics the sum is updated with a compare and swap loop on
+// its bit pattern, which only retries while another thread splats into the same pixel.
+void splat(uint index, float value) {
+#ifdef ATOMIC_FLOAT
+    atomicAdd(Splats.values[index], value);
+#else
+    uint expected = Splats.values[index];
+    while (true) {
+        const uint previous = atomicCompSwap(Splats.values[index], expected,
+                                             floatBitsToUint(uintBitsToFloat(expected) + value));
+        if (previous == expected)
+            break;
+        expected = previous;
+    }
+#endif
+}
+
+// same visibility query as in the camera ray generation shader
+bool isOccluded(vec3 origin, vec3 direction, float tmax) {
+    const uint rayFlags = gl_RayFlagsTerminateOnFirstHitEXT | gl_RayFlagsSkipClosestHitShaderEXT | gl_RayFlagsOpaqueEXT;
+    occluded = true;
+    traceRayEXT(Scene, rayFlags, 0xFF, 0, 0, 1, origin, 0.001f, direction, tmax, 1);
+    return occluded;
+}
+
+// Adds the light a diffuse vertex reflects towards the camera to the pixel it is seen in. throughput holds the light
+// arriving at the vertex divided by the density of the light path.
+void connectToCamera(vec3 position, vec3 normal, vec3 albedo, vec3 throughput) {
+    const vec3 toCamera = frameData.cameraPos.xyz - position;
+    const float distance2 = dot(toCamera, toCamera);
+    const vec3 direction = toCamera * inversesqrt(distance2);
+    const float cosSurface = dot(direction, normal);
+    const float cosCamera = -dot(direction, frameData.cameraDir.xyz);
+    if (cosSurface <= 0.0f || cosCamera <= 0.0f)
+        return;
+
+    const ViewCamera camera = ViewCamera(frameData.cameraPos, frameData.cameraDir, frameData.cameraUp,
+                                         frameData.cameraSide, frameData.cameraNearFarFOV);
+    const vec2 size = vec2(frameData.renderSize.xy);
+    const float aspect = size.x / size.y;
+    vec2 screenUV;
+    float depth;
+    if (!projectToScreen(camera, position, aspect, screenUV, depth) ||
+        depth < camera.nearFarFOV.x || depth > camera.nearFarFOV.y)
+        return;
+    const ivec2 pixel = ivec2(floor((screenUV * 0.5f + 0.5f) * size));
+    if (any(lessThan(pixel, ivec2(0))) || any(greaterThanEqual(pixel, ivec2(frameData.renderSize.xy))))
+        return;
+
+    if (isOccluded(position, direction, sqrt(distance2)))
+        return;
+
+    // Importance of a pinhole camera whose image plane at distance 1 has the area filmArea. With one light path per
+    // pixel the per pixel normalization and the number of light paths cancel.
+    const float planeWidth = imagePlaneWidth(camera);
+    const float filmArea = 4.0f * planeWidth * planeWidth * aspect;
+    const float importance = 1.0f / (filmArea * cosCamera * cosCamera * cosCamera * cosCamera);
+    const vec3 contribution = throughput * albedo / PI * cosSurface * importance * cosCamera / distance2;
+
+    const uint index = 3u * (uint(pixel.y) * frameData.renderSize.x + uint(pixel.x));
+    splat(index + 0, contribution.r);
+    splat(index + 1, contribution.g);
+    splat(index + 2, contribution.b);
+}
+
+void main() {
+    // seeded apart from the camera paths of the same pixel
+    payload.rng = rng_init(gl_LaunchIDEXT.xy + 2 * gl_LaunchSizeEXT.xy, frameData.frameID.x);
+
+    // lights are picked by power alone, there is no shading point yet
+    uint lightIndex;
+    float pmf;
+    if (!selectLight(vec3(0.0f), vec3(0.0f), false, payload.rng, lightIndex, pmf))
+        return;
+    const LightTriangle light = LightTriangles.triangles[lightIndex];
+    const vec3 origin = lightPoint(light, sampleTriangle(payload.rng));
+
+    // lights emit on both sides, each is chosen with probability 1 / 2 and sampled proportional to the cosine
+    vec3 lightNormal = normalize(cross(light.v1.xyz - light.v0.xyz, light.v2.xyz - light.v0.xyz));
+    if (next_float(payload.rng) < 0.5f)
+        lightNormal = -lightNormal;
+
+    payload.origin = origin;
+    payload.dir = randomCosineDirection(payload.rng, lightNormal);
+    payload.throughput = 2.0f * PI * light.emittance.xyz * light.v0.w / pmf;
+    payload.radiance = vec3(0.0f);
+    payload.done = false;
+    payload.specular = false;
+    payload.countEmission = false;
+    payload.intersections = 0;
+
+    // A vertex at depth d connects to the camera with a path of d + 2 hits as seen from the camera, which has to stay
+    // within the maximum depth of camera paths.
+    for (uint depth = 0; depth + 2 <= pushConstant.maxDepth && !payload.done; ++depth) {
+        const vec3 throughput = payload.throughput;
+        traceRayEXT(Scene, gl_RayFlagsNoneEXT, 0xFF, 0, 0, 0, payload.origin, 0.001f, payload.dir, 1000.0f, 0);
+        if (payload.done || (depth == 0 && !payload.specular))
+            break;
+
+        if (!payload.specular)
+            connectToCamera(payload.origin, payload.normal, payload.albedo, throughput);
+    }
+}
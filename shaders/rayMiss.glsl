@@ -7,5 +7,5 @@
 rayPayloadInEXT Payload payloadIn;
 
 void main() {
-    payloadIn.color = vec3(0);
+    payloadIn.done = true;
 }
\ No newline at end of file
@@ -0,0 +1,9 @@
+#version 460
+#extension GL_EXT_ray_tracing : require
+
+// only invoked for visibility queries, which skip the closest hit shader and stop at the first hit
+layout(location = 1) rayPayloadInEXT bool occluded;
+
+void main() {
+    occluded = false;
+}
\ No newline at end of file
@@ -0,0 +1,39 @@
+#ifndef RESERVOIR_GLSL
+#define RESERVOIR_GLSL
+
+// Weighted reservoir sampling: a stream of candidates is reduced to one, which is kept with probability proportional
+// to its resampling weight, without storing the others.
+
+Reservoir emptyReservoir() {
+    Reservoir reservoir;
+    reservoir.barycentrics = vec2(0.0f);
+    reservoir.light = ~0u;
+    reservoir.targetPdf = 0.0f;
+    reservoir.weightSum = 0.0f;
+    reservoir.candidates = 0.0f;
+    reservoir.contributionWeight = 0.0f;
+    reservoir.padding = 0.0f;
+    return reservoir;
+}
+
+// offers one candidate, u is uniformly distributed in [0, 1], returns true if the candidate replaced the sample
+bool updateReservoir(inout Reservoir reservoir, uint light, vec2 barycentrics, float targetPdf, float weight, float u) {
+    reservoir.weightSum += weight;
+    if (weight <= 0.0f || u * reservoir.weightSum > weight)
+        return false;
+
+    reservoir.light = light;
+    reservoir.barycentrics = barycentrics;
+    reservoir.targetPdf = targetPdf;
+    return true;
+}
+
+// Offers the sample of another reservoir as a candidate which stands for all candidates the other one has seen.
+// targetPdf is the target function of that sample evaluated for the surface of this reservoir.
+bool mergeReservoir(inout Reservoir reservoir, Reservoir other, float targetPdf, float u) {
+    reservoir.candidates += other.candidates;
+    return updateReservoir(reservoir, other.light, other.barycentrics, targetPdf,
+                           targetPdf * other.contributionWeight * other.candidates, u);
+}
+
+#endif // RESERVOIR_GLSL